@@ -0,0 +1,46 @@
+cmake_minimum_required(VERSION 3.16)
+
+# Fails if any of FILES reference heap allocation, exceptions, RTTI or the guards of thread safe statics.
+#
+# Usage: cmake -DNM=<nm> -DFILES=<file;...> -P hsm_freestanding_check.cmake
+#
+# Note: operator delete is allowed, it is referenced by the deleting destructors of classes with a virtual
+# destructor but never called when no object is allocated on the heap.
+
+set(FORBIDDEN
+	"_Znwm" "_Znam" "_Znwj" "_Znaj"                       # operator new
+	"malloc" "calloc" "realloc"
+	"__cxa_throw" "__cxa_allocate_exception" "__cxa_begin_catch" "__gxx_personality_v0"
+	"__dynamic_cast"
+	"__cxa_guard_acquire" "__cxa_guard_release" "__cxa_guard_abort"  # -fno-threadsafe-statics
+)
+# Any typeinfo
+set(FORBIDDEN_PREFIXES "_ZTI" "_ZTS")
+
+set(failed FALSE)
+foreach(file ${FILES})
+	execute_process(COMMAND ${NM} -u ${file} OUTPUT_VARIABLE undefined RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "${NM} failed on ${file}")
+	endif()
+	execute_process(COMMAND ${NM} --defined-only ${file} OUTPUT_VARIABLE defined)
+	set(symbols "${undefined}\n${defined}")
+
+	foreach(symbol ${FORBIDDEN})
+		if(symbols MATCHES "[ \n]${symbol}\n")
+			message(SEND_ERROR "${file}: references ${symbol}")
+			set(failed TRUE)
+		endif()
+	endforeach()
+	foreach(prefix ${FORBIDDEN_PREFIXES})
+		if(symbols MATCHES "[ \n](${prefix}[^\n]*)")
+			message(SEND_ERROR "${file}: references ${CMAKE_MATCH_1}")
+			set(failed TRUE)
+		endif()
+	endforeach()
+endforeach()
+
+if(failed)
+	message(FATAL_ERROR "Freestanding check failed")
+endif()
+message(STATUS "Freestanding check passed")
@@ -0,0 +1,68 @@
+cmake_minimum_required(VERSION 3.16)
+
+# Prints the footprint of the freestanding profile:
+#  - .text/.data/.bss of each object of the library and the pump example
+#  - code and vtables of each state class of the pump example
+#  - sizeof the states and the machine, i.e. RAM per machine
+#
+# Usage: cmake -DNM=<nm> -DSIZE=<size> -DLIBRARY=<objects> -DEXAMPLE=<objects> -DSIZEOF=<program> -P hsm_size_report.cmake
+
+function(section_sizes file)
+	execute_process(COMMAND ${SIZE} -A ${file} OUTPUT_VARIABLE output)
+	set(text 0)
+	set(data 0)
+	set(bss 0)
+	string(REPLACE "\n" ";" lines "${output}")
+	foreach(line ${lines})
+		if(line MATCHES "^(\\.[a-zA-Z0-9_.]+) +([0-9]+)")
+			set(section ${CMAKE_MATCH_1})
+			set(bytes ${CMAKE_MATCH_2})
+			if(section MATCHES "^\\.(text|rodata)")
+				math(EXPR text "${text} + ${bytes}")
+			elseif(section MATCHES "^\\.(data|init_array)")
+				math(EXPR data "${data} + ${bytes}")
+			elseif(section MATCHES "^\\.bss")
+				math(EXPR bss "${bss} + ${bytes}")
+			endif()
+		endif()
+	endforeach()
+	get_filename_component(name ${file} NAME)
+	message("  ${name}: .text ${text}  .data ${data}  .bss ${bss}")
+endfunction()
+
+message("Objects (.text includes .rodata, .data includes .data.rel.ro):")
+foreach(file ${LIBRARY} ${EXAMPLE})
+	section_sizes(${file})
+endforeach()
+
+# Sum the symbols of each state class, including its vtable
+message("States of the pump example (.text/.data per state):")
+set(states "")
+foreach(file ${EXAMPLE})
+	execute_process(COMMAND ${NM} -S -C --defined-only ${file} OUTPUT_VARIABLE output)
+	string(REPLACE "\n" ";" lines "${output}")
+	foreach(line ${lines})
+		if(line MATCHES "^[0-9a-f]+ ([0-9a-f]+) ([A-Za-z]) (vtable for )?PumpControl::(State[A-Za-z]+|PumpControlHsmState)(::|$)")
+			set(state ${CMAKE_MATCH_4})
+			math(EXPR bytes "0x${CMAKE_MATCH_1}")
+			if(CMAKE_MATCH_2 MATCHES "[tTwW]")
+				set(kind text)
+			else()
+				set(kind data)
+			endif()
+			if(NOT state IN_LIST states)
+				list(APPEND states ${state})
+				set(${state}_text 0)
+				set(${state}_data 0)
+			endif()
+			math(EXPR ${state}_${kind} "${${state}_${kind}} + ${bytes}")
+		endif()
+	endforeach()
+endforeach()
+list(SORT states)
+foreach(state ${states})
+	message("  ${state}: .text ${${state}_text}  .data ${${state}_data}")
+endforeach()
+
+message("RAM per machine:")
+execute_process(COMMAND ${SIZEOF})
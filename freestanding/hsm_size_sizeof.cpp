@@ -0,0 +1,45 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pump_control_hsm.h"
+
+#include <cstdio>
+
+//!
+// Prints the RAM used by the states and a machine of the pump example, for the size report
+//
+
+using namespace PumpControl;
+
+int main() {
+  std::printf("  HsmStateBase: %zu\n", sizeof(hsp::HsmStateBase));
+  std::printf("  HsmBase: %zu\n", sizeof(hsp::HsmBase));
+  std::printf("  PumpControlHsmState: %zu\n", sizeof(PumpControlHsmState));
+  std::printf("  StateTop: %zu\n", sizeof(StateTop));
+  std::printf("  StateStandby: %zu\n", sizeof(StateStandby));
+  std::printf("  StateContinuous: %zu\n", sizeof(StateContinuous));
+  std::printf("  StatePulsing: %zu\n", sizeof(StatePulsing));
+  std::printf("  StateRunning: %zu\n", sizeof(StateRunning));
+  std::printf("  StatePaused: %zu\n", sizeof(StatePaused));
+  std::printf("  PumpControlHsm: %zu\n", sizeof(PumpControlHsm));
+  return 0;
+}
@@ -19,35 +19,96 @@
 // LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
-
 #pragma once
 
+#include <hsm_event_type.h>
 #include <hsm_state.h>
 
+#include <cassert>
+#include <memory>
 #include <type_traits>
 
 namespace hsp {
 
+class HsmFlightRecorder;
+class HsmMetrics;
+class HsmPayloadArena;
+class HsmWatchdogSlot;
+struct HsmEventType;
+
+// The callbacks of states are timed for the CPU time of the metrics and for the watchdog
+#if defined(HSM_METRICS) || defined(HSM_WATCHDOG)
+#define HSM_CALLBACK_TIMING
+#endif
+
+/*!
+ * Default policy of Hsm. A policy is a compile time observer of the machine, e.g. for tracing or
+ * logging. The hooks are called without virtual calls, so the empty hooks of this policy compile to
+ * nothing. Own policies derive from HsmNoPolicy and hide the hooks they need.
+ */
+struct HsmNoPolicy {
+  //! Before event is offered to the current state
+  template <typename EVENT> void onDispatch(const HsmStateBase & /*currentState*/, const EVENT & /*event*/) {}
+  //! When the event is done, including the transition. state handled the event, nullptr if unhandled.
+  void onHandled(const HsmStateBase * /*state*/) {}
+  //! After state.onExit()
+  void onExit(const HsmStateBase & /*state*/) {}
+  //! After state.onEnter()
+  void onEnter(const HsmStateBase & /*state*/) {}
+  //! After state.onInit()
+  void onInit(const HsmStateBase & /*state*/) {}
+  //! After a transition taken by an event, currentState is the new leaf state
+  void onTransitionComplete(const HsmStateBase & /*currentState*/) {}
+};
+
 //! Base class for hierarchical state machines
 class HsmBase {
+  friend class HsmWatchdog;
+
 public:
   explicit HsmBase(HsmStateBase &topHsmState);
 
-  //! Start the state machine
+  //! Start the state machine without the hooks of its policy. Hsm::onStart() hides this with the hooks.
   // Note: Call this before any calls onEvent().
-  // Note: Call this only ones
   void onStart();
 
-  // FIXME make a onStop()
+  //! Stop the state machine without the hooks of its policy. Hsm::onStop() hides this with the hooks.
+  // Note: The machine could be started again with onStart(), which will use the history.
+  void onStop();
+
+  //! Clear the history of all states, so the machine starts as new on next onStart().
+  // Note: Must only be called on a stopped machine.
+  void reset();
+
+  //! True between onStart() and onStop()
+  bool isStarted() const { return currentState != nullptr; }
+
+  //! Record events and transitions of the machine in recorder, identified by machine. nullptr to detach.
+  void setFlightRecorder(HsmFlightRecorder *recorder, uint32_t machine = 0) {
+    flightRecorder = recorder;
+    traceMachine = machine;
+  }
+
+#ifdef HSM_METRICS
+  //! Collect dwell time, dispatch latency etc. of the machine in metrics. nullptr to detach. The dwell time of
+  // the states active when attached counts from the call.
+  void setMetrics(HsmMetrics *machineMetrics);
+#endif
+
+#ifndef HSM_FREESTANDING
+  //! Payloads in arena are released after each run to completion step of the machine, i.e. when the
+  // outermost onEvent() returns. nullptr to detach.
+  void setPayloadArena(HsmPayloadArena *arena) { payloadArena = arena; }
+#endif
 
 protected:
-  //! Make the state machine take a transition to another state. This will result in a chain of onExit(), onEnter()
-  // and onInit() on the involved states in the hierarchy.
+  //! Make the state machine take a transition to another state, without the hooks of its policy.
+  // Hsm::transition() hides this with the hooks.
   // @param nextState
   void transition(HsmStateBase &nextState);
 
   //! Make the state machine take a transition to a sub state but exiting and entering own state before entering
-  // sub states.
+  // sub states, without the hooks of its policy. Hsm::externalTransition() hides this with the hooks.
   // @param nextState
   void externalTransition(HsmStateBase &nextState);
 
@@ -68,54 +129,441 @@ protected:
   HsmStateBase *nextState = nullptr;
   //! Temporarily set when and transition is taken. Set equal to the state from which the transition is started.
   HsmStateBase *sourceState = nullptr;
+  //! Released after each run to completion step
+  HsmPayloadArena *payloadArena = nullptr;
+  //! Nesting of onEvent(), internal events are dispatched within the step of the outer event
+  unsigned stepDepth = 0;
+  HsmFlightRecorder *flightRecorder = nullptr;
+  uint32_t traceMachine = 0;
+#ifdef HSM_METRICS
+  HsmMetrics *metrics = nullptr;
+#endif
+  //! Id of the event being dispatched, when recording or collecting metrics
+  uint16_t traceEvent = 0;
+#ifdef HSM_WATCHDOG
+  //! Progress of the machine, published to the watchdog watching it
+  HsmWatchdogSlot *watchdogSlot = nullptr;
+#endif
+#ifdef HSM_CALLBACK_TIMING
+  //! True while the callbacks of the current run to completion step are timed, for CPU time or the watchdog
+  bool measuredStep = false;
+  uint64_t stepBegin = 0;
+  //! Time of callbacks nested in the callback being measured, e.g. internal events
+  uint64_t nestedTime = 0;
+#endif
+#ifdef HSM_METRICS
+  //! True while the current run to completion step is sampled for CPU time
+  bool cpuSampled = false;
+  //! Self time of all callbacks in the sampled step
+  uint64_t cpuCallbacks = 0;
+#endif
+
+  //! Type erased event. Invokes the event on state and returns true if handled.
+  using EventThunk = bool (*)(HsmStateBase &state, void *event);
+  //! Type of the event, only called when recording or collecting metrics
+  using EventTypeOf = const HsmEventType &(*)();
+
+  //! Saved by beginDispatch() for endDispatch()
+  struct DispatchScope {
+    uint16_t outerEvent;
+#ifdef HSM_METRICS
+    HsmStateBase *origin;
+    uint64_t start;
+#endif
+#ifdef HSM_CALLBACK_TIMING
+    bool measuredStep;
+#endif
+  };
+
+  //! Saved by beginCallback() for endCallback()
+  struct CallbackScope {
+    //! Nested time of an enclosing callback
+    uint64_t nested = 0;
+    //! Watchdog activity of an enclosing callback
+    uint32_t activity = 0;
+  };
+
+  //! Measures the self time of a callback of a state, when the step is sampled for CPU time or watched
+  class CallbackTimer {
+  public:
+#ifdef HSM_CALLBACK_TIMING
+    CallbackTimer(HsmBase &hsm, HsmStateBase &state, HsmCallback callback)
+        : hsm(hsm)
+        , state(state)
+        , callback(callback)
+        , begin(hsm.measuredStep ? hsm.beginCallback(state, callback, outer) : 0) {}
+    ~CallbackTimer() {
+      if (begin) {
+        hsm.endCallback(state, callback, begin, outer);
+      }
+    }
+
+  private:
+    HsmBase &hsm;
+    HsmStateBase &state;
+    const HsmCallback callback;
+    CallbackScope outer;
+    const uint64_t begin;
+#else
+    CallbackTimer(HsmBase &, HsmStateBase &, HsmCallback) {}
+#endif
+  };
+
+  /*
+   * The algorithm is templated on the policy of the machine. The instances for HsmNoPolicy are compiled once
+   * in hsm.cpp, see the extern templates below.
+   */
+
+  //! Call to initialize the state machine. It will make sure that current state is set
+  // by calling onInit() on the top state and then traverse down initial transitions.
+  template <typename POLICY> void start(POLICY &policy);
+
+  //! Exit all active states, from current state up to top state
+  template <typename POLICY> void stop(POLICY &policy);
+
+  //! Walk from current state up via the hierarchy until a state handles the event. The loop is compiled
+  // once per policy, only the thunk is instantiated per event.
+  template <typename POLICY> bool dispatch(POLICY &policy, EventThunk thunk, void *event, EventTypeOf type);
+
+  //! Make the state machine take a transition to another state. This will result in a chain of onExit(), onEnter()
+  // and onInit() on the involved states in the hierarchy.
+  template <typename POLICY> void transition(POLICY &policy, HsmStateBase &targetState);
 
-  void enterAndInitNextState();
-  void enterNextState();
-  void initCurrentState();
-  void exitUpToLCA(HsmStateBase &target);
+  //! Make the state machine take a transition to a sub state but exiting and entering own state before entering
+  // sub states.
+  template <typename POLICY> void externalTransition(POLICY &policy, HsmStateBase &targetState);
+
+  template <typename POLICY> void enterAndInitNextState(POLICY &policy);
+  template <typename POLICY> void enterNextState(POLICY &policy);
+  template <typename POLICY> void initCurrentState(POLICY &policy);
+  template <typename POLICY> void exitUpToLCA(POLICY &policy, HsmStateBase &target);
+
+  //! The current state of a started machine. Not a template, so the assert is the same for all events
+  HsmStateBase &startedState() const {
+    assert(currentState != nullptr && "onStart must be called before any events");
+    return *currentState;
+  }
+  bool beginStep();
+  void endStep();
+#ifdef HSM_CALLBACK_TIMING
+  uint64_t beginCallback(HsmStateBase &state, HsmCallback callback, CallbackScope &outer);
+  void endCallback(HsmStateBase &state, HsmCallback callback, uint64_t begin, const CallbackScope &outer);
+#endif
+  DispatchScope beginDispatch(EventTypeOf type);
+  bool endDispatch(const DispatchScope &scope, HsmStateBase *handledBy);
+  bool observed() const;
+  void record(uint8_t kind, const HsmStateBase *source, const HsmStateBase *target, bool handled);
+  void entered(HsmStateBase &state);
+  void exited(HsmStateBase &state, const HsmStateBase *target);
+  void handled(HsmStateBase &state);
+  void completeStep();
   unsigned levelsToLCA(HsmStateBase &target);
 }; // namespace hsp
 
-template <typename CONTEXT> class Hsm : public HsmBase {
+template <typename CONTEXT, typename POLICY = HsmNoPolicy> class Hsm : public HsmBase, private POLICY {
 public:
   // The CONTEXT parameter must be a HsmState derived class
   static_assert(std::is_base_of<HsmState<CONTEXT>, CONTEXT>::value);
+  static_assert(std::is_base_of<HsmNoPolicy, POLICY>::value, "The POLICY must derive from HsmNoPolicy");
+
   using HsmBase::HsmBase;
 
+  //! Start the state machine
+  // Note: Call this before any calls onEvent().
+  // Note: Must only be called on a stopped machine, a new one or one stopped by onStop().
+  void onStart() { start(policy()); }
+
+  //! Stop the state machine. All active states are exited, from current state up to top state.
+  // Note: The machine could be started again with onStart(), which will use the history.
+  void onStop() { stop(policy()); }
+
   //! Call to stimulate state machine with an event. This function will traverse the hierarchy to
   // find a state that handles the event.
-  // @param eventerror
+  // Note: The event is offered to each state up the hierarchy, so it is invoked as an lvalue and must not
+  // be consumed by a handler. Large payloads are passed by reference, see HsmPayload.
+  // @param event
   template <typename EVENT> bool onEvent(EVENT &&event) {
-    HsmStateBase *state;
-    bool handled = false;
+    using Event = std::remove_reference_t<EVENT>;
+    policy().onDispatch(startedState(), static_cast<const Event &>(event));
+    return dispatch(policy(), &invoke<Event>, const_cast<std::remove_const_t<Event> *>(std::addressof(event)),
+                    &hsmEventType<std::remove_cv_t<Event>>);
+  }
 
-    // Walk from current state up via state hierarchy
-    for (state = currentState; state; state = state->superState) {
-      // Remember which state that handle the event
-      sourceState = state;
+  POLICY &policy() { return *this; }
+  const POLICY &policy() const { return *this; }
 
-      // Try if state want's to handle event
-      if (not dynamic_cast<CONTEXT *>(state)->onEvent(event)) {
-        continue;
-      }
-      handled = true;
+protected:
+  //! Make the state machine take a transition to another state. This will result in a chain of onExit(), onEnter()
+  // and onInit() on the involved states in the hierarchy.
+  // @param nextState
+  void transition(HsmStateBase &nextState) { HsmBase::transition(policy(), nextState); }
 
-      // Is an state transition taken, then enter next state
-      if (nextState) {
-        enterAndInitNextState();
-      }
-      break;
-    }
-    return handled;
-  }
+  //! Make the state machine take a transition to a sub state but exiting and entering own state before entering
+  // sub states.
+  // @param nextState
+  void externalTransition(HsmStateBase &nextState) { HsmBase::externalTransition(policy(), nextState); }
 
 private:
+  //! The only code instantiated per event
+  template <typename EVENT> static bool invoke(HsmStateBase &state, void *event) {
+    // The states of the machine must derive from CONTEXT. Not checked, as the check would need RTTI, and a
+    // state of another type is undefined behaviour
+    return static_cast<CONTEXT &>(state).onEvent(*static_cast<EVENT *>(event));
+  }
+
   // Only to be used internally in the Hsm
+#ifdef HSM_CALLBACK_TIMING
+  using HsmBase::beginCallback;
+#endif
+  using HsmBase::beginDispatch;
+  using HsmBase::beginStep;
+  using HsmBase::completeStep;
+  using HsmBase::dispatch;
+#ifdef HSM_CALLBACK_TIMING
+  using HsmBase::endCallback;
+#endif
+  using HsmBase::endDispatch;
+  using HsmBase::endStep;
   using HsmBase::enterAndInitNextState;
   using HsmBase::enterNextState;
+  using HsmBase::entered;
   using HsmBase::exitUpToLCA;
+  using HsmBase::exited;
+  using HsmBase::handled;
   using HsmBase::initCurrentState;
   using HsmBase::levelsToLCA;
+  using HsmBase::observed;
+  using HsmBase::record;
+  using HsmBase::start;
+  using HsmBase::startedState;
+  using HsmBase::stop;
 };
 
+template <typename POLICY> void HsmBase::start(POLICY &policy) {
+  assert(topState.superState == nullptr && "Top state must have nullptr for super state");
+  assert(currentState == nullptr && "onStart must not be called on a started machine");
+
+  const bool measured = beginStep();
+
+  currentState = &topState;
+
+  nextState = nullptr;
+
+  {
+    CallbackTimer timer(*this, *currentState, HsmCallback::ENTER);
+    currentState->onEnter();
+  }
+  entered(*currentState);
+  policy.onEnter(*currentState);
+
+  initCurrentState(policy);
+
+  if (measured) {
+    endStep();
+  }
+}
+
+template <typename POLICY> void HsmBase::stop(POLICY &policy) {
+  assert(currentState != nullptr && "onStop must only be called on a started machine");
+  assert(nextState == nullptr && "onStop must not be called during a transition");
+  const bool measured = beginStep();
+
+  for (HsmStateBase *state = currentState; state; state = state->superState) {
+    {
+      CallbackTimer timer(*this, *state, HsmCallback::EXIT);
+      state->onExit();
+    }
+    exited(*state, nullptr);
+    policy.onExit(*state);
+    if (state->superState) {
+      state->superState->historySubstate = state; // remember last substate
+    }
+  }
+  currentState = nullptr;
+  sourceState = nullptr;
+
+  if (measured) {
+    endStep();
+  }
+}
+
+template <typename POLICY> bool HsmBase::dispatch(POLICY &policy, EventThunk thunk, void *event, EventTypeOf type) {
+  HsmStateBase *state;
+  const DispatchScope scope = beginDispatch(type);
+
+  // Walk from current state up via state hierarchy
+  for (state = currentState; state; state = state->superState) {
+    // Remember which state that handle the event
+    sourceState = state;
+
+    // Try if state want's to handle event
+    bool handles;
+    {
+      CallbackTimer timer(*this, *state, HsmCallback::HANDLER);
+      handles = thunk(*state, event);
+    }
+    if (not handles) {
+      continue;
+    }
+    handled(*state);
+
+    // Is an state transition taken, then enter next state
+    if (nextState) {
+      enterAndInitNextState(policy);
+      policy.onTransitionComplete(*currentState);
+    }
+    break;
+  }
+  policy.onHandled(state);
+  return endDispatch(scope, state);
+}
+
+//!
+// Used to change current state to a new state.
+// @param target_state
+template <typename POLICY> void HsmBase::transition(POLICY &policy, HsmStateBase &targetState) {
+  assert(currentState != nullptr && "onStart must be called before any transitions can be taken");
+  // FIXME check that we are not calling this function twice
+  // FIXME check that we are not calling this function inside a onInit()
+
+  exitUpToLCA(policy, targetState);
+
+  nextState = &targetState;
+}
+
+//!
+// Used to change current state to a new state.
+// @param target_state
+template <typename POLICY> void HsmBase::externalTransition(POLICY &policy, HsmStateBase &targetState) {
+  assert(currentState != nullptr && "onStart must be called before any transitions can be taken");
+  // FIXME check that we are not calling this function twice
+  // FIXME check that we are not calling this function inside a onInit()
+
+  exitUpToLCA(policy, targetState);
+
+  // Exit and enter own state
+  {
+    CallbackTimer timer(*this, *currentState, HsmCallback::EXIT);
+    currentState->onExit();
+  }
+  exited(*currentState, &targetState);
+  policy.onExit(*currentState);
+  {
+    CallbackTimer timer(*this, *currentState, HsmCallback::ENTER);
+    currentState->onEnter();
+  }
+  entered(*currentState);
+  policy.onEnter(*currentState);
+
+  nextState = &targetState;
+}
+
+//!
+// Makes the Hsm entering a state and invoke the initial transition
+//
+template <typename POLICY> void HsmBase::enterAndInitNextState(POLICY &policy) {
+  enterNextState(policy);
+
+  currentState = nextState;
+  nextState = nullptr;
+
+  initCurrentState(policy);
+}
+
+//!
+// Makes the Hsm enters the next state
+//
+template <typename POLICY> void HsmBase::enterNextState(POLICY &policy) {
+  // FIXME make this a vector
+  constexpr int MAX_STATE_NESTING = 7;
+  HsmStateBase *entry_path[MAX_STATE_NESTING];
+  HsmStateBase **trace;
+  HsmStateBase *state = nullptr;
+
+  entry_path[0] = nullptr;
+  trace = &entry_path[0];
+
+  // Trace path to target state
+  for (state = nextState; state != currentState; state = state->superState) {
+    /// TODO Consider range check to avoid exceeding MAX_STATE_NESTING?
+    *(++trace) = state;
+  }
+
+  // Invoke onEnter from LCA to next state
+  while ((state = *trace--) != nullptr) {
+    {
+      CallbackTimer timer(*this, *state, HsmCallback::ENTER);
+      state->onEnter();
+    }
+    entered(*state);
+    policy.onEnter(*state);
+  }
+}
+
+//!
+// Make the Hsm intialize current state
+//
+template <typename POLICY> void HsmBase::initCurrentState(POLICY &policy) {
+  while (true) {
+    {
+      CallbackTimer timer(*this, *currentState, HsmCallback::INIT);
+      currentState->onInit();
+    }
+    policy.onInit(*currentState);
+
+    // If we have reached last substate
+    if (nullptr == nextState)
+      break;
+
+    assert(nextState->superState == currentState && "Sub state do have super state set correctly");
+
+    enterNextState(policy);
+
+    currentState = nextState;
+    nextState = nullptr;
+  }
+}
+
+//!
+// Exit states up the state that is common least super state to current state and target state.
+// @param target State that is the target of the transition.
+//
+template <typename POLICY> void HsmBase::exitUpToLCA(POLICY &policy, HsmStateBase &target) {
+  HsmStateBase *state = currentState;
+
+  // Exit up to source state
+  while (state != sourceState) {
+    {
+      CallbackTimer timer(*this, *state, HsmCallback::EXIT);
+      state->onExit();
+    }
+    exited(*state, &target);
+    policy.onExit(*state);
+    state->superState->historySubstate = state; // remember last substate
+    state = state->superState;
+  }
+
+  // Exit up to LCA
+  for (unsigned toLca = levelsToLCA(target); toLca != 0; toLca--) {
+    {
+      CallbackTimer timer(*this, *state, HsmCallback::EXIT);
+      state->onExit();
+    }
+    exited(*state, &target);
+    policy.onExit(*state);
+    state->superState->historySubstate = state; // remember last substate
+    state = state->superState;
+  }
+
+  // Current state is now LCA
+  currentState = state;
+}
+
+// The default policy is compiled once in hsm.cpp
+extern template void HsmBase::start(HsmNoPolicy &);
+extern template void HsmBase::stop(HsmNoPolicy &);
+extern template bool HsmBase::dispatch(HsmNoPolicy &, EventThunk, void *, EventTypeOf);
+extern template void HsmBase::transition(HsmNoPolicy &, HsmStateBase &);
+extern template void HsmBase::externalTransition(HsmNoPolicy &, HsmStateBase &);
+
 } // namespace hsp
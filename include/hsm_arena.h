@@ -0,0 +1,61 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+namespace hsp {
+
+/*!
+ * Bump allocator for objects that live as long as the machine, e.g. lazily constructed states. Memory
+ * is never freed individually, only when the arena is destroyed. The objects must be destroyed by
+ * their owner before that.
+ */
+class HsmArena {
+public:
+  /*!
+   * Arena in a static buffer, e.g. for targets without heap
+   */
+  HsmArena(void *buffer, std::size_t size);
+  /*!
+   * Arena allocated from the heap the first time it is used
+   */
+  explicit HsmArena(std::size_t capacity);
+
+  HsmArena(const HsmArena &) = delete;
+  HsmArena &operator=(const HsmArena &) = delete;
+
+  //! Allocate memory. Aborts if the arena is exhausted, also in release builds.
+  void *allocate(std::size_t size, std::size_t alignment);
+
+  std::size_t capacity() const { return size; }
+  std::size_t used() const { return offset; }
+
+private:
+  std::unique_ptr<std::max_align_t[]> heap;
+  char *buffer;
+  const std::size_t size;
+  std::size_t offset = 0;
+};
+
+} // namespace hsp
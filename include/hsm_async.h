@@ -0,0 +1,87 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_executor.h"
+
+#include <functional>
+#include <memory>
+
+namespace hsp {
+
+/*!
+ * An action that runs outside the run-to-completion step of the Hsm.
+ *
+ * The action is handed to an executor (e.g. a HsmWorkerExecutor) and start() returns immediately. When
+ * the action is finished a completion or failure event is posted to the completion executor, which must
+ * be the context dispatching the Hsm (e.g. the HsmEventLoop). A state typically starts the action in
+ * onEnter() and cancels it in onExit():
+ *
+ *   void StateStarting::onEnter() {
+ *     hsm.motorOn.start([&] { return hsm.motor.on(); },
+ *                       [&] { hsm.onMotorOn(); },
+ *                       [&] { hsm.onMotorFailed(); });
+ *   }
+ *   void StateStarting::onExit() { hsm.motorOn.cancel(); }
+ *
+ * The action and its events run with the correlation of the thread calling start().
+ *
+ * Note: start(), cancel() and the destructor must be called from the completion context.
+ */
+class HsmAsyncAction {
+public:
+  /*!
+   * @param executor Executor running the action
+   * @param completion Executor delivering the completion and failure events to the Hsm
+   */
+  HsmAsyncAction(IExecutor &executor, IExecutor &completion);
+  ~HsmAsyncAction();
+
+  HsmAsyncAction(const HsmAsyncAction &) = delete;
+  HsmAsyncAction &operator=(const HsmAsyncAction &) = delete;
+
+  /*!
+   * Start the action. If an earlier started action is still pending its events are dropped.
+   * @param action Returns false if the action failed
+   * @param onDone Event posted when the action succeeded
+   * @param onFailed Event posted when the action failed. Could be empty.
+   */
+  void start(std::function<bool()> action, std::function<void()> onDone, std::function<void()> onFailed = nullptr);
+
+  /*!
+   * Drop the completion or failure event of the pending action. The action itself could still run.
+   */
+  void cancel();
+
+  //! True from start() until the completion or failure event is delivered or cancelled
+  bool pending() const { return isPending; }
+
+private:
+  IExecutor &executor;
+  IExecutor &completion;
+  //! Incremented each time the events of the pending action must be dropped. Shared with the action
+  // in flight, as it could outlive this object.
+  std::shared_ptr<unsigned> generation;
+  bool isPending = false;
+};
+
+} // namespace hsp
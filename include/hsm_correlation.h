@@ -0,0 +1,92 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_flight_recorder.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace hsp {
+
+/*!
+ * Id tying the events and actions caused by one external command together, 0 is no command. The id of
+ * the event being handled is kept per thread: events dispatched and actions started while it is set
+ * inherit it, and HsmEventLoop, HsmScheduler and HsmAsyncAction carry it along with what they post, so it
+ * follows the command across queues, threads and machines. Flight recorder records are stamped with it.
+ *
+ *   void PumpGateway::onCommand(const Command &command) {
+ *     HsmCorrelationScope scope(hsmNewCorrelation());
+ *     loop.post([&] { pump.onStart(); });
+ *   }
+ */
+using HsmCorrelationId = uint32_t;
+
+//! Correlation of the work running on this thread. Only to be set by HsmCorrelationScope.
+inline thread_local HsmCorrelationId hsmCurrentCorrelation = 0;
+
+//! Correlation of the work running on this thread, 0 if none
+inline HsmCorrelationId hsmCorrelation() { return hsmCurrentCorrelation; }
+
+//! A new process wide unique correlation, never 0
+HsmCorrelationId hsmNewCorrelation();
+
+//! Sets the correlation of this thread for its lifetime and restores the previous one after
+class HsmCorrelationScope {
+public:
+  explicit HsmCorrelationScope(HsmCorrelationId correlation)
+      : outer(hsmCurrentCorrelation) {
+    hsmCurrentCorrelation = correlation;
+  }
+  ~HsmCorrelationScope() { hsmCurrentCorrelation = outer; }
+
+  HsmCorrelationScope(const HsmCorrelationScope &) = delete;
+  HsmCorrelationScope &operator=(const HsmCorrelationScope &) = delete;
+
+private:
+  const HsmCorrelationId outer;
+};
+
+//! Records of one command
+struct HsmCorrelationSpan {
+  HsmCorrelationId correlation;
+  //! Timestamps of the first and the last record
+  uint64_t first;
+  uint64_t last;
+  uint32_t records;
+  //! Number of different machines in the records
+  uint32_t machines;
+
+  //! End to end latency in hsmTimestamp() ticks, from the first dispatch until the last record
+  uint64_t latency() const { return last - first; }
+};
+
+/*!
+ * Group records by correlation to measure the end to end latency per command. Records without a
+ * correlation are skipped.
+ * @return Spans ordered by their first record
+ */
+std::vector<HsmCorrelationSpan> hsmCorrelationSpans(const HsmTraceRecord *records, std::size_t count);
+std::vector<HsmCorrelationSpan> hsmCorrelationSpans(const HsmFlightRecorder &recorder);
+
+} // namespace hsp
@@ -0,0 +1,167 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_correlation.h"
+#include "hsm_executor.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct epoll_event;
+
+namespace hsp {
+
+class HsmEventLoopTimer;
+
+/*!
+ * Linux event loop driving any number of Hsm's from a single thread.
+ *
+ * All events are delivered as callbacks on the thread calling run() or runOnce(). The callbacks are
+ * supposed to stimulate the state machines, e.g. [&] { pump.onStandby(); }. Three kinds of sources are
+ * multiplexed by one epoll_wait():
+ *  - post():  Thread safe. Wakes the loop through an eventfd.
+ *  - timers:  HsmEventLoopTimer's share one timerfd armed with the earliest deadline.
+ *  - watch(): Arbitrary file descriptors mapped to a callback when readable.
+ * Posted events and timeouts are dispatched with the correlation of the thread posting or starting them.
+ */
+class HsmEventLoop : public IExecutor {
+  friend class HsmEventLoopTimer;
+
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /*!
+   * @param maxBatch Max number of file descriptor events handled per epoll_wait()
+   */
+  explicit HsmEventLoop(unsigned maxBatch = 64);
+  ~HsmEventLoop() override;
+
+  HsmEventLoop(const HsmEventLoop &) = delete;
+  HsmEventLoop &operator=(const HsmEventLoop &) = delete;
+
+  /*!
+   * Queue an event for dispatch on the loop thread. Could be called from any thread.
+   */
+  void post(std::function<void()> event) override;
+
+  /*!
+   * Invoke onReadable on the loop thread each time fd becomes readable (level triggered).
+   * Note: The callback must read from fd, otherwise it is invoked again on next iteration.
+   */
+  void watch(int fd, std::function<void()> onReadable);
+  //! The callback is not invoked after this, also not if fd is ready in the batch being dispatched
+  void unwatch(int fd);
+
+  /*!
+   * Wait for at most timeoutMs (-1 is forever) and dispatch everything that is ready.
+   * @return Number of dispatched callbacks
+   * @throws std::system_error if waiting fails, other than being interrupted by a signal
+   */
+  unsigned runOnce(int timeoutMs = -1);
+
+  /*!
+   * Dispatch until stop() is called.
+   */
+  void run();
+
+  /*!
+   * Make run() return. Could be called from any thread.
+   */
+  void stop();
+
+private:
+  using TimerQueue = std::multimap<Clock::time_point, HsmEventLoopTimer *>;
+
+  const unsigned maxBatch;
+  const int epollFd;
+  const int eventFd;
+  const int timerFd;
+  std::atomic<bool> stopped{false};
+
+  struct Posted {
+    std::function<void()> event;
+    HsmCorrelationId correlation;
+  };
+
+  std::mutex postedMutex;
+  std::vector<Posted> posted;
+  std::vector<Posted> dispatching;
+
+  std::vector<epoll_event> ready;
+
+  struct Watch {
+    std::function<void()> callback;
+    //! Cleared by unwatch()
+    bool live = true;
+  };
+
+  std::unordered_map<int, std::unique_ptr<Watch>> watched;
+  //! Unwatched callbacks are kept alive until the current batch is dispatched
+  std::vector<std::unique_ptr<Watch>> retired;
+
+  TimerQueue timers;
+
+  void wakeup();
+  unsigned dispatchPosted();
+  unsigned dispatchTimers();
+  void armTimerFd();
+  TimerQueue::iterator schedule(Clock::time_point deadline, HsmEventLoopTimer &timer);
+  void unschedule(TimerQueue::iterator entry);
+};
+
+/*!
+ * One shot timer driven by a HsmEventLoop. The timeout callback is invoked on the loop thread.
+ * Note: Must only be used from the loop thread.
+ */
+class HsmEventLoopTimer {
+  friend class HsmEventLoop;
+
+public:
+  HsmEventLoopTimer(HsmEventLoop &loop, std::chrono::nanoseconds timeout);
+  ~HsmEventLoopTimer();
+
+  HsmEventLoopTimer(const HsmEventLoopTimer &) = delete;
+  HsmEventLoopTimer &operator=(const HsmEventLoopTimer &) = delete;
+
+  //! (Re)start the timer. A running timer is restarted.
+  void start(std::function<void()> timeoutCallback);
+  //! Cancel the timer if running
+  void cancel();
+  bool running() const { return isRunning; }
+
+private:
+  HsmEventLoop &loop;
+  const std::chrono::nanoseconds timeout;
+  std::function<void()> callback;
+  HsmCorrelationId correlation = 0;
+  HsmEventLoop::TimerQueue::iterator entry;
+  bool isRunning = false;
+};
+
+} // namespace hsp
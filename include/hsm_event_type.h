@@ -0,0 +1,83 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <cstdint>
+
+#ifndef HSM_FREESTANDING
+#include <string>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HSM_SIGNATURE __PRETTY_FUNCTION__
+#else
+#define HSM_SIGNATURE __FUNCSIG__
+#endif
+
+namespace hsp {
+
+/*!
+ * Runtime identity of an event type, e.g. the lambda of an event. Types get ids from 1 in order of first
+ * use and are linked in a list without heap, so they can be looked up from a signal handler.
+ */
+struct HsmEventType {
+  uint16_t id;
+  //! Name of the type, not null terminated. nullptr in HSM_FREESTANDING builds, types are known by id only
+  const char *name;
+  uint16_t nameLength;
+  const HsmEventType *next;
+};
+
+//! Registers a type when constructed
+struct HsmEventTypeRegistration {
+  //! @param signature Signature of hsmEventType<>(), the name of the type is taken from it. nullptr for no name
+  explicit HsmEventTypeRegistration(const char *signature);
+
+  HsmEventType type;
+};
+
+//! Find a registered type, nullptr if unknown
+const HsmEventType *hsmFindEventType(uint16_t id);
+
+#ifndef HSM_FREESTANDING
+/*!
+ * Short name of an event type for reports. Lambdas are named by the function they are defined in, e.g.
+ * "PumpControlHsm::onStandby()::<lambda(...)>" is "onStandby()", and namespaces and classes are dropped.
+ * Unknown ids are "event <id>".
+ */
+std::string hsmEventName(uint16_t id);
+#endif
+
+/*!
+ * The type of EVENT, registered the first time called
+ */
+template <typename EVENT> const HsmEventType &hsmEventType() {
+#ifndef HSM_FREESTANDING
+  static const HsmEventTypeRegistration registration(HSM_SIGNATURE);
+#else
+  // No signature, it would take a string in the rodata per event type
+  static const HsmEventTypeRegistration registration(nullptr);
+#endif
+  return registration.type;
+}
+
+} // namespace hsp
@@ -0,0 +1,71 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hsp {
+
+/*!
+ * Something that runs work, now or later, on some thread.
+ */
+class IExecutor {
+public:
+  virtual ~IExecutor() = default;
+
+  /*!
+   * Queue work for execution. Must be thread safe.
+   */
+  virtual void post(std::function<void()> work) = 0;
+};
+
+/*!
+ * Executor running the posted work on a set of worker threads. Used to offload slow actions from the
+ * thread dispatching the Hsm.
+ */
+class HsmWorkerExecutor : public IExecutor {
+public:
+  explicit HsmWorkerExecutor(unsigned threads = 1);
+  //! Finish all queued work and join the workers
+  ~HsmWorkerExecutor() override;
+
+  HsmWorkerExecutor(const HsmWorkerExecutor &) = delete;
+  HsmWorkerExecutor &operator=(const HsmWorkerExecutor &) = delete;
+
+  void post(std::function<void()> work) override;
+
+private:
+  std::mutex mutex;
+  std::condition_variable available;
+  std::deque<std::function<void()>> queue;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+
+  void work();
+};
+
+} // namespace hsp
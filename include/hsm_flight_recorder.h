@@ -0,0 +1,156 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace hsp {
+
+//! State index for records without a state
+constexpr uint16_t HSM_TRACE_NO_STATE = 0xFFFF;
+
+//! Timestamp of records, the TSC on x86 and nanoseconds of the steady clock elsewhere
+inline uint64_t hsmTimestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+#ifndef HSM_FREESTANDING
+//! Rate of hsmTimestamp(), measured against the steady clock the first time called
+double hsmTimestampsPerMicrosecond();
+#endif
+
+/*!
+ * Compact binary record of what a machine did. States are identified by HsmStateBase::index and events by
+ * HsmEventType::id.
+ */
+struct HsmTraceRecord {
+  enum Kind : uint8_t {
+    //! An event was dispatched. source is the state that handled it (or the current state), target the
+    // target of the transition taken.
+    EVENT,
+    //! source was exited in a transition to target
+    EXIT,
+    //! target was entered
+    ENTER,
+  };
+
+  uint64_t timestamp;
+  uint32_t machine;
+  //! HsmCorrelationId of the command causing the record, 0 if none
+  uint32_t correlation;
+  uint16_t event;
+  uint16_t source;
+  uint16_t target;
+  Kind kind;
+  uint8_t handled;
+};
+
+/*!
+ * Flight recorder of one or more machines. A fixed size ring of records that always holds the latest
+ * records, cheap enough to be left enabled in production. Attach it to machines with
+ * HsmBase::setFlightRecorder().
+ *
+ * Writers claim a slot with one atomic increment and never block, so machines on different threads can
+ * share a recorder. A slot is stamped with its sequence when written, which lets readers skip records that
+ * are being overwritten.
+ */
+class HsmFlightRecorder {
+public:
+  struct Slot {
+    std::atomic<uint64_t> sequence{0};
+    HsmTraceRecord record;
+  };
+
+  //! @param capacity Slots in the ring, must be a power of two
+  HsmFlightRecorder(Slot *slots, std::size_t capacity);
+
+  HsmFlightRecorder(const HsmFlightRecorder &) = delete;
+  HsmFlightRecorder &operator=(const HsmFlightRecorder &) = delete;
+
+  void record(const HsmTraceRecord &record) {
+    const uint64_t position = head.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = slots[position & mask];
+    slot.sequence.store(BUSY, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.record = record;
+    slot.sequence.store(position + 1, std::memory_order_release);
+  }
+
+  //! Records written since construction, including the overwritten ones
+  uint64_t written() const { return head.load(std::memory_order_relaxed); }
+  std::size_t capacity() const { return mask + 1; }
+
+  /*!
+   * Copy the records still in the ring, oldest first, to records (at most capacity()). Records being
+   * written are skipped.
+   * @return Number of records copied
+   */
+  std::size_t snapshot(HsmTraceRecord *records, std::size_t size) const;
+
+#ifndef HSM_FREESTANDING
+  /*!
+   * Write the records as text to fd. Async signal safe, so it could be called from a crash handler.
+   */
+  void dump(int fd) const;
+
+  /*!
+   * Dump the recorder to fd on SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT. Only one recorder can be
+   * installed.
+   */
+  static void dumpOnCrash(HsmFlightRecorder &recorder, int fd = 2);
+#endif
+
+private:
+  static constexpr uint64_t BUSY = ~uint64_t(0);
+
+  Slot *const slots;
+  const std::size_t mask;
+  std::atomic<uint64_t> head{0};
+
+  bool read(uint64_t position, HsmTraceRecord &record) const;
+};
+
+/*!
+ * Flight recorder with a ring of CAPACITY slots inside the object
+ */
+template <std::size_t CAPACITY> class HsmFlightRecorderRing : public HsmFlightRecorder {
+public:
+  HsmFlightRecorderRing()
+      : HsmFlightRecorder(ring, CAPACITY) {}
+
+private:
+  Slot ring[CAPACITY];
+};
+
+} // namespace hsp
@@ -0,0 +1,278 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef HSM_STATE_ID_TYPE
+#define HSM_STATE_ID_TYPE uint8_t
+#endif
+
+namespace hsp {
+
+class FlyweightHsmBase;
+class FlyweightHsmStateBase;
+
+/*!
+ * Index of a state in the model of a flyweight machine. Define HSM_STATE_ID_TYPE as uint16_t for
+ * machines with more than 254 states.
+ */
+using HsmStateId = HSM_STATE_ID_TYPE;
+static_assert(std::is_unsigned<HsmStateId>::value);
+constexpr HsmStateId NO_STATE = std::numeric_limits<HsmStateId>::max();
+
+/*!
+ * Structure of a flyweight state machine type. All the states of the machine type register here when
+ * constructed, which builds a contiguous table of the hierarchy indexed by state id. There must be one
+ * model per machine type, shared by all instances.
+ */
+class FlyweightHsmModel {
+  friend class FlyweightHsmStateBase;
+
+public:
+  //! Max levels of states, including the top state
+  static constexpr unsigned MAX_DEPTH = 16;
+
+  //! Hierarchy of a state. Sub states are linked from first child through next sibling.
+  struct Node {
+    HsmStateId parent;
+    uint8_t depth;
+    HsmStateId firstChild;
+    HsmStateId nextSibling;
+    //! Entry of the state in the history of an instance, NO_STATE for leaf states
+    HsmStateId historySlot;
+  };
+
+  FlyweightHsmModel() = default;
+  FlyweightHsmModel(const FlyweightHsmModel &) = delete;
+  FlyweightHsmModel &operator=(const FlyweightHsmModel &) = delete;
+
+  //! Number of states in the machine
+  unsigned size() const { return states.size(); }
+  //! Number of history entries of an instance, one per state with sub states
+  unsigned historySlots() const { return slots; }
+  //! The state with id, where 0 is the top state
+  const FlyweightHsmStateBase &state(HsmStateId id) const { return *states[id]; }
+  const Node &node(HsmStateId id) const { return nodes[id]; }
+  HsmStateId parent(HsmStateId id) const { return nodes[id].parent; }
+  unsigned depth(HsmStateId id) const { return nodes[id].depth; }
+  HsmStateId historySlot(HsmStateId id) const { return nodes[id].historySlot; }
+
+  //! Least common ancestor of two states
+  HsmStateId lca(HsmStateId a, HsmStateId b) const;
+  //! True if state is the active state or one of its super states
+  bool isIn(HsmStateId active, HsmStateId state) const;
+
+private:
+  std::vector<Node> nodes;
+  std::vector<const FlyweightHsmStateBase *> states;
+  unsigned slots = 0;
+
+  HsmStateId add(const FlyweightHsmStateBase &state, const FlyweightHsmStateBase *superState);
+};
+
+/*!
+ * State shared by all instances of a flyweight state machine type. States are stateless (const), all
+ * data of an instance lives in the FlyweightHsm.
+ */
+class FlyweightHsmStateBase {
+  friend class FlyweightHsmBase;
+
+public:
+  /*!
+   * Call constructor with the model of the machine type and address of super state, top state must
+   * be given a nullptr and be constructed first.
+   */
+  FlyweightHsmStateBase(FlyweightHsmModel &model, const FlyweightHsmStateBase *superState);
+  virtual ~FlyweightHsmStateBase();
+
+  FlyweightHsmStateBase(const FlyweightHsmStateBase &) = delete;
+  FlyweightHsmStateBase &operator=(const FlyweightHsmStateBase &) = delete;
+
+  /*!
+   * Id of the state in the model
+   */
+  const HsmStateId id;
+
+protected:
+  //! Invoke onEnter(), onExit() and onInit() of the concrete state with the instance
+  virtual void enter(FlyweightHsmBase &hsm) const = 0;
+  virtual void exit(FlyweightHsmBase &hsm) const = 0;
+  virtual void init(FlyweightHsmBase &hsm) const = 0;
+};
+
+/*!
+ * Base class of the states of a flyweight machine. The MACHINE parameter is the concrete machine class
+ * (derived from FlyweightHsm), which is passed to all handlers of the state.
+ */
+template <typename MACHINE> class FlyweightHsmState : public FlyweightHsmStateBase {
+public:
+  using Machine = MACHINE;
+  using FlyweightHsmStateBase::FlyweightHsmStateBase;
+
+  /*!
+   * Invoked when an state enter during a transition.
+   */
+  virtual void onEnter(MACHINE &) const {}
+  /*!
+   * Invoked when an state exit during a transition.
+   */
+  virtual void onExit(MACHINE &) const {}
+  /*!
+   * Invoked when an state transition ends on a state. If state has sub states this function must
+   * invoke hsm.initialTransition() to define which sub state should be entered.
+   */
+  virtual void onInit(MACHINE &) const {}
+
+private:
+  void enter(FlyweightHsmBase &hsm) const final { onEnter(static_cast<MACHINE &>(hsm)); }
+  void exit(FlyweightHsmBase &hsm) const final { onExit(static_cast<MACHINE &>(hsm)); }
+  void init(FlyweightHsmBase &hsm) const final { onInit(static_cast<MACHINE &>(hsm)); }
+};
+
+/*!
+ * Instance part of a flyweight hierarchical state machine. Holds only the ids of the current state
+ * and the history of the instance, the states are shared with all other instances of the machine type.
+ * The history is stored outside the instance, with historyStride between the entries of two states. Only
+ * states with sub states have an entry, see FlyweightHsmModel::historySlot().
+ */
+class FlyweightHsmBase {
+public:
+  FlyweightHsmBase(const FlyweightHsmModel &model, HsmStateId *history, uint32_t historyStride);
+
+  FlyweightHsmBase(const FlyweightHsmBase &) = delete;
+  FlyweightHsmBase &operator=(const FlyweightHsmBase &) = delete;
+
+  //! Start the state machine
+  // Note: Call this before any calls onEvent().
+  // Note: Call this only ones
+  void onStart();
+
+  //! Make the state machine take a transition to another state. This will result in a chain of onExit(), onEnter()
+  // and onInit() on the involved states in the hierarchy.
+  void transition(const FlyweightHsmStateBase &nextState);
+
+  //! Make the state machine take a transition to a sub state but exiting and entering own state before entering
+  // sub states.
+  void externalTransition(const FlyweightHsmStateBase &nextState);
+
+  //! Sets the initial sub state.
+  // Note: Must be called from state.onInit(), if the concrete state has sub states.
+  void initialTransition(const FlyweightHsmStateBase &subState);
+
+  //! Sets the initial sub state first time called. Next time it will used the history.
+  // Note: Must be called from state.onInit(), if the concrete state has sub states.
+  void initialHistoryTransition(const FlyweightHsmStateBase &subState);
+
+  //! True if state is the current state or one of its super states
+  bool isIn(const FlyweightHsmStateBase &state) const;
+
+protected:
+  const FlyweightHsmModel &model;
+  //! Last active sub state of each state with sub states, the entry of state id is
+  // history[model.historySlot(id) * historyStride]
+  HsmStateId *history;
+  uint32_t historyStride;
+  //! Current state. Must be at the lowest level of the hierachy (it cannot have sub states).
+  HsmStateId currentState = NO_STATE;
+  //! Temporarily set if and transitions is taken. NO_STATE if no transition taken
+  HsmStateId nextState = NO_STATE;
+  //! Temporarily set when and transition is taken. Set equal to the state from which the transition is started.
+  HsmStateId sourceState = NO_STATE;
+
+  void enterAndInitNextState();
+
+  //! Traverse the hierarchy from current state to find a state of type STATE that handles the event
+  template <typename STATE, typename EVENT> bool dispatch(EVENT &&event) {
+    using Machine = typename STATE::Machine;
+    static_assert(std::is_base_of<FlyweightHsmState<Machine>, STATE>::value);
+
+    for (HsmStateId state = currentState; state != NO_STATE; state = model.parent(state)) {
+      // Remember which state that handle the event
+      sourceState = state;
+
+      // Try if state want's to handle event
+      if (not event(static_cast<const STATE &>(model.state(state)), static_cast<Machine &>(*this))) {
+        continue;
+      }
+
+      // Is an state transition taken, then enter next state
+      if (nextState != NO_STATE) {
+        enterAndInitNextState();
+      }
+      return true;
+    }
+    return false;
+  }
+
+private:
+  void enterNextState();
+  void initCurrentState();
+  void exitUpToLCA(HsmStateId target);
+  unsigned levelsToLCA(HsmStateId target) const;
+};
+
+/*!
+ * Flyweight hierarchical state machine. STATE is the base class of all the states of the machine.
+ * Events are invoked with the state and the concrete machine:
+ *
+ *   onEvent([](const LampState &state, Lamp &hsm) { return state.onSwitch(hsm); });
+ *
+ * The history takes model.historySlots() entries. Many instances can take them from one array of the
+ * caller instead of an allocation each:
+ *
+ *   std::vector<HsmStateId> history(lampModel().historySlots() * lamps);
+ *   Lamp lamp(&history[i * lampModel().historySlots()]);
+ */
+template <typename STATE> class FlyweightHsm : public FlyweightHsmBase {
+public:
+  using Machine = typename STATE::Machine;
+
+  //! The history is allocated for the instance, if the machine has states with sub states
+  explicit FlyweightHsm(const FlyweightHsmModel &model)
+      : FlyweightHsmBase(model, nullptr, 1)
+      , historySubstates(model.historySlots() ? new HsmStateId[model.historySlots()] : nullptr) {
+    std::fill_n(historySubstates.get(), model.historySlots(), NO_STATE);
+    history = historySubstates.get();
+  }
+
+  //! @param historyStorage model.historySlots() entries, which must outlive the instance
+  FlyweightHsm(const FlyweightHsmModel &model, HsmStateId *historyStorage)
+      : FlyweightHsmBase(model, historyStorage, 1) {
+    std::fill_n(historyStorage, model.historySlots(), NO_STATE);
+  }
+
+  //! Call to stimulate state machine with an event. This function will traverse the hierarchy to
+  // find a state that handles the event.
+  template <typename EVENT> bool onEvent(EVENT &&event) { return dispatch<STATE>(std::forward<EVENT>(event)); }
+
+private:
+  std::unique_ptr<HsmStateId[]> historySubstates;
+};
+
+} // namespace hsp
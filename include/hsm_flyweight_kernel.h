@@ -0,0 +1,93 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_flyweight.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace hsp {
+
+/*!
+ * Flattened transition table of one event for a flyweight machine type, used by the broadcast kernel of
+ * FlyweightHsmPopulation. The table maps the current (leaf) state of a machine to its next leaf state.
+ *
+ * Only transitions without side effects can be put in the table, i.e. the handler only takes the
+ * transition and the onExit(), onEnter() and onInit() of the involved states does nothing. All other
+ * leaves are left SCALAR and the event is dispatched to those machines through onEvent().
+ *
+ * Declare the outer states first, declarations for a state overwrite the ones of its sub states.
+ */
+class FlyweightHsmEventTable {
+public:
+  //! Entry of leaves that must be dispatched through onEvent()
+  static constexpr int32_t SCALAR = -1;
+  //! Set in entries of transitions that write history
+  static constexpr int32_t HISTORY = 0x10000;
+  static constexpr int32_t STATE_MASK = 0xFFFF;
+
+  //! History entry written when a state is exited
+  struct HistoryWrite {
+    HsmStateId superState;
+    HsmStateId subState;
+  };
+
+  explicit FlyweightHsmEventTable(const FlyweightHsmModel &model);
+
+  //! The event is handled by state without any transition
+  void ignore(const FlyweightHsmStateBase &state);
+  //! The event makes state take a transition to target, which must be a leaf
+  void transition(const FlyweightHsmStateBase &state, const FlyweightHsmStateBase &target);
+  //! The event must be dispatched through onEvent() in state
+  void scalar(const FlyweightHsmStateBase &state);
+
+  //! Entries indexed by leaf state id
+  const int32_t *entries() const { return table.data(); }
+  int32_t entry(HsmStateId leaf) const { return table[leaf]; }
+  //! History written by the transition from leaf
+  const std::vector<HistoryWrite> &historyWrites(HsmStateId leaf) const { return writes[leaf]; }
+
+private:
+  const FlyweightHsmModel &model;
+  std::vector<int32_t> table;
+  std::vector<std::vector<HistoryWrite>> writes;
+
+  template <typename FUNCTION> void forEachLeaf(HsmStateId state, FUNCTION function);
+};
+
+/*!
+ * Look up the next state of count machines in table and write it back to current. Machines in a SCALAR
+ * leaf are appended to scalar and keep their state. Machines that moved with a transition that writes
+ * history are appended to moved, together with the leaf they left.
+ * Uses AVX2 gathers when supported by the CPU, otherwise a scalar loop.
+ */
+void flyweightBroadcastKernel(const FlyweightHsmEventTable &table, HsmStateId *current, uint32_t count,
+                              std::vector<std::pair<uint32_t, HsmStateId>> &moved, std::vector<uint32_t> &scalar);
+
+//! Scalar version of flyweightBroadcastKernel()
+void flyweightBroadcastKernelScalar(const FlyweightHsmEventTable &table, HsmStateId *current, uint32_t count,
+                                    std::vector<std::pair<uint32_t, HsmStateId>> &moved,
+                                    std::vector<uint32_t> &scalar);
+
+} // namespace hsp
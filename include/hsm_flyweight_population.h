@@ -0,0 +1,199 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_flyweight_kernel.h"
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace hsp {
+
+template <typename MACHINE> class FlyweightHsmPopulation;
+
+/*!
+ * Machine of a FlyweightHsmPopulation. The population binds it to the columns of one machine while an
+ * event is dispatched, so it is only valid inside the handlers of the states. DATA is the data of each
+ * machine, accessed through data().
+ */
+template <typename STATE, typename DATA> class FlyweightHsmCursor : public FlyweightHsmBase {
+  template <typename> friend class FlyweightHsmPopulation;
+
+public:
+  using Machine = typename STATE::Machine;
+  using State = STATE;
+  using Data = DATA;
+  using Handle = uint32_t;
+
+  explicit FlyweightHsmCursor(const FlyweightHsmModel &model)
+      : FlyweightHsmBase(model, nullptr, 0) {}
+
+  //! The machine currently bound
+  Handle handle() const { return machine; }
+  DATA &data() { return *machineData; }
+
+private:
+  Handle machine = 0;
+  DATA *machineData = nullptr;
+
+  void bind(Handle handle, HsmStateId current, HsmStateId *historyColumn, uint32_t stride, DATA &data) {
+    machine = handle;
+    machineData = &data;
+    currentState = current;
+    history = historyColumn;
+    historyStride = stride;
+  }
+
+  template <typename EVENT> bool onEvent(EVENT &&event) { return dispatch<STATE>(std::forward<EVENT>(event)); }
+};
+
+/*!
+ * Runtime state of many flyweight machines of the same type, stored as columns (structure of arrays):
+ *  - current: Current state id of each machine
+ *  - history: One column per state with sub states, history[model.historySlot(state) * capacity + machine]
+ *  - pending: Flag per machine, set by setPending() and cleared by dispatchPending()
+ *  - data:    The DATA of each machine
+ * Machines are addressed by handle. An event to one machine only touches its entries in the columns, and
+ * broadcast() and dispatchPending() are linear scans over the columns.
+ *
+ * MACHINE must derive from FlyweightHsmCursor and be constructible from the model.
+ */
+template <typename MACHINE> class FlyweightHsmPopulation {
+public:
+  using Handle = typename MACHINE::Handle;
+  using State = typename MACHINE::State;
+  using Data = typename MACHINE::Data;
+
+  /*!
+   * @param capacity Max number of machines. The history columns are allocated up front.
+   */
+  FlyweightHsmPopulation(const FlyweightHsmModel &model, uint32_t capacity)
+      : capacity(capacity)
+      , cursor(model)
+      , history(size_t(model.historySlots()) * capacity, NO_STATE) {
+    current.reserve(capacity);
+    pending.reserve(capacity);
+    data.reserve(capacity);
+  }
+
+  FlyweightHsmPopulation(const FlyweightHsmPopulation &) = delete;
+  FlyweightHsmPopulation &operator=(const FlyweightHsmPopulation &) = delete;
+
+  //! Add a machine and start it
+  Handle add(Data initial = Data()) {
+    assert(current.size() < capacity && "Population is full");
+    const Handle handle = current.size();
+    current.push_back(NO_STATE);
+    pending.push_back(0);
+    data.push_back(std::move(initial));
+
+    bind(handle);
+    cursor.onStart();
+    current[handle] = cursor.currentState;
+    return handle;
+  }
+
+  uint32_t size() const { return current.size(); }
+
+  HsmStateId currentState(Handle handle) const { return current[handle]; }
+  bool isIn(Handle handle, const FlyweightHsmStateBase &state) const {
+    return cursor.model.isIn(current[handle], state.id);
+  }
+  Data &dataOf(Handle handle) { return data[handle]; }
+
+  //! Dispatch an event to one machine
+  template <typename EVENT> bool onEvent(Handle handle, EVENT &&event) {
+    bind(handle);
+    const bool handled = cursor.onEvent(std::forward<EVENT>(event));
+    current[handle] = cursor.currentState;
+    return handled;
+  }
+
+  //! Dispatch an event to all machines in handle order
+  // @return Number of machines that handled the event
+  template <typename EVENT> uint32_t broadcast(EVENT &&event) {
+    uint32_t handled = 0;
+    for (Handle handle = 0; handle < current.size(); ++handle) {
+      handled += onEvent(handle, event);
+    }
+    return handled;
+  }
+
+  /*!
+   * Dispatch an event to all machines with the broadcast kernel. The next state of the machines is looked
+   * up in the flattened table of the event, and only the machines in a SCALAR leaf get the event through
+   * onEvent() afterwards.
+   * @return Number of machines dispatched to through onEvent()
+   */
+  template <typename EVENT> uint32_t broadcast(const FlyweightHsmEventTable &table, EVENT &&event) {
+    moved.clear();
+    scalar.clear();
+    flyweightBroadcastKernel(table, current.data(), size(), moved, scalar);
+
+    for (const auto &[handle, leaf] : moved) {
+      for (const auto &write : table.historyWrites(leaf)) {
+        history[size_t(cursor.model.historySlot(write.superState)) * capacity + handle] = write.subState;
+      }
+    }
+    for (Handle handle : scalar) {
+      onEvent(handle, event);
+    }
+    return scalar.size();
+  }
+
+  //! Mark a machine for the next dispatchPending()
+  void setPending(Handle handle) { pending[handle] = 1; }
+  bool isPending(Handle handle) const { return pending[handle]; }
+
+  //! Dispatch an event to all pending machines and clear their flag
+  // @return Number of machines dispatched to
+  template <typename EVENT> uint32_t dispatchPending(EVENT &&event) {
+    uint32_t dispatched = 0;
+    for (Handle handle = 0; handle < pending.size(); ++handle) {
+      if (pending[handle]) {
+        pending[handle] = 0;
+        onEvent(handle, event);
+        ++dispatched;
+      }
+    }
+    return dispatched;
+  }
+
+private:
+  const uint32_t capacity;
+  MACHINE cursor;
+
+  std::vector<HsmStateId> current;
+  std::vector<HsmStateId> history;
+  std::vector<uint8_t> pending;
+  std::vector<Data> data;
+
+  // Follow up lists of the broadcast kernel, kept to reuse the memory
+  std::vector<std::pair<uint32_t, HsmStateId>> moved;
+  std::vector<uint32_t> scalar;
+
+  void bind(Handle handle) { cursor.bind(handle, current[handle], history.data() + handle, capacity, data[handle]); }
+};
+
+} // namespace hsp
@@ -0,0 +1,98 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_flight_recorder.h"
+#include "hsm_metrics.h"
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace hsp {
+
+class HsmStateBase;
+
+/*!
+ * Diagram of a live machine annotated with what was observed, as PlantUML or Graphviz DOT. States and
+ * transitions are coloured from white (cold) to red (hot), which points at the transitions worth
+ * flattening or caching.
+ *
+ * The hierarchy is taken from the states of a machine. Transitions and their frequency are taken from flight
+ * recorder records, dwell time and event latency from a metrics snapshot. States are hot by their total
+ * dwell time when metrics are added, otherwise by how often they were entered.
+ *
+ * HsmHeatMap map(pumpHsm.top);
+ * map.add(recorder);
+ * map.add(pumpMetrics.snapshot());
+ * map.writePlantUml(file);
+ */
+class HsmHeatMap {
+public:
+  //! @param top Top state of a machine, the states are named by HsmStateBase::name()
+  explicit HsmHeatMap(const HsmStateBase &top);
+
+  //! Records must be from machines with the same states as top. Records of states not in the tree of top,
+  // e.g. from another machine or a lazy state built after the map, are skipped.
+  void add(const HsmTraceRecord &record);
+  void add(const HsmFlightRecorder &recorder);
+  void add(const HsmMetrics::Snapshot &snapshot);
+
+  void writePlantUml(std::ostream &out) const;
+  void writeDot(std::ostream &out) const;
+
+private:
+  struct State {
+    std::string name;
+    std::vector<uint16_t> subStates;
+    uint64_t entered = 0;
+    uint64_t dwellCount = 0;
+    uint64_t dwellSum = 0;
+  };
+
+  struct Transition {
+    uint64_t count = 0;
+    //! Mean dispatch latency of the event in ns, 0 if unknown
+    uint64_t latency = 0;
+  };
+
+  //! Source, target and event
+  using TransitionKey = std::tuple<uint16_t, uint16_t, uint16_t>;
+
+  std::vector<State> states;
+  std::map<TransitionKey, Transition> transitions;
+  bool haveDwell = false;
+
+  void addState(const HsmStateBase &state);
+  uint64_t heat(const State &state) const;
+  double stateHeat(const State &state) const;
+  double transitionHeat(const Transition &transition) const;
+  std::string observations(const State &state, const char *newline) const;
+  std::string transitionLabel(const TransitionKey &key, const Transition &transition, const char *newline) const;
+  void writePlantUmlState(std::ostream &out, uint16_t index, unsigned indent) const;
+  void writeDotState(std::ostream &out, uint16_t index, unsigned indent) const;
+};
+
+} // namespace hsp
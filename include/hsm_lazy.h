@@ -0,0 +1,76 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_arena.h"
+
+#include <cassert>
+#include <functional>
+#include <utility>
+
+namespace hsp {
+
+/*!
+ * Subtree of states that is constructed in an arena the first time it is accessed, which normally is
+ * when a transition is taken to one of its states. Use it for subtrees that most instances never
+ * enter, like service modes:
+ *
+ *   HsmLazy<ServiceStates> service{arena, [this](void *memory) { return new (memory) ServiceStates(*this, &top); }};
+ *   hsm.transition(hsm.service->calibrate);
+ *
+ * Note: States of a lazy subtree can not declare HsmStateLocal data.
+ */
+template <typename T> class HsmLazy {
+public:
+  using Factory = std::function<T *(void *memory)>;
+
+  HsmLazy(HsmArena &arena, Factory factory)
+      : arena(arena)
+      , factory(std::move(factory)) {}
+  ~HsmLazy() {
+    if (object) {
+      object->~T();
+    }
+  }
+
+  HsmLazy(const HsmLazy &) = delete;
+  HsmLazy &operator=(const HsmLazy &) = delete;
+
+  T &get() {
+    if (not object) {
+      object = factory(arena.allocate(sizeof(T), alignof(T)));
+      assert(object && "Factory must construct the subtree in the given memory");
+    }
+    return *object;
+  }
+  T *operator->() { return &get(); }
+  T &operator*() { return get(); }
+
+  bool constructed() const { return object != nullptr; }
+
+private:
+  HsmArena &arena;
+  Factory factory;
+  T *object = nullptr;
+};
+
+} // namespace hsp
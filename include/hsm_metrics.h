@@ -0,0 +1,315 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_state.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace hsp {
+
+//! Clock of the metrics in nanoseconds
+inline uint64_t hsmMetricsNow() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/*!
+ * Histogram of durations in nanoseconds with power of two buckets. Bucket n counts durations in
+ * [2^(n-1), 2^n), bucket 0 counts zero.
+ */
+struct HsmHistogram {
+  static constexpr unsigned BUCKETS = 40;
+
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+  uint64_t buckets[BUCKETS] = {};
+
+  static unsigned bucketOf(uint64_t ns) {
+    const unsigned bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+  }
+
+  uint64_t mean() const { return count ? sum / count : 0; }
+  //! Upper bound of the bucket holding the fraction (0.0 - 1.0) of the durations
+  uint64_t percentile(double fraction) const;
+};
+
+/*!
+ * Metrics of all machines of one type: dwell time in each state (from onEnter() to onExit()), dispatch
+ * latency and unhandled events per event type, and how many levels events bubbled up before being handled.
+ * Attach it to the machines with HsmBase::setMetrics().
+ *
+ * Each thread updates its own shard, created the first time the thread updates the metrics. The counters
+ * of a shard are only written by its thread, so they are updated with a plain load and store. snapshot()
+ * sums the shards.
+ *
+ * CPU time accounting and bubbling per event and leaf state are opt-in, see profileCpu() and
+ * profileBubbling().
+ *
+ * Only collected when the library is built with HSM_METRICS, otherwise the hooks in the machine are
+ * compiled out.
+ */
+class HsmMetrics {
+public:
+  //! Bubble depths at or above are counted in the last entry
+  static constexpr unsigned MAX_DEPTH = 16;
+
+  //! Self time of the callbacks of a state, in hsmTimestamp() ticks. Excludes nested events.
+  struct CpuTime {
+    uint64_t ticks[HSM_CALLBACKS] = {};
+    uint64_t calls[HSM_CALLBACKS] = {};
+
+    uint64_t total() const { return ticks[0] + ticks[1] + ticks[2] + ticks[3]; }
+  };
+
+  //! Dispatches of one event type from one leaf state
+  struct Bubbling {
+    uint64_t dispatched = 0;
+    //! Sum of the number of states the event was offered to, 1 if handled by the leaf itself
+    uint64_t levels = 0;
+    //! Not handled by any state
+    uint64_t dropped = 0;
+    //! Sum of the dispatch latency
+    uint64_t ns = 0;
+  };
+
+  struct Snapshot {
+    //! Indexed by HsmStateBase::index
+    std::vector<HsmHistogram> dwell;
+    //! Dispatch latency indexed by HsmEventType::id. Entry 0 counts events with an id above the capacity.
+    std::vector<HsmHistogram> latency;
+    std::vector<uint64_t> unhandled;
+    //! Handled events per number of super states the event bubbled up to
+    uint64_t bubbleDepth[MAX_DEPTH] = {};
+    //! Updates dropped as the state index was not below stateCount
+    uint64_t unknownStates = 0;
+
+    //! Sampled CPU time per state index
+    std::vector<CpuTime> cpu;
+    //! Time of the sampled steps not spent in callbacks of the states, i.e. in the framework
+    uint64_t cpuOverhead = 0;
+    uint64_t cpuSamples = 0;
+    unsigned cpuSamplePeriod = 0;
+
+    //! Indexed by event id * number of states + leaf state index. Empty unless profileBubbling().
+    std::vector<Bubbling> bubbling;
+
+    const Bubbling &bubblingOf(uint16_t event, uint16_t leaf) const { return bubbling[event * dwell.size() + leaf]; }
+  };
+
+  /*!
+   * @param stateCount Number of states in the machine. Lazily constructed states get their index when first
+   *                   entered, so they must be included. Updates of states with a higher index are dropped
+   *                   and counted in Snapshot::unknownStates.
+   * @param eventCapacity Event type ids counted separately
+   */
+  explicit HsmMetrics(unsigned stateCount, unsigned eventCapacity = 64);
+  ~HsmMetrics();
+
+  HsmMetrics(const HsmMetrics &) = delete;
+  HsmMetrics &operator=(const HsmMetrics &) = delete;
+
+  //! Sum of all shards. Could be called from any thread.
+  Snapshot snapshot() const;
+
+  /*!
+   * Measure the self time of the event handlers, onEnter(), onExit() and onInit() of each state, and the
+   * framework overhead around them. Only one in samplePeriod run to completion steps (events, starts and
+   * stops) is measured, which bounds the overhead to two timestamps per callback of the sampled steps.
+   * 0 disables. Must be called before the metrics are attached to machines.
+   */
+  void profileCpu(unsigned samplePeriod = 64) { cpuSamplePeriod = samplePeriod; }
+
+  /*!
+   * Write a table of the CPU time per state, most expensive first. The times are estimated for all steps,
+   * i.e. scaled up by the sample period. States are named by HsmStateBase::name() of the tree under top.
+   */
+  void cpuReport(std::ostream &out, const HsmStateBase &top) const;
+
+  /*!
+   * Count how many states each event type is offered to from each leaf state before it is handled or
+   * dropped. Costs a table of event capacity * number of states per thread. Must be called before any
+   * machine using the metrics is started.
+   */
+  void profileBubbling() { bubblingEnabled = true; }
+
+  /*!
+   * Write the (event, leaf state) pairs that take the most dispatch time, at most rows of them. Pairs
+   * making up the bulk of the time are flagged when the event walks several levels before being handled
+   * ("handle lower") or dropped ("drop lower"). States are named by HsmStateBase::name() of the tree under
+   * top.
+   */
+  void bubblingReport(std::ostream &out, const HsmStateBase &top, unsigned rows = 20) const;
+
+  //! True if the step about to be run should be measured
+  bool sampleCpu() {
+    if (cpuSamplePeriod == 0) {
+      return false;
+    }
+    Shard &local = shard();
+    if (++local.cpuCountdown < cpuSamplePeriod) {
+      return false;
+    }
+    local.cpuCountdown = 0;
+    return true;
+  }
+
+  void cpuTime(uint16_t state, HsmCallback callback, uint64_t ticks) {
+    Shard &local = shard();
+    if (not known(local, state)) {
+      return;
+    }
+    add(local.cpu[state].ticks[unsigned(callback)], ticks);
+    increment(local.cpu[state].calls[unsigned(callback)]);
+  }
+
+  void cpuStep(uint64_t overhead) {
+    Shard &local = shard();
+    add(local.cpuOverhead, overhead);
+    increment(local.cpuSamples);
+  }
+
+  void dwell(uint16_t state, uint64_t ns) {
+    Shard &local = shard();
+    if (known(local, state)) {
+      add(local.dwell[state], ns);
+    }
+  }
+
+  /*!
+   * @param leaf Current state when the event was dispatched
+   * @param offered Number of states the event was offered to
+   */
+  void dispatched(uint16_t event, uint16_t leaf, unsigned offered, bool handled, uint64_t ns) {
+    Shard &local = shard();
+    const uint16_t slot = event < eventCapacity ? event : 0;
+    add(local.latency[slot], ns);
+    if (handled) {
+      const unsigned depth = offered - 1;
+      increment(local.bubbleDepth[depth < MAX_DEPTH ? depth : MAX_DEPTH - 1]);
+    } else {
+      increment(local.unhandled[slot]);
+    }
+    if (local.bubbling && known(local, leaf)) {
+      Shard::Bubbling &pair = local.bubbling[slot * stateCount + leaf];
+      increment(pair.dispatched);
+      add(pair.levels, offered);
+      if (not handled) {
+        increment(pair.dropped);
+      }
+      add(pair.ns, ns);
+    }
+  }
+
+private:
+  //! Only written by the thread owning the shard
+  using Counter = std::atomic<uint64_t>;
+
+  struct Histogram {
+    Counter count{0};
+    Counter sum{0};
+    Counter max{0};
+    Counter buckets[HsmHistogram::BUCKETS] = {};
+  };
+
+  struct Shard {
+    Shard(unsigned stateCount, unsigned eventCapacity, bool bubbling);
+
+    std::unique_ptr<Histogram[]> dwell;
+    std::unique_ptr<Histogram[]> latency;
+    std::unique_ptr<Counter[]> unhandled;
+    Counter bubbleDepth[MAX_DEPTH] = {};
+
+    struct Cpu {
+      Counter ticks[HSM_CALLBACKS] = {};
+      Counter calls[HSM_CALLBACKS] = {};
+    };
+    std::unique_ptr<Cpu[]> cpu;
+    Counter cpuOverhead{0};
+    Counter cpuSamples{0};
+    Counter unknownStates{0};
+    //! Only used by the owning thread
+    unsigned cpuCountdown = 0;
+
+    struct Bubbling {
+      Counter dispatched{0};
+      Counter levels{0};
+      Counter dropped{0};
+      Counter ns{0};
+    };
+    //! nullptr unless profiled
+    std::unique_ptr<Bubbling[]> bubbling;
+  };
+
+  const unsigned stateCount;
+  const unsigned eventCapacity;
+  //! Index into the thread local shard tables, reused after destruction
+  const uint32_t id;
+  //! Never reused, tells the shard of this metrics from one of a destroyed metrics with the same id
+  const uint64_t generation;
+  unsigned cpuSamplePeriod = 0;
+  bool bubblingEnabled = false;
+
+  mutable std::mutex shardsMutex;
+  std::vector<std::unique_ptr<Shard>> shards;
+
+  static void increment(Counter &counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  static void add(Counter &counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  //! Out of range indices are dropped, like event ids above the capacity, so a miscounted machine cannot
+  // write past the tables
+  bool known(Shard &local, uint16_t state) {
+    if (state < stateCount) {
+      return true;
+    }
+    increment(local.unknownStates);
+    return false;
+  }
+
+  static void add(Histogram &histogram, uint64_t ns) {
+    increment(histogram.count);
+    add(histogram.sum, ns);
+    if (ns > histogram.max.load(std::memory_order_relaxed)) {
+      histogram.max.store(ns, std::memory_order_relaxed);
+    }
+    increment(histogram.buckets[HsmHistogram::bucketOf(ns)]);
+  }
+
+  Shard &shard();
+  Shard &addShard();
+};
+
+} // namespace hsp
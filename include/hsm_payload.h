@@ -0,0 +1,139 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace hsp {
+
+template <typename T> class HsmPayload;
+
+/*!
+ * Arena for event payloads. Payloads are constructed in place and referenced by the events, so large
+ * payloads like sensor frames are never copied. The memory is reclaimed in bulk with release(), which a
+ * Hsm does after each run to completion step when the arena is attached with setPayloadArena(). An arena
+ * could also be shared by a queue of events and released when the queue is drained.
+ *
+ * Memory is allocated in blocks that are kept and reused after release().
+ */
+class HsmPayloadArena {
+public:
+  explicit HsmPayloadArena(std::size_t blockSize = 64 * 1024);
+  ~HsmPayloadArena();
+
+  HsmPayloadArena(const HsmPayloadArena &) = delete;
+  HsmPayloadArena &operator=(const HsmPayloadArena &) = delete;
+
+  //! Construct a payload in the arena
+  template <typename T, typename... ARGS> HsmPayload<T> make(ARGS &&...args);
+
+  //! Destroy all payloads and reclaim the memory. All payloads handed out are invalid afterwards.
+  void release();
+
+  //! Bytes in use since last release()
+  std::size_t used() const { return usedBytes; }
+  //! Payloads constructed since last release()
+  std::size_t count() const { return payloads; }
+  //! Bytes of the blocks allocated, kept over release()
+  std::size_t capacity() const { return capacityBytes; }
+
+private:
+  //! Put in front of payloads with a destructor
+  struct Destructor {
+    void (*destroy)(void *object);
+    void *object;
+    Destructor *next;
+  };
+
+  struct Block {
+    std::unique_ptr<std::max_align_t[]> memory;
+    std::size_t size;
+  };
+
+  const std::size_t blockSize;
+  std::vector<Block> blocks;
+  std::size_t block = 0;
+  std::size_t offset = 0;
+  std::size_t usedBytes = 0;
+  std::size_t capacityBytes = 0;
+  std::size_t payloads = 0;
+  Destructor *destructors = nullptr;
+
+  void *allocate(std::size_t size, std::size_t alignment);
+};
+
+/*!
+ * Move only handle to a payload in a HsmPayloadArena. The handle does not own the payload, it is valid
+ * until the arena is released. Handlers get the payload by reference:
+ *
+ *   bool onFrame(HsmPayload<Frame> frame) {
+ *     return onEvent([&](PumpState &state) { return state.onFrame(*frame); });
+ *   }
+ */
+template <typename T> class HsmPayload {
+public:
+  HsmPayload() = default;
+  HsmPayload(HsmPayload &&other)
+      : object(std::exchange(other.object, nullptr)) {}
+  HsmPayload &operator=(HsmPayload &&other) {
+    object = std::exchange(other.object, nullptr);
+    return *this;
+  }
+  HsmPayload(const HsmPayload &) = delete;
+  HsmPayload &operator=(const HsmPayload &) = delete;
+
+  T &operator*() const { return *object; }
+  T *operator->() const { return object; }
+  T *get() const { return object; }
+  explicit operator bool() const { return object != nullptr; }
+
+private:
+  friend class HsmPayloadArena;
+  explicit HsmPayload(T *object)
+      : object(object) {}
+
+  T *object = nullptr;
+};
+
+template <typename T, typename... ARGS> HsmPayload<T> HsmPayloadArena::make(ARGS &&...args) {
+  if constexpr (std::is_trivially_destructible<T>::value) {
+    T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<ARGS>(args)...);
+    ++payloads;
+    return HsmPayload<T>(object);
+  } else {
+    Destructor *destructor = new (allocate(sizeof(Destructor), alignof(Destructor))) Destructor;
+    T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<ARGS>(args)...);
+    // Only registered when constructed, a throwing constructor leaves nothing to destroy
+    *destructor = {[](void *object) { static_cast<T *>(object)->~T(); }, object, destructors};
+    destructors = destructor;
+    ++payloads;
+    return HsmPayload<T>(object);
+  }
+}
+
+} // namespace hsp
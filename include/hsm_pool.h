@@ -0,0 +1,131 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm.h"
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace hsp {
+
+/*!
+ * Pool of machines that are reused instead of being destroyed and constructed again. acquire() hands out
+ * a started machine, and when the handle is destroyed the machine is stopped, reset and returned to the
+ * pool.
+ *
+ * Note: Instance data of the machine outside the states is not reset, clear it in onExit() of the top
+ * state.
+ * Note: Not thread safe, and the pool must outlive all handles.
+ */
+template <typename MACHINE> class HsmPool {
+public:
+  static_assert(std::is_base_of<HsmBase, MACHINE>::value);
+
+  using Factory = std::function<std::unique_ptr<MACHINE>()>;
+
+  //! Owner of a machine acquired from the pool
+  class Handle {
+  public:
+    Handle() = default;
+    Handle(Handle &&other)
+        : pool(std::exchange(other.pool, nullptr))
+        , machine(std::exchange(other.machine, nullptr)) {}
+    Handle &operator=(Handle &&other) {
+      release();
+      pool = std::exchange(other.pool, nullptr);
+      machine = std::exchange(other.machine, nullptr);
+      return *this;
+    }
+    ~Handle() { release(); }
+
+    MACHINE *operator->() const { return machine; }
+    MACHINE &operator*() const { return *machine; }
+    explicit operator bool() const { return machine != nullptr; }
+
+    //! Return the machine to the pool
+    void release() {
+      if (machine) {
+        pool->recycle(*machine);
+        pool = nullptr;
+        machine = nullptr;
+      }
+    }
+
+  private:
+    friend class HsmPool;
+    Handle(HsmPool &pool, MACHINE &machine)
+        : pool(&pool)
+        , machine(&machine) {}
+
+    HsmPool *pool = nullptr;
+    MACHINE *machine = nullptr;
+  };
+
+  explicit HsmPool(Factory factory = [] { return std::make_unique<MACHINE>(); })
+      : factory(std::move(factory)) {}
+  ~HsmPool() { assert(free.size() == machines.size() && "All handles must be released before the pool"); }
+
+  HsmPool(const HsmPool &) = delete;
+  HsmPool &operator=(const HsmPool &) = delete;
+
+  //! Get a started machine, constructed only if the pool is empty
+  Handle acquire() {
+    if (free.empty()) {
+      reserve(machines.size() + 1);
+    }
+    MACHINE &machine = *free.back();
+    free.pop_back();
+    machine.onStart();
+    return Handle(*this, machine);
+  }
+
+  //! Construct machines up to count in advance
+  void reserve(std::size_t count) {
+    while (machines.size() < count) {
+      machines.push_back(factory());
+      free.push_back(machines.back().get());
+    }
+  }
+
+  //! Machines constructed by the pool
+  std::size_t size() const { return machines.size(); }
+  //! Machines ready to be acquired
+  std::size_t available() const { return free.size(); }
+
+private:
+  Factory factory;
+  std::vector<std::unique_ptr<MACHINE>> machines;
+  std::vector<MACHINE *> free;
+
+  void recycle(MACHINE &machine) {
+    machine.onStop();
+    machine.reset();
+    free.push_back(&machine);
+  }
+};
+
+} // namespace hsp
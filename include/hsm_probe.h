@@ -0,0 +1,44 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+/*!
+ * USDT (SystemTap/DTrace style) static tracepoints of the provider "hsm". Enabled by building with the CMake
+ * option HSM_USDT, which needs sys/sdt.h (systemtap-sdt-dev or similar). Each probe is a single nop until a
+ * tracer like bpftrace or perf attaches to it, e.g.
+ *   bpftrace -e 'usdt:./app:hsm:dispatch__start { @[arg2] = count(); }'
+ *
+ * Probes, all with the arguments (machine, state, event id):
+ *  - dispatch__start: Event offered to the current state
+ *  - dispatch__end:   Event done, state is the state that handled it or null
+ *  - exit:            After onExit() of state
+ *  - enter:           After onEnter() of state
+ *  - initial:         Initial transition to state
+ */
+#ifdef HSM_USDT
+#include <sys/sdt.h>
+#define HSM_PROBE(name, machine, state, event) DTRACE_PROBE3(hsm, name, machine, state, event)
+#else
+#define HSM_PROBE(name, machine, state, event) \
+  do {                                         \
+  } while (0)
+#endif
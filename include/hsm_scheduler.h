@@ -0,0 +1,186 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_correlation.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace hsp {
+
+/*!
+ * Cooperative single threaded scheduler for many Hsm's sharing one thread.
+ *
+ * Each machine has a mailbox of events. The scheduler serves the mailboxes in slices, where each machine
+ * dispatches at most its quota of events per slice. A machine flooded with events can therefore not
+ * starve the other machines. Two policies are supported:
+ *  - RoundRobin: Mailboxes are served in turn and each mailbox is FIFO.
+ *  - EarliestDeadlineFirst: The event with the earliest deadline among all mailboxes is dispatched first.
+ *    Events without a deadline are dispatched after those with one, and events with equal deadlines
+ *    keep the order they were posted in.
+ * Per machine latency (post to dispatch) and backlog statistics are collected. Deadline misses, i.e.
+ * events completing after their deadline, are counted per machine and per event type. Events are
+ * dispatched with the correlation of the thread posting them.
+ * Note: Not thread safe. Events must be posted from the thread running the scheduler, typically from
+ * other events or actions. Use e.g. a HsmEventLoop to get events in from other threads.
+ */
+class HsmScheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+  using MachineId = unsigned;
+  //! User defined id of an event, used for the deadline statistics
+  using EventType = unsigned;
+
+  enum class Policy { RoundRobin, EarliestDeadlineFirst };
+
+  struct DeadlineStats {
+    //! Events posted with a deadline
+    uint64_t dispatched = 0;
+    uint64_t misses = 0;
+    //! Worst time from deadline to completion of the event
+    Clock::duration maxLateness{0};
+  };
+
+  struct MachineStats {
+    uint64_t posted = 0;
+    uint64_t dispatched = 0;
+    //! Events waiting in the mailbox
+    size_t backlog = 0;
+    size_t maxBacklog = 0;
+    //! Time from post() to dispatch
+    Clock::duration totalLatency{0};
+    Clock::duration maxLatency{0};
+    DeadlineStats deadlines;
+
+    Clock::duration meanLatency() const { return dispatched ? totalLatency / static_cast<Clock::rep>(dispatched) : Clock::duration(0); }
+  };
+
+  /*!
+   * @param defaultQuota Events dispatched per machine per slice, if not given when the machine is added.
+   */
+  explicit HsmScheduler(unsigned defaultQuota = 1, Policy policy = Policy::RoundRobin);
+
+  /*!
+   * Add a mailbox for a machine
+   * @param quota Events dispatched per slice, 0 is the default quota
+   * @return Id used to post events to the machine
+   */
+  MachineId addMachine(unsigned quota = 0);
+  void setQuota(MachineId machine, unsigned quota);
+
+  //! Queue an event (e.g. [&] { pump.onStandby(); }) in the mailbox of the machine
+  void post(MachineId machine, std::function<void()> event);
+
+  /*!
+   * Queue an event that must be completed before deadline.
+   * @param type Event type the deadline statistics is collected for
+   */
+  void post(MachineId machine, std::function<void()> event, Clock::time_point deadline, EventType type = 0);
+
+  /*!
+   * Serve each machine with pending events once.
+   * @return Number of dispatched events
+   */
+  unsigned runSlice();
+
+  /*!
+   * Run slices until all mailboxes are empty.
+   * @return Number of dispatched events
+   */
+  uint64_t run();
+
+  const MachineStats &stats(MachineId machine) const { return mailboxes[machine].stats; }
+  //! Deadline statistics of an event type. Zero if no events of the type had a deadline.
+  DeadlineStats deadlineStats(EventType type) const;
+  size_t machines() const { return mailboxes.size(); }
+  //! Total number of events waiting in all mailboxes
+  size_t backlog() const { return pending; }
+
+private:
+  static constexpr Clock::time_point NO_DEADLINE = Clock::time_point::max();
+
+  struct Event {
+    std::function<void()> dispatch;
+    Clock::time_point posted;
+    Clock::time_point deadline;
+    //! Deadline used for ordering. NO_DEADLINE for all events when round-robin.
+    Clock::time_point due;
+    EventType type;
+    //! Order of posting
+    uint64_t sequence;
+    HsmCorrelationId correlation;
+  };
+
+  //! Order of events in a mailbox. Heap ordered, so the top is the next event to dispatch.
+  struct Later {
+    bool operator()(const Event &a, const Event &b) const { return a.due != b.due ? a.due > b.due : a.sequence > b.sequence; }
+  };
+
+  //! Key of a ready mailbox, used by EarliestDeadlineFirst to find the most urgent mailbox
+  struct Urgency {
+    Clock::time_point deadline;
+    uint64_t sequence;
+    MachineId machine;
+    bool operator<(const Urgency &other) const { return deadline != other.deadline ? deadline < other.deadline : sequence < other.sequence; }
+  };
+
+  struct Mailbox {
+    unsigned quota;
+    std::vector<Event> events;
+    //! True when in the ready queue (RoundRobin) or urgent set (EarliestDeadlineFirst)
+    bool ready = false;
+    //! Key in the urgent set
+    Urgency urgency;
+    //! Events dispatched in current slice, used by EarliestDeadlineFirst
+    unsigned used = 0;
+    MachineStats stats;
+  };
+
+  const unsigned defaultQuota;
+  const Policy policy;
+  //! A deque as events could add machines while a mailbox is referenced
+  std::deque<Mailbox> mailboxes;
+  //! Machines with a non empty mailbox in round-robin order
+  std::deque<MachineId> ready;
+  //! Machines with a non empty mailbox and quota left, ordered by the deadline of their next event
+  std::set<Urgency> urgent;
+  //! Machines that used their quota in current slice
+  std::vector<MachineId> exhausted;
+  std::unordered_map<EventType, DeadlineStats> typeStats;
+  size_t pending = 0;
+  uint64_t sequence = 0;
+
+  void makeReady(MachineId machine);
+  void makeUrgent(MachineId machine);
+  Urgency urgencyOf(MachineId machine) const;
+  unsigned runRoundRobinSlice();
+  unsigned runEarliestDeadlineSlice();
+  void dispatch(Mailbox &mailbox);
+};
+
+} // namespace hsp
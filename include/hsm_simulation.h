@@ -0,0 +1,144 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_correlation.h"
+#include "hsm_executor.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace hsp {
+
+/*!
+ * Discrete event simulation runtime with a virtual clock.
+ *
+ * Events are scheduled at a virtual time and dispatched in time order by run(). The clock jumps
+ * directly to the next deadline, so days of timer driven behavior of many Hsm's run in seconds.
+ * Events scheduled for the same time are dispatched in the order they were scheduled, which together
+ * with the seeded random generator makes a simulation deterministic. Events are dispatched with the
+ * correlation of the code scheduling them.
+ * Note: Not thread safe. Everything must happen on the thread running the simulation.
+ */
+class HsmSimulation : public IExecutor {
+public:
+  using Duration = std::chrono::nanoseconds;
+  //! Virtual time since start of simulation
+  using TimePoint = Duration;
+  using EventId = uint64_t;
+
+  explicit HsmSimulation(uint64_t seed = 0);
+
+  //! Current virtual time
+  TimePoint now() const { return currentTime; }
+
+  //! Random generator to be used by the simulated environment
+  std::mt19937_64 &random() { return generator; }
+
+  /*!
+   * Schedule event at now() + delay
+   * @return Id to use for cancel()
+   */
+  EventId schedule(Duration delay, std::function<void()> event);
+  void cancel(EventId id);
+
+  //! Schedule event at now()
+  void post(std::function<void()> event) override;
+
+  /*!
+   * Advance the clock to the next event and dispatch it.
+   * @return false if no events are scheduled
+   */
+  bool step();
+
+  /*!
+   * Dispatch events until no more events are scheduled before end. The clock is left at end.
+   * @return Number of dispatched events
+   */
+  uint64_t runUntil(TimePoint end);
+
+  //! Statistics of all run's
+  uint64_t dispatched() const { return dispatchedEvents; }
+  Duration simulated() const { return currentTime; }
+  std::chrono::duration<double> elapsed() const { return wallTime; }
+  //! Dispatched events per wall clock second
+  double eventsPerSecond() const;
+
+private:
+  struct Entry {
+    TimePoint time;
+    EventId id; // Also the order of scheduling
+    bool operator>(const Entry &other) const { return time != other.time ? time > other.time : id > other.id; }
+  };
+
+  struct Scheduled {
+    std::function<void()> event;
+    HsmCorrelationId correlation;
+  };
+
+  TimePoint currentTime{0};
+  EventId nextId = 0;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+  //! Events not yet dispatched or cancelled. Cancelled entries are skipped when they reach the top of the queue.
+  std::unordered_map<EventId, Scheduled> events;
+  std::mt19937_64 generator;
+
+  uint64_t dispatchedEvents = 0;
+  std::chrono::duration<double> wallTime{0};
+
+  //! Pop cancelled entries from the top of the queue
+  void dropCancelled();
+};
+
+/*!
+ * One shot timer expiring in virtual time. Has the same shape as the timers of a HsmEventLoop.
+ */
+class HsmSimulationTimer {
+public:
+  HsmSimulationTimer(HsmSimulation &simulation, HsmSimulation::Duration timeout);
+  ~HsmSimulationTimer();
+
+  HsmSimulationTimer(const HsmSimulationTimer &) = delete;
+  HsmSimulationTimer &operator=(const HsmSimulationTimer &) = delete;
+
+  //! (Re)start the timer. A running timer is restarted.
+  void start(std::function<void()> timeoutCallback);
+  //! Cancel the timer if running
+  void cancel();
+  bool running() const { return isRunning; }
+
+  //! Change the timeout used by next start()
+  void setTimeout(HsmSimulation::Duration newTimeout) { timeout = newTimeout; }
+
+private:
+  HsmSimulation &simulation;
+  HsmSimulation::Duration timeout;
+  HsmSimulation::EventId event = 0;
+  bool isRunning = false;
+};
+
+} // namespace hsp
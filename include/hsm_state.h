@@ -21,8 +21,14 @@
 // SOFTWARE.
 #pragma once
 
+#include <cstdint>
+
 namespace hsp {
 
+//! Code of a state called by the machine, used for CPU time accounting
+enum class HsmCallback : uint8_t { HANDLER, ENTER, EXIT, INIT };
+constexpr unsigned HSM_CALLBACKS = 4;
+
 /*!
  * Class to encapsulate a state in a Hsm (Hierarchical State Machine)
  */
@@ -53,6 +59,10 @@ public:
    * should be entered.
    */
   virtual void onInit();
+  /*!
+   * Name of the state in traces. Override to name the state, nullptr gives a name from the index.
+   */
+  virtual const char *name() const;
 
   // FIXME make private
   /*!
@@ -63,6 +73,26 @@ public:
    * Pointer to last active sub state
    */
   HsmStateBase *historySubstate = nullptr;
+  /*!
+   * Sub states are linked from first sub state through next sibling, used to traverse the whole tree
+   */
+  HsmStateBase *firstSubstate = nullptr;
+  HsmStateBase *nextSibling = nullptr;
+  /*!
+   * Index of the state in the tree in order of construction, the top state is 0. Used to identify
+   * states in traces.
+   */
+  uint16_t index = 0;
+  /*!
+   * Number of states in the tree, only counted in the top state
+   */
+  uint16_t stateCount = 1;
+#ifdef HSM_METRICS
+  /*!
+   * Time of last onEnter(), when the machine collects metrics
+   */
+  uint64_t enteredAt = 0;
+#endif
 };
 
 template <typename CONTEXT> class HsmState : public HsmStateBase {
@@ -70,9 +100,20 @@ public:
   using HsmStateBase::HsmStateBase;
 
 private:
-  template <typename T> friend class Hsm;
+  template <typename, typename> friend class Hsm;
 
   template <typename EVENT> bool onEvent(EVENT &&event) { return (event)(static_cast<CONTEXT &>(*this)); }
 }; // namespace hsp
 
+/*!
+ * Call visit(state) for state and all states below it. A state is visited before its sub states, the sub
+ * states in reverse order of construction. STATE is HsmStateBase or const HsmStateBase.
+ */
+template <typename STATE, typename VISIT> void hsmVisitStates(STATE &state, VISIT &&visit) {
+  visit(state);
+  for (STATE *subState = state.firstSubstate; subState; subState = subState->nextSibling) {
+    hsmVisitStates(*subState, visit);
+  }
+}
+
 } // namespace hsp
@@ -0,0 +1,136 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_state.h"
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace hsp {
+
+/*!
+ * Storage area for the data of the active states of one machine. Data of a state is placed right after
+ * the data of its nearest super state with data, so sibling states share the same bytes like a
+ * hierarchical std::variant. The size of the area is the size of the largest path in the hierarchy.
+ *
+ * The data is declared with HsmStateLocal members, which must all be constructed before the first
+ * emplace(). The HsmStateLocal members refer to the storage until destroyed, so the machine must declare
+ * its members in this order:
+ *
+ *   HsmStateStorage storage;             // Before the states, so it is destroyed after them
+ *   StateTop top{*this, nullptr};        // Super states before their sub states
+ *   StatePulsing pulsing{*this, &top};
+ *   StateRunning running{*this, &pulsing};
+ */
+class HsmStateStorage {
+  template <typename T> friend class HsmStateLocal;
+
+public:
+  HsmStateStorage() = default;
+  ~HsmStateStorage() { assert(locals == 0 && "The storage must be declared before the states using it"); }
+  HsmStateStorage(const HsmStateStorage &) = delete;
+  HsmStateStorage &operator=(const HsmStateStorage &) = delete;
+
+  //! Bytes needed for the largest path
+  std::size_t size() const { return maxSize; }
+
+private:
+  //! End of the data placed for a state
+  struct Placement {
+    const HsmStateBase *state;
+    std::size_t end;
+  };
+
+  std::vector<Placement> placements;
+  std::size_t maxSize = 0;
+  std::unique_ptr<std::max_align_t[]> area;
+  //! HsmStateLocal not destroyed yet
+  std::size_t locals = 0;
+
+  std::size_t place(const HsmStateBase &owner, std::size_t size, std::size_t alignment);
+  void *at(std::size_t offset);
+};
+
+/*!
+ * Data of a state that only exists while the state is active. Construct it in onEnter() with emplace() and
+ * destroy it in onExit() with destroy():
+ *
+ *   class StatePulsing : public PumpControlHsmState {
+ *     // hsm.storage is declared before the states, see HsmStateStorage
+ *     HsmStateLocal<Pulses> pulses{hsm.storage, *this};
+ *     void onEnter() override { pulses.emplace(); }
+ *     void onExit() override { pulses.destroy(); }
+ *   };
+ */
+template <typename T> class HsmStateLocal {
+public:
+  static_assert(alignof(T) <= alignof(std::max_align_t));
+
+  HsmStateLocal(HsmStateStorage &storage, const HsmStateBase &owner)
+      : storage(storage)
+      , offset(storage.place(owner, sizeof(T), alignof(T))) {
+    ++storage.locals;
+  }
+  ~HsmStateLocal() {
+    destroy();
+    --storage.locals;
+  }
+
+  HsmStateLocal(const HsmStateLocal &) = delete;
+  HsmStateLocal &operator=(const HsmStateLocal &) = delete;
+
+  template <typename... ARGS> T &emplace(ARGS &&...args) {
+    assert(not constructed && "State data is already constructed");
+    T *data = new (storage.at(offset)) T(std::forward<ARGS>(args)...);
+    constructed = true;
+    return *data;
+  }
+
+  void destroy() {
+    if (constructed) {
+      get().~T();
+      constructed = false;
+    }
+  }
+
+  bool active() const { return constructed; }
+  std::size_t storageOffset() const { return offset; }
+
+  T &get() {
+    assert(constructed && "State data is only available while the state is active");
+    return *std::launder(static_cast<T *>(storage.at(offset)));
+  }
+  T *operator->() { return &get(); }
+  T &operator*() { return get(); }
+
+private:
+  HsmStateStorage &storage;
+  const std::size_t offset;
+  bool constructed = false;
+};
+
+} // namespace hsp
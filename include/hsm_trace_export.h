@@ -0,0 +1,104 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_flight_recorder.h"
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace hsp {
+
+class HsmStateBase;
+
+/*!
+ * Writes trace records as a Chrome Trace Event JSON file, which can be opened in Perfetto or
+ * chrome://tracing. Each machine gets a track, states are nested duration slices following the hierarchy
+ * and events are instant markers.
+ *
+ * The records are streamed to the output as they are added, so traces larger than memory can be converted.
+ * Only the names and the set of machines seen are kept.
+ *
+ * HsmTraceExporter exporter(file);
+ * exporter.nameStates(pumpHsm.top);
+ * exporter.add(recorder);
+ * exporter.finish();
+ */
+class HsmTraceExporter {
+public:
+  /*!
+   * @param timestampsPerMicrosecond Rate of HsmTraceRecord::timestamp
+   */
+  explicit HsmTraceExporter(std::ostream &out, double timestampsPerMicrosecond = hsmTimestampsPerMicrosecond());
+  //! Calls finish()
+  ~HsmTraceExporter();
+
+  HsmTraceExporter(const HsmTraceExporter &) = delete;
+  HsmTraceExporter &operator=(const HsmTraceExporter &) = delete;
+
+  //! Name the states by HsmStateBase::name() of the tree under top. States without a name are "state <index>".
+  void nameStates(const HsmStateBase &top);
+  //! Name the states of one machine, when machines of different types share a recorder
+  void nameStates(uint32_t machine, const HsmStateBase &top);
+  //! Name the track of machine, default is "machine <id>"
+  void nameMachine(uint32_t machine, const std::string &name);
+
+  //! Records are expected in the order they were recorded. EXIT records without the ENTER record, e.g. when
+  // the ENTER was overwritten in a wrapped recorder, are dropped.
+  void add(const HsmTraceRecord &record);
+  void add(const HsmTraceRecord *records, std::size_t count);
+  //! Add the records in the recorder. The timestamps start at the earliest record.
+  void add(const HsmFlightRecorder &recorder);
+
+  //! Terminate the JSON. No records can be added afterwards.
+  void finish();
+
+private:
+  using Names = std::vector<std::string>;
+
+  std::ostream &out;
+  const double timestampsPerMicrosecond;
+  bool first = true;
+  bool finished = false;
+  bool started = false;
+  uint64_t origin = 0;
+
+  Names stateNames;
+  std::unordered_map<uint32_t, Names> machineStateNames;
+  std::unordered_map<uint32_t, std::string> machineNames;
+  std::unordered_set<uint32_t> machines;
+  //! Number of ENTER records without EXIT per machine
+  std::unordered_map<uint32_t, unsigned> openSlices;
+
+  void beginEvent();
+  void writeTrack(uint32_t machine);
+  void writeTimestamp(uint64_t timestamp);
+  void writeState(uint32_t machine, uint16_t state);
+  void writeEventName(uint16_t event);
+  void writeString(const char *text, std::size_t length);
+};
+
+} // namespace hsp
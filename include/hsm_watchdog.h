@@ -0,0 +1,191 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+
+#include "hsm_state.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace hsp {
+
+class HsmBase;
+class HsmWatchdog;
+
+/*!
+ * Progress of one watched machine. Updated by the thread running the machine, read by the monitor thread.
+ * Times are in hsmTimestamp() ticks.
+ */
+class HsmWatchdogSlot {
+  friend class HsmWatchdog;
+
+public:
+  void beginStep(uint64_t timestamp) {
+    slowestTicks = 0;
+    steps.store(steps.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    stepBegin.store(timestamp, std::memory_order_release);
+  }
+
+  void endStep(uint64_t elapsed);
+
+  //! @return Activity of the enclosing callback, to be restored by endCallback()
+  uint32_t beginCallback(uint16_t state, HsmCallback callback) {
+    const uint32_t outer = activity.load(std::memory_order_relaxed);
+    activity.store(activityOf(state, callback), std::memory_order_relaxed);
+    return outer;
+  }
+
+  //! @param self Time of the callback, except callbacks nested within
+  void endCallback(uint16_t state, HsmCallback callback, uint64_t self, uint32_t outer) {
+    if (self > slowestTicks) {
+      slowestTicks = self;
+      slowest = activityOf(state, callback);
+    }
+    activity.store(outer, std::memory_order_relaxed);
+  }
+
+private:
+  HsmWatchdogSlot(HsmWatchdog &watchdog, HsmBase &hsm, uint64_t budget, uint32_t machine)
+      : watchdog(watchdog)
+      , hsm(hsm)
+      , budget(budget)
+      , machine(machine) {}
+
+  //! State index + 1 and callback, 0 when no callback is running
+  static uint32_t activityOf(uint16_t state, HsmCallback callback) {
+    return (uint32_t(state) + 1) << 8 | uint32_t(callback);
+  }
+
+  HsmWatchdog &watchdog;
+  HsmBase &hsm;
+  const uint64_t budget;
+  const uint32_t machine;
+  //! Indexed by HsmStateBase::index
+  std::vector<const HsmStateBase *> states;
+
+  //! Beginning of the running step, 0 between steps
+  std::atomic<uint64_t> stepBegin{0};
+  std::atomic<uint64_t> steps{0};
+  //! Callback running right now
+  std::atomic<uint32_t> activity{0};
+
+  //! Slowest callback of the running step, only used by the machine thread
+  uint32_t slowest = 0;
+  uint64_t slowestTicks = 0;
+
+  //! Last step reported by the monitor, so a stalled step is reported once
+  uint64_t reportedStep = 0;
+};
+
+/*!
+ * Reports run to completion steps exceeding the latency budget of their machine. A callback blocking in a
+ * state, e.g. a slow pump.on() in onEnter(), otherwise stalls the machine silently.
+ *
+ * Watched machines time each callback of their states. When a step is over budget, the machine thread
+ * reports it as it completes, naming the callback with the most self time. A blocked step never completes,
+ * so the monitor thread started by startMonitor() (or periodic calls of check()) reports running steps
+ * already over budget, naming the callback running right now. A step could be reported by both.
+ *
+ * HsmWatchdog watchdog([](const HsmWatchdog::Overrun &overrun) { std::cerr << overrun << '\n'; });
+ * watchdog.watch(pumpHsm, std::chrono::milliseconds(5));
+ * watchdog.startMonitor(std::chrono::milliseconds(1));
+ *
+ * Note: Needs HSM_WATCHDOG. A machine is watched by one watchdog and must be unwatched before it is destroyed.
+ * watch() and unwatch() must not be called while the machine is running a step.
+ */
+class HsmWatchdog {
+public:
+  struct Overrun {
+    //! state when no callback was running
+    static constexpr uint16_t NO_STATE = UINT16_MAX;
+
+    uint32_t machine;
+    //! Index of the state of the callback with the most self time, or the one running right now if stalled.
+    // Copied, so the overrun stays valid after the machine is destroyed.
+    uint16_t state;
+    //! Name of the state, empty if unnamed or no callback was running
+    std::string stateName;
+    HsmCallback callback;
+    //! True if reported by the monitor while the step is still running
+    bool stalled;
+    //! Time of the step, so far if stalled
+    std::chrono::nanoseconds elapsed;
+    //! Self time of the callback, not known if stalled
+    std::chrono::nanoseconds callbackTime;
+    std::chrono::nanoseconds budget;
+  };
+
+  //! Called on the machine thread, or the monitor thread if stalled
+  using Reporter = std::function<void(const Overrun &overrun)>;
+
+  explicit HsmWatchdog(Reporter reporter);
+  ~HsmWatchdog();
+
+  HsmWatchdog(const HsmWatchdog &) = delete;
+  HsmWatchdog &operator=(const HsmWatchdog &) = delete;
+
+  //! Report steps of hsm longer than budget. machine identifies the machine in the reports.
+  void watch(HsmBase &hsm, std::chrono::nanoseconds budget, uint32_t machine = 0);
+  void unwatch(HsmBase &hsm);
+
+  //! Check the running steps every period on a thread of the watchdog
+  void startMonitor(std::chrono::nanoseconds period);
+  void stopMonitor();
+
+  /*!
+   * Report the running steps that are over budget and not reported yet. Called by the monitor thread, but
+   * could also be called from a timer etc. of the application.
+   * @return Number of steps reported
+   */
+  unsigned check();
+
+private:
+  friend class HsmWatchdogSlot;
+
+  const Reporter reporter;
+  const double ticksPerNanosecond;
+
+  std::mutex slotsMutex;
+  std::vector<std::unique_ptr<HsmWatchdogSlot>> slots;
+
+  std::mutex monitorMutex;
+  std::condition_variable monitorWakeup;
+  bool monitorStopped = false;
+  std::thread monitor;
+
+  Overrun overrun(const HsmWatchdogSlot &slot, uint32_t activity, bool stalled, uint64_t elapsed,
+                  uint64_t callbackTicks) const;
+};
+
+//! One line describing the overrun, e.g. "machine 2 stalled in Running::onEnter() for 12.0 ms, budget 5.0 ms"
+std::ostream &operator<<(std::ostream &out, const HsmWatchdog::Overrun &overrun);
+
+} // namespace hsp
@@ -21,6 +21,18 @@
 // SOFTWARE.
 
 #include "hsm.h"
+#include "hsm_flight_recorder.h"
+#include "hsm_probe.h"
+#ifdef HSM_METRICS
+#include "hsm_metrics.h"
+#endif
+#ifdef HSM_WATCHDOG
+#include "hsm_watchdog.h"
+#endif
+#ifndef HSM_FREESTANDING
+#include "hsm_correlation.h"
+#include "hsm_payload.h"
+#endif
 
 #include <cassert>
 
@@ -29,147 +41,281 @@ namespace hsp {
 HsmBase::HsmBase(HsmStateBase &topHsmState)
     : topState(topHsmState) {}
 
-///! Call to initialize the state machine. It will make sure that current state is set
-// by calling onInit() on the top state and then traverse down initial transitions.
-void HsmBase::onStart() {
-  assert(topState.superState == nullptr && "Top state must have nullptr for super state");
-  assert(currentState == nullptr && "onStart must only be called only ones");
+#ifdef HSM_METRICS
+void HsmBase::setMetrics(HsmMetrics *machineMetrics) {
+  metrics = machineMetrics;
+  // The active states were entered while detached, without a time of entry or with a stale one
+  const uint64_t now = metrics ? hsmMetricsNow() : 0;
+  for (HsmStateBase *state = currentState; state; state = state->superState) {
+    state->enteredAt = now;
+  }
+}
+#endif
 
-  currentState = &topState;
+void HsmBase::onStart() {
+  HsmNoPolicy policy;
+  start(policy);
+}
 
-  nextState = nullptr;
+void HsmBase::onStop() {
+  HsmNoPolicy policy;
+  stop(policy);
+}
 
-  currentState->onEnter();
+void HsmBase::transition(HsmStateBase &nextState) {
+  HsmNoPolicy policy;
+  transition(policy, nextState);
+}
 
-  initCurrentState();
+void HsmBase::externalTransition(HsmStateBase &nextState) {
+  HsmNoPolicy policy;
+  externalTransition(policy, nextState);
 }
 
-///!
-// Used to change current state to a new state.
-// @param target_state
-void HsmBase::transition(HsmStateBase &targetState) {
-  assert(currentState != nullptr && "onStart must be called before any transitions can be taken");
-  // FIXME check that we are not calling this function twice
-  // FIXME check that we are not calling this function inside a onInit()
+void HsmBase::reset() {
+  assert(currentState == nullptr && "reset must only be called on a stopped machine");
+
+  hsmVisitStates(topState, [](HsmStateBase &state) { state.historySubstate = nullptr; });
+}
 
-  exitUpToLCA(targetState);
+HsmBase::DispatchScope HsmBase::beginDispatch(EventTypeOf type) {
+  DispatchScope scope;
+  ++stepDepth;
+#ifdef HSM_CALLBACK_TIMING
+  scope.measuredStep = stepDepth == 1 && beginStep();
+#endif
 
-  nextState = &targetState;
+  scope.outerEvent = traceEvent;
+  if (observed()) {
+    traceEvent = type().id;
+  }
+  HSM_PROBE(dispatch__start, this, currentState, traceEvent);
+#ifdef HSM_METRICS
+  scope.origin = currentState;
+  scope.start = metrics ? hsmMetricsNow() : 0;
+#endif
+  return scope;
 }
 
 //!
-// Used to change current state to a new state.
-// @param target_state
-void HsmBase::externalTransition(HsmStateBase &targetState) {
-  assert(currentState != nullptr && "onStart must be called before any transitions can be taken");
-  // FIXME check that we are not calling this function twice
-  // FIXME check that we are not calling this function inside a onInit()
-
-  exitUpToLCA(targetState);
+// Called when state has handled the event, before entering the next state
+//
+void HsmBase::handled(HsmStateBase &state) {
+  if (flightRecorder) {
+    record(HsmTraceRecord::EVENT, &state, nextState, true);
+  }
+}
 
-  // Exit and enter own state
-  currentState->onExit();
-  currentState->onEnter();
+//!
+// @param handledBy State that handled the event, nullptr if unhandled
+// @return True if handled
+//
+bool HsmBase::endDispatch(const DispatchScope &scope, HsmStateBase *handledBy) {
+  HSM_PROBE(dispatch__end, this, handledBy, traceEvent);
+  if (flightRecorder && not handledBy) {
+    record(HsmTraceRecord::EVENT, currentState, nullptr, false);
+  }
+#ifdef HSM_METRICS
+  if (metrics) {
+    // Walk the levels again, so the dispatch loop is kept free of metrics
+    unsigned offered = handledBy ? 1 : 0;
+    for (HsmStateBase *level = scope.origin; level != handledBy; level = level->superState) {
+      ++offered;
+    }
+    metrics->dispatched(traceEvent, scope.origin->index, offered, handledBy != nullptr, hsmMetricsNow() - scope.start);
+  }
+#endif
+  traceEvent = scope.outerEvent;
+#ifdef HSM_CALLBACK_TIMING
+  if (scope.measuredStep) {
+    endStep();
+  }
+#endif
+  if (--stepDepth == 0) {
+    completeStep();
+  }
+  return handledBy != nullptr;
+}
 
-  nextState = &targetState;
+bool HsmBase::observed() const {
+#if defined(HSM_USDT)
+  // The probes need the event id, whether or not a tracer is attached
+  return true;
+#elif defined(HSM_METRICS)
+  return flightRecorder || metrics;
+#else
+  return flightRecorder;
+#endif
 }
 
-/// Note: Must be called from state.onInit(), if the concrete state has sub states.
-void HsmBase::initialTransition(HsmStateBase &subState) {
-  // FIXME check that we are only calling this within a initialTransition
-  // FIXME check that we are only calling this within a direct sub state
-  nextState = &subState;
+void HsmBase::record(uint8_t kind, const HsmStateBase *source, const HsmStateBase *target, bool handled) {
+  HsmTraceRecord entry;
+  entry.timestamp = hsmTimestamp();
+  entry.machine = traceMachine;
+#ifndef HSM_FREESTANDING
+  entry.correlation = hsmCorrelation();
+#else
+  entry.correlation = 0;
+#endif
+  entry.event = traceEvent;
+  entry.source = source ? source->index : HSM_TRACE_NO_STATE;
+  entry.target = target ? target->index : HSM_TRACE_NO_STATE;
+  entry.kind = static_cast<HsmTraceRecord::Kind>(kind);
+  entry.handled = handled;
+  flightRecorder->record(entry);
 }
 
-/// Note: Must be called from state.onInit(), if the concrete state has sub states.
-void HsmBase::initialHistoryTransition(HsmStateBase &subState) {
-  if (currentState->historySubstate) {
-    initialTransition(*currentState->historySubstate);
-  } else {
-    initialTransition(subState);
+//!
+// Called after state->onEnter()
+//
+void HsmBase::entered(HsmStateBase &state) {
+  HSM_PROBE(enter, this, &state, traceEvent);
+  if (flightRecorder) {
+    record(HsmTraceRecord::ENTER, nullptr, &state, false);
+  }
+#ifdef HSM_METRICS
+  if (metrics) {
+    state.enteredAt = hsmMetricsNow();
   }
+#endif
 }
 
 //!
-// Makes the Hsm entering a state and invoke the initial transition
+// Called after state->onExit()
 //
-void HsmBase::enterAndInitNextState() {
-  enterNextState();
-
-  currentState = nextState;
-  nextState = nullptr;
-
-  initCurrentState();
+void HsmBase::exited(HsmStateBase &state, const HsmStateBase *target) {
+  HSM_PROBE(exit, this, &state, traceEvent);
+  if (flightRecorder) {
+    record(HsmTraceRecord::EXIT, &state, target, false);
+  }
+#ifdef HSM_METRICS
+  // Not entered since attached, e.g. when attached from a callback in the middle of a transition
+  if (metrics && state.enteredAt) {
+    metrics->dwell(state.index, hsmMetricsNow() - state.enteredAt);
+  }
+#endif
 }
 
 //!
-// Makes the Hsm enters the next state
+// Decide if the callbacks of the run to completion step about to start are timed, either because the step is
+// sampled for CPU time or the machine is watched
+// @return True if this call started measuring, which must be ended with endStep()
 //
-void HsmBase::enterNextState() {
-  // FIXME make this a vector
-  constexpr int MAX_STATE_NESTING = 7;
-  HsmStateBase *entry_path[MAX_STATE_NESTING];
-  HsmStateBase **trace;
-  HsmStateBase *state = nullptr;
-
-  entry_path[0] = nullptr;
-  trace = &entry_path[0];
-
-  // Trace path to target state
-  for (state = nextState; state != currentState; state = state->superState) {
-    /// TODO Consider range check to avoid exceeding MAX_STATE_NESTING?
-    *(++trace) = state;
+bool HsmBase::beginStep() {
+#ifdef HSM_CALLBACK_TIMING
+  if (measuredStep) {
+    return false;
+  }
+  bool measure = false;
+#ifdef HSM_METRICS
+  cpuSampled = metrics && metrics->sampleCpu();
+  cpuCallbacks = 0;
+  measure = cpuSampled;
+#endif
+#ifdef HSM_WATCHDOG
+  measure = measure || watchdogSlot;
+#endif
+  if (not measure) {
+    return false;
   }
+  measuredStep = true;
+  nestedTime = 0;
+  stepBegin = hsmTimestamp();
+#ifdef HSM_WATCHDOG
+  if (watchdogSlot) {
+    watchdogSlot->beginStep(stepBegin);
+  }
+#endif
+  return true;
+#else
+  return false;
+#endif
+}
 
-  // Invoke onEnter from LCA to next state
-  while ((state = *trace--) != nullptr) {
-    state->onEnter();
+void HsmBase::endStep() {
+#ifdef HSM_CALLBACK_TIMING
+  const uint64_t elapsed = hsmTimestamp() - stepBegin;
+#ifdef HSM_METRICS
+  if (cpuSampled && metrics) {
+    metrics->cpuStep(elapsed > cpuCallbacks ? elapsed - cpuCallbacks : 0);
   }
+  cpuSampled = false;
+#endif
+#ifdef HSM_WATCHDOG
+  if (watchdogSlot) {
+    watchdogSlot->endStep(elapsed);
+  }
+#endif
+  measuredStep = false;
+#endif
 }
 
+#ifdef HSM_CALLBACK_TIMING
 //!
-// Make the Hsm intialize current state
+// @param outer Saves the nested time and watchdog activity of an enclosing callback
+// @return Timestamp of the beginning of the callback
 //
-void HsmBase::initCurrentState() {
-  while (true) {
-    currentState->onInit();
-
-    // If we have reached last substate
-    if (nullptr == nextState)
-      break;
-
-    assert(nextState->superState == currentState && "Sub state do have super state set correctly");
-
-    enterNextState();
-
-    currentState = nextState;
-    nextState = nullptr;
+uint64_t HsmBase::beginCallback(HsmStateBase &state, HsmCallback callback, CallbackScope &outer) {
+  outer.nested = nestedTime;
+  nestedTime = 0;
+#ifdef HSM_WATCHDOG
+  if (watchdogSlot) {
+    outer.activity = watchdogSlot->beginCallback(state.index, callback);
   }
+#else
+  (void)state;
+  (void)callback;
+#endif
+  return hsmTimestamp();
 }
 
 //!
-// Exit states up the state that is common least super state to current state and target state.
-// @param target State that is the target of the transition.
+// Attribute the time since begin, except callbacks nested within, to state
 //
-void HsmBase::exitUpToLCA(HsmStateBase &target) {
-  HsmStateBase *state = currentState;
-
-  // Exit up to source state
-  while (state != sourceState) {
-    state->onExit();
-    state->superState->historySubstate = state; // remember last substate
-    state = state->superState;
+void HsmBase::endCallback(HsmStateBase &state, HsmCallback callback, uint64_t begin, const CallbackScope &outer) {
+  const uint64_t elapsed = hsmTimestamp() - begin;
+  const uint64_t self = elapsed > nestedTime ? elapsed - nestedTime : 0;
+#ifdef HSM_METRICS
+  if (cpuSampled && metrics) {
+    metrics->cpuTime(state.index, callback, self);
+    cpuCallbacks += self;
+  }
+#endif
+#ifdef HSM_WATCHDOG
+  if (watchdogSlot) {
+    watchdogSlot->endCallback(state.index, callback, self, outer.activity);
   }
+#endif
+  nestedTime = outer.nested + elapsed;
+}
+#endif
 
-  // Exit up to LCA
-  for (unsigned toLca = levelsToLCA(target); toLca != 0; toLca--) {
-    state->onExit();
-    state->superState->historySubstate = state; // remember last substate
-    state = state->superState;
+//!
+// Called when the outermost onEvent() returns
+//
+void HsmBase::completeStep() {
+#ifndef HSM_FREESTANDING
+  if (payloadArena) {
+    payloadArena->release();
   }
+#endif
+}
 
-  // Current state is now LCA
-  currentState = state;
+/// Note: Must be called from state.onInit(), if the concrete state has sub states.
+void HsmBase::initialTransition(HsmStateBase &subState) {
+  // FIXME check that we are only calling this within a initialTransition
+  // FIXME check that we are only calling this within a direct sub state
+  HSM_PROBE(initial, this, &subState, traceEvent);
+  nextState = &subState;
+}
+
+/// Note: Must be called from state.onInit(), if the concrete state has sub states.
+void HsmBase::initialHistoryTransition(HsmStateBase &subState) {
+  if (currentState->historySubstate) {
+    initialTransition(*currentState->historySubstate);
+  } else {
+    initialTransition(subState);
+  }
 }
 
 //!
@@ -199,4 +345,10 @@ unsigned HsmBase::levelsToLCA(HsmStateBase &target) {
   return 0;
 }
 
+template void HsmBase::start(HsmNoPolicy &);
+template void HsmBase::stop(HsmNoPolicy &);
+template bool HsmBase::dispatch(HsmNoPolicy &, EventThunk, void *, EventTypeOf);
+template void HsmBase::transition(HsmNoPolicy &, HsmStateBase &);
+template void HsmBase::externalTransition(HsmNoPolicy &, HsmStateBase &);
+
 } // namespace hsp
@@ -0,0 +1,59 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_arena.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+
+namespace hsp {
+
+HsmArena::HsmArena(void *buffer, std::size_t size)
+    : buffer(static_cast<char *>(buffer))
+    , size(size) {}
+
+HsmArena::HsmArena(std::size_t capacity)
+    : buffer(nullptr)
+    , size(capacity) {}
+
+void *HsmArena::allocate(std::size_t bytes, std::size_t alignment) {
+  if (not buffer) {
+    heap.reset(new std::max_align_t[(size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t)]);
+    buffer = reinterpret_cast<char *>(heap.get());
+  }
+
+  // Align the address, as a static buffer is not necessarily aligned
+  const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(buffer) + offset;
+  const std::size_t padding = (alignment - address % alignment) % alignment;
+  // Checked in release builds too, the callers construct objects in the memory. Written so it cannot overflow.
+  if (padding > size - offset || bytes > size - offset - padding) {
+    assert(false && "Arena is exhausted");
+    std::abort();
+  }
+
+  void *memory = buffer + offset + padding;
+  offset += padding + bytes;
+  return memory;
+}
+
+} // namespace hsp
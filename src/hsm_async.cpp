@@ -0,0 +1,72 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_async.h"
+#include "hsm_correlation.h"
+
+namespace hsp {
+
+HsmAsyncAction::HsmAsyncAction(IExecutor &executor, IExecutor &completion)
+    : executor(executor)
+    , completion(completion)
+    , generation(std::make_shared<unsigned>(0)) {}
+
+HsmAsyncAction::~HsmAsyncAction() { cancel(); }
+
+//!
+// The action runs on the executor. Its result is posted back to the completion executor, where the
+// generation is checked to drop events of cancelled actions. The correlation is carried explicitly, as
+// the executors could be of any kind.
+//
+void HsmAsyncAction::start(std::function<bool()> action, std::function<void()> onDone, std::function<void()> onFailed) {
+  cancel();
+  isPending = true;
+
+  executor.post([action = std::move(action), onDone = std::move(onDone), onFailed = std::move(onFailed), &completion = completion, generation = generation,
+                 started = *generation, correlation = hsmCorrelation(), this]() mutable {
+    HsmCorrelationScope actionScope(correlation);
+    bool succeeded = action();
+
+    completion.post([succeeded, onDone = std::move(onDone), onFailed = std::move(onFailed), generation = std::move(generation), started, correlation,
+                     this] {
+      HsmCorrelationScope completionScope(correlation);
+      if (*generation != started) {
+        return; // Cancelled, this object could be gone
+      }
+      isPending = false;
+      if (succeeded) {
+        onDone();
+      } else if (onFailed) {
+        onFailed();
+      }
+    });
+  });
+}
+
+void HsmAsyncAction::cancel() {
+  if (isPending) {
+    ++*generation;
+    isPending = false;
+  }
+}
+
+} // namespace hsp
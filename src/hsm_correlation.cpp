@@ -0,0 +1,75 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_correlation.h"
+
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace hsp {
+
+namespace {
+
+std::atomic<HsmCorrelationId> nextCorrelation{1};
+
+} // namespace
+
+HsmCorrelationId hsmNewCorrelation() {
+  HsmCorrelationId correlation = nextCorrelation.fetch_add(1, std::memory_order_relaxed);
+  // Skip 0 when wrapping around
+  while (correlation == 0) {
+    correlation = nextCorrelation.fetch_add(1, std::memory_order_relaxed);
+  }
+  return correlation;
+}
+
+std::vector<HsmCorrelationSpan> hsmCorrelationSpans(const HsmTraceRecord *records, std::size_t count) {
+  std::vector<HsmCorrelationSpan> spans;
+  std::unordered_map<HsmCorrelationId, std::size_t> spanOf;
+  std::unordered_set<uint64_t> machinesSeen;
+
+  for (std::size_t i = 0; i < count; ++i) {
+    const HsmTraceRecord &record = records[i];
+    if (record.correlation == 0) {
+      continue;
+    }
+    auto found = spanOf.emplace(record.correlation, spans.size());
+    if (found.second) {
+      spans.push_back({record.correlation, record.timestamp, record.timestamp, 0, 0});
+    }
+    HsmCorrelationSpan &span = spans[found.first->second];
+    span.last = record.timestamp;
+    ++span.records;
+    if (machinesSeen.insert(uint64_t(record.correlation) << 32 | record.machine).second) {
+      ++span.machines;
+    }
+  }
+  return spans;
+}
+
+std::vector<HsmCorrelationSpan> hsmCorrelationSpans(const HsmFlightRecorder &recorder) {
+  std::vector<HsmTraceRecord> records(recorder.capacity());
+  return hsmCorrelationSpans(records.data(), recorder.snapshot(records.data(), records.size()));
+}
+
+} // namespace hsp
@@ -0,0 +1,261 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_event_loop.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+
+namespace hsp {
+
+namespace {
+
+//! Report a failed system call, also in release builds
+[[noreturn]] void fail(const char *call) { throw std::system_error(errno, std::generic_category(), call); }
+
+void addToEpoll(int epollFd, int fd, void *data) {
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = data;
+  int result = epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+  assert(result == 0 && "epoll_ctl() failed");
+  (void)result;
+}
+
+void drain(int fd) {
+  uint64_t count;
+  while (read(fd, &count, sizeof(count)) < 0) {
+    if (errno == EAGAIN) {
+      return; // Nothing to drain
+    }
+    if (errno != EINTR) {
+      fail("read");
+    }
+  }
+}
+
+} // namespace
+
+HsmEventLoop::HsmEventLoop(unsigned maxBatch)
+    : maxBatch(maxBatch)
+    , epollFd(epoll_create1(EPOLL_CLOEXEC))
+    , eventFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    , timerFd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK))
+    , ready(maxBatch) {
+  assert(maxBatch > 0);
+  assert(epollFd >= 0 && "epoll_create1() failed");
+  assert(eventFd >= 0 && "eventfd() failed");
+  assert(timerFd >= 0 && "timerfd_create() failed");
+
+  // The address of the members are used to recognize the two internal file descriptors
+  addToEpoll(epollFd, eventFd, const_cast<int *>(&eventFd));
+  addToEpoll(epollFd, timerFd, const_cast<int *>(&timerFd));
+}
+
+HsmEventLoop::~HsmEventLoop() {
+  assert(timers.empty() && "Timers must be destroyed before the loop");
+  close(timerFd);
+  close(eventFd);
+  close(epollFd);
+}
+
+void HsmEventLoop::post(std::function<void()> event) {
+  bool wasEmpty;
+  {
+    std::lock_guard<std::mutex> lock(postedMutex);
+    wasEmpty = posted.empty();
+    posted.push_back({std::move(event), hsmCorrelation()});
+  }
+  // Only the first post in a batch needs to wake up the loop
+  if (wasEmpty) {
+    wakeup();
+  }
+}
+
+void HsmEventLoop::watch(int fd, std::function<void()> onReadable) {
+  assert(watched.count(fd) == 0 && "fd is already watched");
+  auto &watch = watched[fd];
+  watch = std::make_unique<Watch>();
+  watch->callback = std::move(onReadable);
+  addToEpoll(epollFd, fd, watch.get());
+}
+
+void HsmEventLoop::unwatch(int fd) {
+  auto found = watched.find(fd);
+  assert(found != watched.end() && "fd is not watched");
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+  // The callback could still be referenced by the batch being dispatched, where it must be skipped
+  found->second->live = false;
+  retired.push_back(std::move(found->second));
+  watched.erase(found);
+}
+
+unsigned HsmEventLoop::runOnce(int timeoutMs) {
+  unsigned dispatched = 0;
+
+  int count = epoll_wait(epollFd, ready.data(), static_cast<int>(maxBatch), timeoutMs);
+  if (count < 0) {
+    if (errno != EINTR) {
+      fail("epoll_wait");
+    }
+    return 0;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    void *source = ready[i].data.ptr;
+
+    if (source == &eventFd) {
+      drain(eventFd);
+      dispatched += dispatchPosted();
+    } else if (source == &timerFd) {
+      drain(timerFd);
+      dispatched += dispatchTimers();
+    } else {
+      Watch &watch = *static_cast<Watch *>(source);
+      if (watch.live) {
+        watch.callback();
+        ++dispatched;
+      }
+    }
+  }
+  retired.clear();
+
+  return dispatched;
+}
+
+void HsmEventLoop::run() {
+  while (not stopped.exchange(false)) {
+    runOnce();
+  }
+}
+
+void HsmEventLoop::stop() {
+  stopped = true;
+  wakeup();
+}
+
+void HsmEventLoop::wakeup() {
+  uint64_t one = 1;
+  ssize_t written = write(eventFd, &one, sizeof(one));
+  (void)written; // EAGAIN means the counter is already signaled
+}
+
+//!
+// Dispatch all events posted since last time in one batch. The lock is only held while swapping the queues.
+//
+unsigned HsmEventLoop::dispatchPosted() {
+  {
+    std::lock_guard<std::mutex> lock(postedMutex);
+    dispatching.swap(posted);
+  }
+  for (auto &event : dispatching) {
+    HsmCorrelationScope scope(event.correlation);
+    event.event();
+  }
+  unsigned dispatched = dispatching.size();
+  dispatching.clear();
+  return dispatched;
+}
+
+//!
+// Invoke the callbacks of all expired timers and rearm the timerfd with the next deadline.
+//
+unsigned HsmEventLoop::dispatchTimers() {
+  unsigned dispatched = 0;
+  const Clock::time_point now = Clock::now();
+
+  while (not timers.empty() && timers.begin()->first <= now) {
+    HsmEventLoopTimer &timer = *timers.begin()->second;
+    timers.erase(timers.begin());
+    timer.isRunning = false;
+
+    // The callback is allowed to restart the timer
+    std::function<void()> callback = std::move(timer.callback);
+    HsmCorrelationScope scope(timer.correlation);
+    callback();
+    ++dispatched;
+  }
+  armTimerFd();
+  return dispatched;
+}
+
+void HsmEventLoop::armTimerFd() {
+  itimerspec spec = {};
+
+  if (not timers.empty()) {
+    auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(timers.begin()->first - Clock::now());
+    // A zero it_value disarms the timer, so expired deadlines fire after 1ns
+    if (delay.count() <= 0) {
+      delay = std::chrono::nanoseconds(1);
+    }
+    spec.it_value.tv_sec = delay.count() / 1000000000;
+    spec.it_value.tv_nsec = delay.count() % 1000000000;
+  }
+  int result = timerfd_settime(timerFd, 0, &spec, nullptr);
+  assert(result == 0 && "timerfd_settime() failed");
+  (void)result;
+}
+
+HsmEventLoop::TimerQueue::iterator HsmEventLoop::schedule(Clock::time_point deadline, HsmEventLoopTimer &timer) {
+  auto entry = timers.emplace(deadline, &timer);
+  // Only rearm if the new timer is the first to expire
+  if (entry == timers.begin()) {
+    armTimerFd();
+  }
+  return entry;
+}
+
+void HsmEventLoop::unschedule(TimerQueue::iterator entry) {
+  // The timerfd is left armed. An early wakeup will just rearm it.
+  timers.erase(entry);
+}
+
+HsmEventLoopTimer::HsmEventLoopTimer(HsmEventLoop &loop, std::chrono::nanoseconds timeout)
+    : loop(loop)
+    , timeout(timeout) {}
+
+HsmEventLoopTimer::~HsmEventLoopTimer() { cancel(); }
+
+void HsmEventLoopTimer::start(std::function<void()> timeoutCallback) {
+  cancel();
+  callback = std::move(timeoutCallback);
+  correlation = hsmCorrelation();
+  entry = loop.schedule(HsmEventLoop::Clock::now() + timeout, *this);
+  isRunning = true;
+}
+
+void HsmEventLoopTimer::cancel() {
+  if (isRunning) {
+    loop.unschedule(entry);
+    callback = nullptr;
+    isRunning = false;
+  }
+}
+
+} // namespace hsp
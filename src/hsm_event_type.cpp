@@ -0,0 +1,96 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_event_type.h"
+
+#include <atomic>
+#include <cstring>
+
+namespace hsp {
+
+namespace {
+
+std::atomic<uint16_t> lastId{0};
+std::atomic<const HsmEventType *> types{nullptr};
+
+} // namespace
+
+//!
+// Take the name from the signature, e.g. "const hsp::HsmEventType& hsp::hsmEventType() [with EVENT = Foo]"
+//
+HsmEventTypeRegistration::HsmEventTypeRegistration(const char *signature)
+    : type{static_cast<uint16_t>(lastId.fetch_add(1, std::memory_order_relaxed) + 1), signature,
+           static_cast<uint16_t>(signature ? std::strlen(signature) : 0), nullptr} {
+  const char *name = signature ? std::strstr(signature, "EVENT = ") : nullptr;
+  if (name) {
+    name += std::strlen("EVENT = ");
+    const char *end = std::strrchr(name, ']');
+    type.name = name;
+    type.nameLength = static_cast<uint16_t>(end ? end - name : std::strlen(name));
+  }
+
+  // Push on the list
+  const HsmEventType *head = types.load(std::memory_order_relaxed);
+  do {
+    type.next = head;
+  } while (not types.compare_exchange_weak(head, &type, std::memory_order_release, std::memory_order_relaxed));
+}
+
+const HsmEventType *hsmFindEventType(uint16_t id) {
+  for (const HsmEventType *type = types.load(std::memory_order_acquire); type; type = type->next) {
+    if (type->id == id) {
+      return type;
+    }
+  }
+  return nullptr;
+}
+
+#ifndef HSM_FREESTANDING
+
+std::string hsmEventName(uint16_t id) {
+  const HsmEventType *type = hsmFindEventType(id);
+  if (not type) {
+    return "event " + std::to_string(id);
+  }
+  std::string name(type->name, type->nameLength);
+  const std::size_t lambda = name.find("::<lambda");
+  if (lambda != std::string::npos) {
+    name.resize(lambda);
+  }
+  // Last scope separator outside of template arguments and parameters
+  std::size_t begin = 0;
+  int depth = 0;
+  for (std::size_t i = 0; i + 1 < name.size(); ++i) {
+    if (name[i] == '<' || name[i] == '(') {
+      depth++;
+    } else if (name[i] == '>' || name[i] == ')') {
+      depth--;
+    } else if (depth == 0 && name[i] == ':' && name[i + 1] == ':') {
+      begin = i + 2;
+    }
+  }
+  return name.substr(begin);
+}
+
+#endif
+
+} // namespace hsp
@@ -0,0 +1,75 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_executor.h"
+
+#include <cassert>
+
+namespace hsp {
+
+HsmWorkerExecutor::HsmWorkerExecutor(unsigned threads) {
+  assert(threads > 0);
+  for (unsigned i = 0; i < threads; ++i) {
+    workers.emplace_back(&HsmWorkerExecutor::work, this);
+  }
+}
+
+HsmWorkerExecutor::~HsmWorkerExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  available.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void HsmWorkerExecutor::post(std::function<void()> work) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(not stopping && "Work posted to a stopped executor");
+    queue.push_back(std::move(work));
+  }
+  available.notify_one();
+}
+
+//!
+// Worker thread. Runs work until the executor is stopped and the queue is drained.
+//
+void HsmWorkerExecutor::work() {
+  while (true) {
+    std::function<void()> next;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      available.wait(lock, [this] { return stopping || not queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      next = std::move(queue.front());
+      queue.pop_front();
+    }
+    next();
+  }
+}
+
+} // namespace hsp
@@ -0,0 +1,196 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_flight_recorder.h"
+#include "hsm_event_type.h"
+
+#include <cassert>
+
+#ifndef HSM_FREESTANDING
+#include <chrono>
+#include <csignal>
+#include <initializer_list>
+#include <thread>
+#include <unistd.h>
+#endif
+
+namespace hsp {
+
+HsmFlightRecorder::HsmFlightRecorder(Slot *slots, std::size_t capacity)
+    : slots(slots)
+    , mask(capacity - 1) {
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0 && "Capacity must be a power of two");
+}
+
+//!
+// Read the record at position, if it is still in the ring and not being written
+//
+bool HsmFlightRecorder::read(uint64_t position, HsmTraceRecord &record) const {
+  const Slot &slot = slots[position & mask];
+  if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+    return false;
+  }
+  record = slot.record;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.sequence.load(std::memory_order_relaxed) == position + 1;
+}
+
+std::size_t HsmFlightRecorder::snapshot(HsmTraceRecord *records, std::size_t size) const {
+  const uint64_t end = written();
+  const uint64_t available = end < capacity() ? end : capacity();
+  const uint64_t count = available < size ? available : size;
+
+  std::size_t copied = 0;
+  for (uint64_t position = end - count; position < end; ++position) {
+    if (read(position, records[copied])) {
+      ++copied;
+    }
+  }
+  return copied;
+}
+
+#ifndef HSM_FREESTANDING
+
+namespace {
+
+//! Line buffer formatted without library calls, as they are not async signal safe
+class Line {
+public:
+  explicit Line(int fd)
+      : fd(fd) {}
+
+  Line &text(const char *text, std::size_t length) {
+    for (std::size_t i = 0; i < length; ++i) {
+      if (size == sizeof(buffer)) {
+        flush();
+      }
+      buffer[size++] = text[i];
+    }
+    return *this;
+  }
+  Line &text(const char *text) {
+    std::size_t length = 0;
+    while (text[length]) {
+      ++length;
+    }
+    return this->text(text, length);
+  }
+  Line &number(uint64_t value) {
+    char digits[20];
+    std::size_t count = 0;
+    do {
+      digits[count++] = '0' + value % 10;
+      value /= 10;
+    } while (value);
+    while (count) {
+      text(&digits[--count], 1);
+    }
+    return *this;
+  }
+  Line &state(uint16_t index) { return index == HSM_TRACE_NO_STATE ? text("-") : number(index); }
+
+  void flush() {
+    std::size_t written = 0;
+    while (written < size) {
+      ssize_t result = ::write(fd, buffer + written, size - written);
+      if (result <= 0) {
+        break;
+      }
+      written += result;
+    }
+    size = 0;
+  }
+
+private:
+  const int fd;
+  char buffer[256];
+  std::size_t size = 0;
+};
+
+std::atomic<HsmFlightRecorder *> crashRecorder{nullptr};
+std::atomic<int> crashFd{2};
+
+void onCrash(int signal) {
+  HsmFlightRecorder *recorder = crashRecorder.exchange(nullptr);
+  if (recorder) {
+    recorder->dump(crashFd.load());
+  }
+  std::signal(signal, SIG_DFL);
+  std::raise(signal);
+}
+
+} // namespace
+
+double hsmTimestampsPerMicrosecond() {
+  static const double rate = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    using Clock = std::chrono::steady_clock;
+    const Clock::time_point begin = Clock::now();
+    const uint64_t beginTimestamp = hsmTimestamp();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    const uint64_t timestamps = hsmTimestamp() - beginTimestamp;
+    const auto elapsed = std::chrono::duration<double, std::micro>(Clock::now() - begin);
+    return timestamps / elapsed.count();
+#else
+    return 1000.0;
+#endif
+  }();
+  return rate;
+}
+
+void HsmFlightRecorder::dump(int fd) const {
+  static const char *const kinds[] = {"EVENT", "EXIT", "ENTER"};
+  Line line(fd);
+
+  const uint64_t end = written();
+  const uint64_t begin = end < capacity() ? 0 : end - capacity();
+  line.text("hsm flight recorder, ").number(end - begin).text(" of ").number(end).text(" records\n");
+  line.text("sequence timestamp machine kind event source target handled correlation\n");
+
+  for (uint64_t position = begin; position < end; ++position) {
+    HsmTraceRecord record;
+    if (not read(position, record)) {
+      continue;
+    }
+    line.number(position).text(" ").number(record.timestamp).text(" ").number(record.machine).text(" ");
+    line.text(record.kind <= HsmTraceRecord::ENTER ? kinds[record.kind] : "?").text(" ").number(record.event);
+    line.text(" ").state(record.source).text(" ").state(record.target).text(" ").number(record.handled);
+    line.text(" ").number(record.correlation);
+    if (const HsmEventType *type = hsmFindEventType(record.event)) {
+      line.text(" ").text(type->name, type->nameLength);
+    }
+    line.text("\n");
+  }
+  line.flush();
+}
+
+void HsmFlightRecorder::dumpOnCrash(HsmFlightRecorder &recorder, int fd) {
+  crashFd = fd;
+  crashRecorder = &recorder;
+  for (int signal : {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT}) {
+    std::signal(signal, onCrash);
+  }
+}
+
+#endif
+
+} // namespace hsp
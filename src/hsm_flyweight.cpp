@@ -0,0 +1,230 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_flyweight.h"
+
+#include <cassert>
+
+namespace hsp {
+
+//!
+// Add a state to the hierarchy table. The sub states are kept in order of construction.
+//
+HsmStateId FlyweightHsmModel::add(const FlyweightHsmStateBase &state, const FlyweightHsmStateBase *superState) {
+  assert(states.size() < NO_STATE && "Too many states for HsmStateId");
+  const HsmStateId id = states.size();
+  Node node = {NO_STATE, 0, NO_STATE, NO_STATE, NO_STATE};
+
+  if (superState) {
+    node.parent = superState->id;
+    node.depth = nodes[node.parent].depth + 1;
+    assert(node.depth < MAX_DEPTH && "State nesting too deep");
+
+    // The super state gets a history entry with its first sub state
+    if (nodes[node.parent].historySlot == NO_STATE) {
+      nodes[node.parent].historySlot = slots++;
+    }
+
+    HsmStateId *last = &nodes[node.parent].firstChild;
+    while (*last != NO_STATE) {
+      last = &nodes[*last].nextSibling;
+    }
+    *last = id;
+  }
+
+  nodes.push_back(node);
+  states.push_back(&state);
+  return id;
+}
+
+HsmStateId FlyweightHsmModel::lca(HsmStateId a, HsmStateId b) const {
+  while (nodes[a].depth > nodes[b].depth) {
+    a = nodes[a].parent;
+  }
+  while (nodes[b].depth > nodes[a].depth) {
+    b = nodes[b].parent;
+  }
+  while (a != b) {
+    a = nodes[a].parent;
+    b = nodes[b].parent;
+  }
+  return a;
+}
+
+bool FlyweightHsmModel::isIn(HsmStateId active, HsmStateId state) const {
+  if (active == NO_STATE || nodes[active].depth < nodes[state].depth) {
+    return false;
+  }
+  for (unsigned levels = nodes[active].depth - nodes[state].depth; levels != 0; --levels) {
+    active = nodes[active].parent;
+  }
+  return active == state;
+}
+
+//!
+// Constructor. Registers the state in the model of the machine type.
+//
+FlyweightHsmStateBase::FlyweightHsmStateBase(FlyweightHsmModel &model, const FlyweightHsmStateBase *superState)
+    : id(model.add(*this, superState)) {
+  assert((superState != nullptr) == (id != 0) && "Top state must be constructed first and is the only one without super state");
+}
+
+//!
+// Destructor
+//
+FlyweightHsmStateBase::~FlyweightHsmStateBase() {}
+
+FlyweightHsmBase::FlyweightHsmBase(const FlyweightHsmModel &model, HsmStateId *history, uint32_t historyStride)
+    : model(model)
+    , history(history)
+    , historyStride(historyStride) {
+  assert(model.size() > 0 && "The states of the model must be constructed before the instances");
+}
+
+///! Call to initialize the state machine. It will make sure that current state is set
+// by calling onInit() on the top state and then traverse down initial transitions.
+void FlyweightHsmBase::onStart() {
+  assert(currentState == NO_STATE && "onStart must only be called only ones");
+
+  currentState = 0;
+  nextState = NO_STATE;
+
+  model.state(currentState).enter(*this);
+
+  initCurrentState();
+}
+
+void FlyweightHsmBase::transition(const FlyweightHsmStateBase &targetState) {
+  assert(currentState != NO_STATE && "onStart must be called before any transitions can be taken");
+
+  exitUpToLCA(targetState.id);
+
+  nextState = targetState.id;
+}
+
+void FlyweightHsmBase::externalTransition(const FlyweightHsmStateBase &targetState) {
+  assert(currentState != NO_STATE && "onStart must be called before any transitions can be taken");
+
+  exitUpToLCA(targetState.id);
+
+  // Exit and enter own state
+  model.state(currentState).exit(*this);
+  model.state(currentState).enter(*this);
+
+  nextState = targetState.id;
+}
+
+void FlyweightHsmBase::initialTransition(const FlyweightHsmStateBase &subState) { nextState = subState.id; }
+
+void FlyweightHsmBase::initialHistoryTransition(const FlyweightHsmStateBase &subState) {
+  assert(model.historySlot(currentState) != NO_STATE && "Only states with sub states have history");
+  const HsmStateId lastSubstate = history[model.historySlot(currentState) * historyStride];
+  nextState = lastSubstate != NO_STATE ? lastSubstate : subState.id;
+}
+
+bool FlyweightHsmBase::isIn(const FlyweightHsmStateBase &state) const { return model.isIn(currentState, state.id); }
+
+//!
+// Makes the Hsm entering a state and invoke the initial transition
+//
+void FlyweightHsmBase::enterAndInitNextState() {
+  enterNextState();
+
+  currentState = nextState;
+  nextState = NO_STATE;
+
+  initCurrentState();
+}
+
+//!
+// Makes the Hsm enters the next state. Current state must be a super state of next state.
+//
+void FlyweightHsmBase::enterNextState() {
+  HsmStateId entryPath[FlyweightHsmModel::MAX_DEPTH];
+  unsigned levels = model.depth(nextState) - model.depth(currentState);
+
+  // Trace path to target state
+  HsmStateId state = nextState;
+  for (unsigned level = levels; level != 0; --level) {
+    entryPath[level - 1] = state;
+    state = model.parent(state);
+  }
+  assert(state == currentState && "Next state must be a sub state of current state");
+
+  // Invoke onEnter from LCA to next state
+  for (unsigned level = 0; level < levels; ++level) {
+    model.state(entryPath[level]).enter(*this);
+  }
+}
+
+//!
+// Make the Hsm intialize current state
+//
+void FlyweightHsmBase::initCurrentState() {
+  while (true) {
+    model.state(currentState).init(*this);
+
+    // If we have reached last substate
+    if (NO_STATE == nextState)
+      break;
+
+    assert(model.parent(nextState) == currentState && "Sub state do have super state set correctly");
+
+    enterNextState();
+
+    currentState = nextState;
+    nextState = NO_STATE;
+  }
+}
+
+//!
+// Exit states up the state that is common least super state to current state and target state.
+// @param target State that is the target of the transition.
+//
+void FlyweightHsmBase::exitUpToLCA(HsmStateId target) {
+  HsmStateId state = currentState;
+  unsigned levels = model.depth(currentState) - model.depth(sourceState) + levelsToLCA(target);
+
+  // Exit up to source state and then up to LCA
+  for (; levels != 0; --levels) {
+    const HsmStateId superState = model.parent(state);
+    model.state(state).exit(*this);
+    history[model.historySlot(superState) * historyStride] = state; // remember last substate
+    state = superState;
+  }
+
+  // Current state is now LCA
+  currentState = state;
+}
+
+//!
+// Calculate the levels up to the least common super state of source state and transition
+// target state.
+//
+unsigned FlyweightHsmBase::levelsToLCA(HsmStateId target) const {
+  if (sourceState == target) {
+    return 1;
+  }
+  return model.depth(sourceState) - model.depth(model.lca(sourceState, target));
+}
+
+} // namespace hsp
@@ -0,0 +1,189 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_flyweight_kernel.h"
+
+#include <cassert>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HSM_KERNEL_AVX2
+#endif
+
+namespace hsp {
+
+FlyweightHsmEventTable::FlyweightHsmEventTable(const FlyweightHsmModel &model)
+    : model(model)
+    , table(model.size(), SCALAR)
+    , writes(model.size()) {
+  static_assert(sizeof(HsmStateId) <= 2, "State ids must fit in the entries");
+}
+
+void FlyweightHsmEventTable::ignore(const FlyweightHsmStateBase &state) {
+  forEachLeaf(state.id, [&](HsmStateId leaf) {
+    table[leaf] = leaf;
+    writes[leaf].clear();
+  });
+}
+
+//!
+// Precompute the history written by the transition from each leaf below state. The exits are the same as
+// FlyweightHsmBase::exitUpToLCA().
+//
+void FlyweightHsmEventTable::transition(const FlyweightHsmStateBase &state, const FlyweightHsmStateBase &target) {
+  assert(model.node(target.id).firstChild == NO_STATE && "Target must be a leaf state");
+
+  const HsmStateId lca = model.lca(state.id, target.id);
+  const unsigned levelsToLCA = state.id == target.id ? 1 : model.depth(state.id) - model.depth(lca);
+
+  forEachLeaf(state.id, [&](HsmStateId leaf) {
+    writes[leaf].clear();
+    HsmStateId exited = leaf;
+    for (unsigned levels = model.depth(leaf) - model.depth(state.id) + levelsToLCA; levels != 0; --levels) {
+      writes[leaf].push_back({model.parent(exited), exited});
+      exited = model.parent(exited);
+    }
+    table[leaf] = target.id | (writes[leaf].empty() ? 0 : HISTORY);
+  });
+}
+
+void FlyweightHsmEventTable::scalar(const FlyweightHsmStateBase &state) {
+  forEachLeaf(state.id, [&](HsmStateId leaf) {
+    table[leaf] = SCALAR;
+    writes[leaf].clear();
+  });
+}
+
+template <typename FUNCTION> void FlyweightHsmEventTable::forEachLeaf(HsmStateId state, FUNCTION function) {
+  HsmStateId child = model.node(state).firstChild;
+  if (child == NO_STATE) {
+    function(state);
+  }
+  for (; child != NO_STATE; child = model.node(child).nextSibling) {
+    forEachLeaf(child, function);
+  }
+}
+
+namespace {
+
+inline void lookup(const int32_t *entries, HsmStateId *current, uint32_t machine,
+                   std::vector<std::pair<uint32_t, HsmStateId>> &moved, std::vector<uint32_t> &scalar) {
+  const HsmStateId leaf = current[machine];
+  const int32_t entry = entries[leaf];
+
+  if (entry == FlyweightHsmEventTable::SCALAR) {
+    scalar.push_back(machine);
+    return;
+  }
+  current[machine] = entry & FlyweightHsmEventTable::STATE_MASK;
+  if (entry & FlyweightHsmEventTable::HISTORY) {
+    moved.emplace_back(machine, leaf);
+  }
+}
+
+#ifdef HSM_KERNEL_AVX2
+
+//!
+// Eight machines per iteration: widen the ids, gather the entries and pack the next ids back. Only lanes
+// that are SCALAR or write history leave the vector path.
+//
+__attribute__((target("avx2"))) uint32_t kernelAvx2(const int32_t *entries, HsmStateId *current, uint32_t count,
+                                                    std::vector<std::pair<uint32_t, HsmStateId>> &moved,
+                                                    std::vector<uint32_t> &scalar) {
+  const __m256i scalarEntry = _mm256_set1_epi32(FlyweightHsmEventTable::SCALAR);
+  const __m256i historyFlag = _mm256_set1_epi32(FlyweightHsmEventTable::HISTORY);
+  const __m256i stateMask = _mm256_set1_epi32(FlyweightHsmEventTable::STATE_MASK);
+
+  uint32_t machine = 0;
+  for (; machine + 8 <= count; machine += 8) {
+    __m256i leaves;
+    if constexpr (sizeof(HsmStateId) == 1) {
+      leaves = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(current + machine)));
+    } else {
+      leaves = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(current + machine)));
+    }
+    const __m256i next = _mm256_i32gather_epi32(entries, leaves, 4);
+
+    const __m256i isScalar = _mm256_cmpeq_epi32(next, scalarEntry);
+    const __m256i writesHistory =
+        _mm256_andnot_si256(isScalar, _mm256_cmpeq_epi32(_mm256_and_si256(next, historyFlag), historyFlag));
+    const __m256i ids = _mm256_blendv_epi8(_mm256_and_si256(next, stateMask), leaves, isScalar);
+
+    const unsigned scalarLanes = _mm256_movemask_ps(_mm256_castsi256_ps(isScalar));
+    const unsigned historyLanes = _mm256_movemask_ps(_mm256_castsi256_ps(writesHistory));
+    if (historyLanes) {
+      for (unsigned lane = 0; lane < 8; ++lane) {
+        if (historyLanes & (1u << lane)) {
+          moved.emplace_back(machine + lane, current[machine + lane]);
+        }
+      }
+    }
+    if (scalarLanes) {
+      for (unsigned lane = 0; lane < 8; ++lane) {
+        if (scalarLanes & (1u << lane)) {
+          scalar.push_back(machine + lane);
+        }
+      }
+    }
+
+    const __m128i ids16 = _mm_packus_epi32(_mm256_castsi256_si128(ids), _mm256_extracti128_si256(ids, 1));
+    if constexpr (sizeof(HsmStateId) == 1) {
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(current + machine), _mm_packus_epi16(ids16, ids16));
+    } else {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(current + machine), ids16);
+    }
+  }
+  return machine;
+}
+
+bool hasAvx2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+
+#endif
+
+} // namespace
+
+void flyweightBroadcastKernel(const FlyweightHsmEventTable &table, HsmStateId *current, uint32_t count,
+                              std::vector<std::pair<uint32_t, HsmStateId>> &moved, std::vector<uint32_t> &scalar) {
+  uint32_t machine = 0;
+#ifdef HSM_KERNEL_AVX2
+  if (hasAvx2()) {
+    machine = kernelAvx2(table.entries(), current, count, moved, scalar);
+  }
+#endif
+  // The tail, or all machines without AVX2
+  for (; machine < count; ++machine) {
+    lookup(table.entries(), current, machine, moved, scalar);
+  }
+}
+
+void flyweightBroadcastKernelScalar(const FlyweightHsmEventTable &table, HsmStateId *current, uint32_t count,
+                                    std::vector<std::pair<uint32_t, HsmStateId>> &moved,
+                                    std::vector<uint32_t> &scalar) {
+  for (uint32_t machine = 0; machine < count; ++machine) {
+    lookup(table.entries(), current, machine, moved, scalar);
+  }
+}
+
+} // namespace hsp
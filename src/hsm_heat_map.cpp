@@ -0,0 +1,237 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_heat_map.h"
+#include "hsm_event_type.h"
+#include "hsm_state.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace hsp {
+
+namespace {
+
+//! White for 0.0, red for 1.0
+std::string heatColor(double heat) {
+  const unsigned cold = 255 - static_cast<unsigned>(heat * 215 + 0.5);
+  char color[8];
+  std::snprintf(color, sizeof(color), "#FF%02X%02X", cold, cold);
+  return color;
+}
+
+std::string duration(uint64_t ns) {
+  char text[32];
+  if (ns < 10000) {
+    std::snprintf(text, sizeof(text), "%llu ns", static_cast<unsigned long long>(ns));
+  } else if (ns < 10000000) {
+    std::snprintf(text, sizeof(text), "%.1f us", ns / 1e3);
+  } else {
+    std::snprintf(text, sizeof(text), "%.1f ms", ns / 1e6);
+  }
+  return text;
+}
+
+//! Quotes are replaced, as neither PlantUML nor DOT labels are escaped the same way
+std::string label(const char *text, std::size_t length) {
+  std::string result(text, length);
+  std::replace(result.begin(), result.end(), '"', '\'');
+  return result;
+}
+
+std::string id(uint16_t state) { return "S" + std::to_string(state); }
+
+} // namespace
+
+HsmHeatMap::HsmHeatMap(const HsmStateBase &top) {
+  hsmVisitStates(top, [this](const HsmStateBase &state) { addState(state); });
+}
+
+void HsmHeatMap::addState(const HsmStateBase &state) {
+  if (states.size() <= state.index) {
+    states.resize(state.index + 1);
+  }
+  const char *name = state.name();
+  states[state.index].name =
+      name ? label(name, std::char_traits<char>::length(name)) : "state " + std::to_string(state.index);
+
+  for (const HsmStateBase *subState = state.firstSubstate; subState; subState = subState->nextSibling) {
+    states[state.index].subStates.push_back(subState->index);
+  }
+  // Sub states are linked in reverse order of construction
+  std::sort(states[state.index].subStates.begin(), states[state.index].subStates.end());
+}
+
+void HsmHeatMap::add(const HsmTraceRecord &record) {
+  switch (record.kind) {
+  case HsmTraceRecord::ENTER:
+    if (record.target < states.size()) {
+      states[record.target].entered++;
+    }
+    break;
+  case HsmTraceRecord::EVENT:
+    if (record.handled && record.source < states.size() && record.target < states.size()) {
+      transitions[TransitionKey(record.source, record.target, record.event)].count++;
+    }
+    break;
+  case HsmTraceRecord::EXIT:
+    break;
+  }
+}
+
+void HsmHeatMap::add(const HsmFlightRecorder &recorder) {
+  std::vector<HsmTraceRecord> records(recorder.capacity());
+  const std::size_t count = recorder.snapshot(records.data(), records.size());
+  for (std::size_t i = 0; i < count; ++i) {
+    add(records[i]);
+  }
+}
+
+void HsmHeatMap::add(const HsmMetrics::Snapshot &snapshot) {
+  haveDwell = true;
+  for (std::size_t state = 0; state < states.size() && state < snapshot.dwell.size(); ++state) {
+    states[state].dwellCount += snapshot.dwell[state].count;
+    states[state].dwellSum += snapshot.dwell[state].sum;
+  }
+  for (auto &transition : transitions) {
+    const uint16_t event = std::get<2>(transition.first);
+    if (event < snapshot.latency.size()) {
+      transition.second.latency = snapshot.latency[event].mean();
+    }
+  }
+}
+
+uint64_t HsmHeatMap::heat(const State &state) const { return haveDwell ? state.dwellSum : state.entered; }
+
+double HsmHeatMap::stateHeat(const State &state) const {
+  uint64_t hottest = 0;
+  for (const State &other : states) {
+    // Super states are active as long as their sub states, only leaves are compared
+    if (other.subStates.empty()) {
+      hottest = std::max(hottest, heat(other));
+    }
+  }
+  return hottest ? std::min(1.0, double(heat(state)) / hottest) : 0.0;
+}
+
+double HsmHeatMap::transitionHeat(const Transition &transition) const {
+  uint64_t hottest = 0;
+  for (const auto &other : transitions) {
+    hottest = std::max(hottest, other.second.count);
+  }
+  return hottest ? double(transition.count) / hottest : 0.0;
+}
+
+std::string HsmHeatMap::observations(const State &state, const char *newline) const {
+  std::string text = "entered " + std::to_string(state.entered) + "x";
+  if (haveDwell && state.dwellCount) {
+    text += newline + std::string("dwell ") + duration(state.dwellSum / state.dwellCount);
+  }
+  return text;
+}
+
+std::string HsmHeatMap::transitionLabel(const TransitionKey &key, const Transition &transition,
+                                        const char *newline) const {
+  const std::string name = hsmEventName(std::get<2>(key));
+  std::string text = label(name.data(), name.size());
+  text += newline + std::to_string(transition.count) + "x";
+  if (transition.latency) {
+    text += ", " + duration(transition.latency);
+  }
+  return text;
+}
+
+void HsmHeatMap::writePlantUml(std::ostream &out) const {
+  out << "@startuml\n";
+  writePlantUmlState(out, 0, 0);
+  for (const auto &transition : transitions) {
+    const std::string color = heatColor(transitionHeat(transition.second));
+    out << id(std::get<0>(transition.first)) << " -[" << color << ",bold]-> " << id(std::get<1>(transition.first))
+        << " : " << transitionLabel(transition.first, transition.second, "\\n") << "\n";
+  }
+  out << "@enduml\n";
+}
+
+void HsmHeatMap::writePlantUmlState(std::ostream &out, uint16_t index, unsigned indent) const {
+  const State &state = states[index];
+  const std::string margin(indent, ' ');
+
+  out << margin << "state \"" << state.name << "\" as " << id(index) << " " << heatColor(stateHeat(state));
+  if (not state.subStates.empty()) {
+    out << " {\n";
+    for (uint16_t subState : state.subStates) {
+      writePlantUmlState(out, subState, indent + 2);
+    }
+    out << margin << "}\n";
+  } else {
+    out << "\n";
+  }
+  out << margin << id(index) << " : " << observations(state, "\\n") << "\n";
+}
+
+void HsmHeatMap::writeDot(std::ostream &out) const {
+  out << "digraph hsm {\n";
+  out << "  compound=true;\n";
+  out << "  node [shape=box, style=\"rounded,filled\"];\n";
+  writeDotState(out, 0, 2);
+  for (const auto &transition : transitions) {
+    const uint16_t source = std::get<0>(transition.first);
+    const uint16_t target = std::get<1>(transition.first);
+    const double heat = transitionHeat(transition.second);
+    out << "  " << id(source) << " -> " << id(target) << " [label=\""
+        << transitionLabel(transition.first, transition.second, "\\n") << "\", color=\"" << heatColor(heat)
+        << "\", penwidth=" << 1 + static_cast<int>(heat * 4);
+    // Transitions to and from super states are drawn to the border of the cluster
+    if (not states[source].subStates.empty()) {
+      out << ", ltail=cluster_" << id(source);
+    }
+    if (not states[target].subStates.empty()) {
+      out << ", lhead=cluster_" << id(target);
+    }
+    out << "];\n";
+  }
+  out << "}\n";
+}
+
+void HsmHeatMap::writeDotState(std::ostream &out, uint16_t index, unsigned indent) const {
+  const State &state = states[index];
+  const std::string margin(indent, ' ');
+  const std::string color = heatColor(stateHeat(state));
+
+  if (state.subStates.empty()) {
+    out << margin << id(index) << " [label=\"" << state.name << "\\n" << observations(state, "\\n") << "\", fillcolor=\""
+        << color << "\"];\n";
+    return;
+  }
+  out << margin << "subgraph cluster_" << id(index) << " {\n";
+  out << margin << "  label=\"" << state.name << "\\n" << observations(state, "\\n") << "\";\n";
+  out << margin << "  style=\"rounded,filled\";\n";
+  out << margin << "  fillcolor=\"" << color << "\";\n";
+  // Anchor of transitions to and from the super state
+  out << margin << "  " << id(index) << " [shape=point, style=invis];\n";
+  for (uint16_t subState : state.subStates) {
+    writeDotState(out, subState, indent + 2);
+  }
+  out << margin << "}\n";
+}
+
+} // namespace hsp
@@ -0,0 +1,298 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_metrics.h"
+#include "hsm_event_type.h"
+#include "hsm_flight_recorder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+namespace hsp {
+
+namespace {
+
+//! Ids of live metrics. Freed ids are reused, so the thread local tables stay as small as the most metrics alive at once
+struct MetricsIds {
+  std::mutex mutex;
+  std::vector<uint32_t> freed;
+  uint32_t next = 0;
+  uint64_t nextGeneration = 1;
+};
+
+MetricsIds &metricsIds() {
+  // Constructed by the first metrics, so it outlives all of them
+  static MetricsIds ids;
+  return ids;
+}
+
+uint32_t acquireMetricsId() {
+  MetricsIds &ids = metricsIds();
+  std::lock_guard<std::mutex> lock(ids.mutex);
+  if (ids.freed.empty()) {
+    return ids.next++;
+  }
+  const uint32_t id = ids.freed.back();
+  ids.freed.pop_back();
+  return id;
+}
+
+uint64_t nextMetricsGeneration() {
+  MetricsIds &ids = metricsIds();
+  std::lock_guard<std::mutex> lock(ids.mutex);
+  return ids.nextGeneration++;
+}
+
+void releaseMetricsId(uint32_t id) {
+  MetricsIds &ids = metricsIds();
+  std::lock_guard<std::mutex> lock(ids.mutex);
+  ids.freed.push_back(id);
+}
+
+struct ThreadShard {
+  void *shard = nullptr;
+  //! Generation of the metrics the shard belongs to, stale after its id is reused
+  uint64_t generation = 0;
+};
+
+//! Shard of each metrics on this thread, indexed by HsmMetrics id
+thread_local std::vector<ThreadShard> threadShards;
+
+} // namespace
+
+uint64_t HsmHistogram::percentile(double fraction) const {
+  const uint64_t rank = static_cast<uint64_t>(fraction * count);
+  uint64_t counted = 0;
+  for (unsigned bucket = 0; bucket < BUCKETS; ++bucket) {
+    counted += buckets[bucket];
+    if (counted > rank || (counted == count && counted != 0)) {
+      return bucket ? (uint64_t(1) << bucket) - 1 : 0;
+    }
+  }
+  return 0;
+}
+
+HsmMetrics::Shard::Shard(unsigned stateCount, unsigned eventCapacity, bool bubbling)
+    : dwell(new Histogram[stateCount])
+    , latency(new Histogram[eventCapacity])
+    , unhandled(new Counter[eventCapacity]())
+    , cpu(new Cpu[stateCount])
+    , bubbling(bubbling ? new Bubbling[eventCapacity * stateCount] : nullptr) {}
+
+HsmMetrics::HsmMetrics(unsigned stateCount, unsigned eventCapacity)
+    : stateCount(stateCount)
+    , eventCapacity(eventCapacity ? eventCapacity : 1)
+    , id(acquireMetricsId())
+    , generation(nextMetricsGeneration()) {}
+
+HsmMetrics::~HsmMetrics() {
+  releaseMetricsId(id);
+}
+
+HsmMetrics::Shard &HsmMetrics::shard() {
+  if (id < threadShards.size() && threadShards[id].generation == generation) {
+    return *static_cast<Shard *>(threadShards[id].shard);
+  }
+  return addShard();
+}
+
+//!
+// First update from this thread. The only place a lock is taken when updating.
+//
+HsmMetrics::Shard &HsmMetrics::addShard() {
+  std::lock_guard<std::mutex> lock(shardsMutex);
+  shards.push_back(std::make_unique<Shard>(stateCount, eventCapacity, bubblingEnabled));
+  if (threadShards.size() <= id) {
+    threadShards.resize(id + 1);
+  }
+  threadShards[id] = {shards.back().get(), generation};
+  return *shards.back();
+}
+
+namespace {
+
+void sum(HsmHistogram &total, const std::atomic<uint64_t> &count, const std::atomic<uint64_t> &sum,
+         const std::atomic<uint64_t> &max, const std::atomic<uint64_t> *buckets) {
+  total.count += count.load(std::memory_order_relaxed);
+  total.sum += sum.load(std::memory_order_relaxed);
+  const uint64_t shardMax = max.load(std::memory_order_relaxed);
+  if (shardMax > total.max) {
+    total.max = shardMax;
+  }
+  for (unsigned bucket = 0; bucket < HsmHistogram::BUCKETS; ++bucket) {
+    total.buckets[bucket] += buckets[bucket].load(std::memory_order_relaxed);
+  }
+}
+
+} // namespace
+
+HsmMetrics::Snapshot HsmMetrics::snapshot() const {
+  Snapshot total;
+  total.dwell.resize(stateCount);
+  total.latency.resize(eventCapacity);
+  total.unhandled.resize(eventCapacity);
+  total.cpu.resize(stateCount);
+  total.cpuSamplePeriod = cpuSamplePeriod;
+  if (bubblingEnabled) {
+    total.bubbling.resize(eventCapacity * stateCount);
+  }
+
+  std::lock_guard<std::mutex> lock(shardsMutex);
+  for (const auto &shard : shards) {
+    for (unsigned state = 0; state < stateCount; ++state) {
+      const Histogram &dwell = shard->dwell[state];
+      sum(total.dwell[state], dwell.count, dwell.sum, dwell.max, dwell.buckets);
+    }
+    for (unsigned event = 0; event < eventCapacity; ++event) {
+      const Histogram &latency = shard->latency[event];
+      sum(total.latency[event], latency.count, latency.sum, latency.max, latency.buckets);
+      total.unhandled[event] += shard->unhandled[event].load(std::memory_order_relaxed);
+    }
+    for (unsigned depth = 0; depth < MAX_DEPTH; ++depth) {
+      total.bubbleDepth[depth] += shard->bubbleDepth[depth].load(std::memory_order_relaxed);
+    }
+    for (unsigned state = 0; state < stateCount; ++state) {
+      for (unsigned callback = 0; callback < HSM_CALLBACKS; ++callback) {
+        total.cpu[state].ticks[callback] += shard->cpu[state].ticks[callback].load(std::memory_order_relaxed);
+        total.cpu[state].calls[callback] += shard->cpu[state].calls[callback].load(std::memory_order_relaxed);
+      }
+    }
+    total.cpuOverhead += shard->cpuOverhead.load(std::memory_order_relaxed);
+    total.cpuSamples += shard->cpuSamples.load(std::memory_order_relaxed);
+    total.unknownStates += shard->unknownStates.load(std::memory_order_relaxed);
+    if (shard->bubbling) {
+      for (std::size_t pair = 0; pair < total.bubbling.size(); ++pair) {
+        const Shard::Bubbling &bubbling = shard->bubbling[pair];
+        total.bubbling[pair].dispatched += bubbling.dispatched.load(std::memory_order_relaxed);
+        total.bubbling[pair].levels += bubbling.levels.load(std::memory_order_relaxed);
+        total.bubbling[pair].dropped += bubbling.dropped.load(std::memory_order_relaxed);
+        total.bubbling[pair].ns += bubbling.ns.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  return total;
+}
+
+namespace {
+
+void collectNames(const HsmStateBase &top, std::vector<const char *> &names) {
+  hsmVisitStates(top, [&](const HsmStateBase &state) {
+    if (names.size() <= state.index) {
+      names.resize(state.index + 1);
+    }
+    names[state.index] = state.name();
+  });
+}
+
+} // namespace
+
+void HsmMetrics::cpuReport(std::ostream &out, const HsmStateBase &top) const {
+  const Snapshot total = snapshot();
+  std::vector<const char *> names;
+  collectNames(top, names);
+
+  std::vector<unsigned> states(stateCount);
+  for (unsigned state = 0; state < stateCount; ++state) {
+    states[state] = state;
+  }
+  std::stable_sort(states.begin(), states.end(),
+                   [&](unsigned a, unsigned b) { return total.cpu[a].total() > total.cpu[b].total(); });
+
+  uint64_t all = total.cpuOverhead;
+  for (const CpuTime &cpu : total.cpu) {
+    all += cpu.total();
+  }
+  // Estimated microseconds for all steps
+  const double scale = (total.cpuSamplePeriod ? total.cpuSamplePeriod : 1) / hsmTimestampsPerMicrosecond();
+  const auto share = [&](uint64_t ticks) { return all ? 100.0 * ticks / all : 0.0; };
+
+  char line[160];
+  std::snprintf(line, sizeof(line), "cpu time in us, %llu steps sampled, 1 of %u\n",
+                static_cast<unsigned long long>(total.cpuSamples), total.cpuSamplePeriod);
+  out << line;
+  std::snprintf(line, sizeof(line), "%-24s %12s %12s %12s %12s %7s\n", "state", "handler", "enter", "exit", "init",
+                "share");
+  out << line;
+  for (unsigned state : states) {
+    const CpuTime &cpu = total.cpu[state];
+    const std::string name = state < names.size() && names[state] ? names[state] : "state " + std::to_string(state);
+    std::snprintf(line, sizeof(line), "%-24s %12.1f %12.1f %12.1f %12.1f %6.1f%%\n", name.c_str(),
+                  cpu.ticks[0] * scale, cpu.ticks[1] * scale, cpu.ticks[2] * scale, cpu.ticks[3] * scale,
+                  share(cpu.total()));
+    out << line;
+  }
+  std::snprintf(line, sizeof(line), "%-24s %12.1f %12s %12s %12s %6.1f%%\n", "(framework)",
+                total.cpuOverhead * scale, "", "", "", share(total.cpuOverhead));
+  out << line;
+}
+
+void HsmMetrics::bubblingReport(std::ostream &out, const HsmStateBase &top, unsigned rows) const {
+  const Snapshot total = snapshot();
+  std::vector<const char *> names;
+  collectNames(top, names);
+  const auto stateName = [&](unsigned state) {
+    return state < names.size() && names[state] ? std::string(names[state]) : "state " + std::to_string(state);
+  };
+
+  std::vector<std::size_t> pairs;
+  uint64_t all = 0;
+  for (std::size_t pair = 0; pair < total.bubbling.size(); ++pair) {
+    if (total.bubbling[pair].dispatched) {
+      pairs.push_back(pair);
+      all += total.bubbling[pair].ns;
+    }
+  }
+  std::stable_sort(pairs.begin(), pairs.end(),
+                   [&](std::size_t a, std::size_t b) { return total.bubbling[a].ns > total.bubbling[b].ns; });
+  if (pairs.size() > rows) {
+    pairs.resize(rows);
+  }
+
+  char line[200];
+  std::snprintf(line, sizeof(line), "%-24s %-24s %10s %7s %8s %12s %7s\n", "event", "leaf", "dispatched", "levels",
+                "dropped", "time us", "share");
+  out << line;
+  // Pairs making up the first 80% of the time dominate
+  uint64_t accumulated = 0;
+  for (std::size_t pair : pairs) {
+    const Bubbling &bubbling = total.bubbling[pair];
+    const double levels = double(bubbling.levels) / bubbling.dispatched;
+    const bool dominant = accumulated < all * 8 / 10;
+    accumulated += bubbling.ns;
+
+    const char *advice = "";
+    if (dominant && bubbling.dropped * 2 > bubbling.dispatched && levels >= 2) {
+      advice = "drop lower";
+    } else if (dominant && levels >= 2) {
+      advice = "handle lower";
+    }
+    const std::string event = hsmEventName(static_cast<uint16_t>(pair / stateCount));
+    std::snprintf(line, sizeof(line), "%-24s %-24s %10llu %7.1f %7.1f%% %12.1f %6.1f%% %s\n", event.c_str(),
+                  stateName(pair % stateCount).c_str(), static_cast<unsigned long long>(bubbling.dispatched), levels,
+                  100.0 * bubbling.dropped / bubbling.dispatched, bubbling.ns / 1e3,
+                  all ? 100.0 * bubbling.ns / all : 0.0, advice);
+    out << line;
+  }
+}
+
+} // namespace hsp
@@ -0,0 +1,76 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_payload.h"
+
+#include <algorithm>
+
+namespace hsp {
+
+HsmPayloadArena::HsmPayloadArena(std::size_t blockSize)
+    : blockSize(blockSize) {
+  assert(blockSize > 0);
+}
+
+HsmPayloadArena::~HsmPayloadArena() { release(); }
+
+//!
+// Destroy the payloads in reverse order of construction and rewind to the first block
+//
+void HsmPayloadArena::release() {
+  for (Destructor *destructor = destructors; destructor; destructor = destructor->next) {
+    destructor->destroy(destructor->object);
+  }
+  destructors = nullptr;
+  block = 0;
+  offset = 0;
+  usedBytes = 0;
+  payloads = 0;
+}
+
+void *HsmPayloadArena::allocate(std::size_t size, std::size_t alignment) {
+  assert(alignment <= alignof(std::max_align_t) && "Over aligned payloads are not supported");
+
+  while (block < blocks.size()) {
+    const std::size_t begin = (offset + alignment - 1) / alignment * alignment;
+    if (begin + size <= blocks[block].size) {
+      offset = begin + size;
+      usedBytes += size;
+      return reinterpret_cast<char *>(blocks[block].memory.get()) + begin;
+    }
+    // Continue in the next block
+    ++block;
+    offset = 0;
+  }
+
+  // Payloads larger than a block get a block of their own
+  const std::size_t newSize = std::max(size, blockSize);
+  const std::size_t elements = (newSize + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+  blocks.push_back({std::unique_ptr<std::max_align_t[]>(new std::max_align_t[elements]), elements * sizeof(std::max_align_t)});
+  block = blocks.size() - 1;
+  capacityBytes += blocks[block].size;
+  offset = size;
+  usedBytes += size;
+  return blocks[block].memory.get();
+}
+
+} // namespace hsp
@@ -0,0 +1,212 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_scheduler.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace hsp {
+
+HsmScheduler::HsmScheduler(unsigned defaultQuota, Policy policy)
+    : defaultQuota(defaultQuota)
+    , policy(policy) {
+  assert(defaultQuota > 0);
+}
+
+HsmScheduler::MachineId HsmScheduler::addMachine(unsigned quota) {
+  mailboxes.emplace_back();
+  mailboxes.back().quota = quota ? quota : defaultQuota;
+  return mailboxes.size() - 1;
+}
+
+void HsmScheduler::setQuota(MachineId machine, unsigned quota) {
+  assert(machine < mailboxes.size());
+  mailboxes[machine].quota = quota ? quota : defaultQuota;
+}
+
+void HsmScheduler::post(MachineId machine, std::function<void()> event) { post(machine, std::move(event), NO_DEADLINE); }
+
+void HsmScheduler::post(MachineId machine, std::function<void()> event, Clock::time_point deadline, EventType type) {
+  assert(machine < mailboxes.size());
+  Mailbox &mailbox = mailboxes[machine];
+
+  // Round-robin mailboxes are FIFO, which is the heap order when all events are equally due
+  const Clock::time_point due = policy == Policy::EarliestDeadlineFirst ? deadline : NO_DEADLINE;
+  mailbox.events.push_back({std::move(event), Clock::now(), deadline, due, type, sequence++, hsmCorrelation()});
+  std::push_heap(mailbox.events.begin(), mailbox.events.end(), Later());
+  pending++;
+
+  if (policy == Policy::RoundRobin) {
+    makeReady(machine);
+  } else {
+    makeUrgent(machine);
+  }
+
+  MachineStats &stats = mailbox.stats;
+  stats.posted++;
+  stats.backlog = mailbox.events.size();
+  stats.maxBacklog = std::max(stats.maxBacklog, stats.backlog);
+}
+
+unsigned HsmScheduler::runSlice() { return policy == Policy::RoundRobin ? runRoundRobinSlice() : runEarliestDeadlineSlice(); }
+
+uint64_t HsmScheduler::run() {
+  uint64_t dispatched = 0;
+  while (pending) {
+    dispatched += runSlice();
+  }
+  return dispatched;
+}
+
+HsmScheduler::DeadlineStats HsmScheduler::deadlineStats(EventType type) const {
+  auto found = typeStats.find(type);
+  return found != typeStats.end() ? found->second : DeadlineStats();
+}
+
+//!
+// Only the machines ready when the slice starts are served. Machines getting events during the slice are
+// served in the next slice.
+//
+unsigned HsmScheduler::runRoundRobinSlice() {
+  unsigned dispatched = 0;
+
+  for (size_t count = ready.size(); count != 0; --count) {
+    MachineId machine = ready.front();
+    ready.pop_front();
+    Mailbox &mailbox = mailboxes[machine];
+    mailbox.ready = false;
+
+    for (unsigned quota = mailbox.quota; quota != 0 && not mailbox.events.empty(); --quota) {
+      dispatch(mailbox);
+      dispatched++;
+    }
+
+    // Back of the line if more events are pending
+    if (not mailbox.events.empty()) {
+      makeReady(machine);
+    }
+  }
+  return dispatched;
+}
+
+//!
+// Repeatedly dispatch the most urgent event of all machines with quota left. The slice ends when all
+// machines have used their quota or have no more events.
+//
+unsigned HsmScheduler::runEarliestDeadlineSlice() {
+  unsigned dispatched = 0;
+
+  while (not urgent.empty()) {
+    MachineId machine = urgent.begin()->machine;
+    urgent.erase(urgent.begin());
+    Mailbox &mailbox = mailboxes[machine];
+    mailbox.ready = false;
+
+    dispatch(mailbox);
+    dispatched++;
+
+    // Events posted by the event to its own machine could have made it urgent again
+    if (mailbox.ready) {
+      urgent.erase(mailbox.urgency);
+      mailbox.ready = false;
+    }
+    if (++mailbox.used == mailbox.quota) {
+      exhausted.push_back(machine);
+    } else if (not mailbox.events.empty()) {
+      makeUrgent(machine);
+    }
+  }
+
+  // Next slice
+  for (MachineId machine : exhausted) {
+    mailboxes[machine].used = 0;
+    if (not mailboxes[machine].events.empty()) {
+      makeUrgent(machine);
+    }
+  }
+  exhausted.clear();
+
+  return dispatched;
+}
+
+void HsmScheduler::makeReady(MachineId machine) {
+  if (not mailboxes[machine].ready) {
+    mailboxes[machine].ready = true;
+    ready.push_back(machine);
+  }
+}
+
+//!
+// (Re)insert the machine in the urgent set, unless it has used its quota. A new event could be more
+// urgent than the event the machine was inserted with.
+//
+void HsmScheduler::makeUrgent(MachineId machine) {
+  Mailbox &mailbox = mailboxes[machine];
+  if (mailbox.used == mailbox.quota) {
+    return; // In exhausted
+  }
+  if (mailbox.ready) {
+    urgent.erase(mailbox.urgency);
+  }
+  mailbox.urgency = urgencyOf(machine);
+  mailbox.ready = true;
+  urgent.insert(mailbox.urgency);
+}
+
+HsmScheduler::Urgency HsmScheduler::urgencyOf(MachineId machine) const {
+  const Event &next = mailboxes[machine].events.front();
+  return {next.due, next.sequence, machine};
+}
+
+void HsmScheduler::dispatch(Mailbox &mailbox) {
+  std::pop_heap(mailbox.events.begin(), mailbox.events.end(), Later());
+  Event event = std::move(mailbox.events.back());
+  mailbox.events.pop_back();
+  pending--;
+
+  MachineStats &stats = mailbox.stats;
+  const Clock::duration latency = Clock::now() - event.posted;
+  stats.dispatched++;
+  stats.backlog = mailbox.events.size();
+  stats.totalLatency += latency;
+  stats.maxLatency = std::max(stats.maxLatency, latency);
+
+  // Note: The event could post to this mailbox
+  {
+    HsmCorrelationScope scope(event.correlation);
+    event.dispatch();
+  }
+
+  if (event.deadline != NO_DEADLINE) {
+    const Clock::duration lateness = Clock::now() - event.deadline;
+    for (DeadlineStats *deadlines : {&stats.deadlines, &typeStats[event.type]}) {
+      deadlines->dispatched++;
+      if (lateness.count() > 0) {
+        deadlines->misses++;
+        deadlines->maxLateness = std::max(deadlines->maxLateness, lateness);
+      }
+    }
+  }
+}
+
+} // namespace hsp
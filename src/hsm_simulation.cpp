@@ -0,0 +1,110 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_simulation.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace hsp {
+
+HsmSimulation::HsmSimulation(uint64_t seed)
+    : generator(seed) {}
+
+HsmSimulation::EventId HsmSimulation::schedule(Duration delay, std::function<void()> event) {
+  assert(delay.count() >= 0 && "Events cannot be scheduled in the past");
+  EventId id = nextId++;
+  queue.push({currentTime + delay, id});
+  events.emplace(id, Scheduled{std::move(event), hsmCorrelation()});
+  return id;
+}
+
+void HsmSimulation::cancel(EventId id) { events.erase(id); }
+
+void HsmSimulation::post(std::function<void()> event) { schedule(Duration(0), std::move(event)); }
+
+bool HsmSimulation::step() {
+  dropCancelled();
+  if (queue.empty()) {
+    return false;
+  }
+  Entry next = queue.top();
+  queue.pop();
+
+  auto found = events.find(next.id);
+  Scheduled scheduled = std::move(found->second);
+  events.erase(found);
+
+  currentTime = next.time;
+  {
+    HsmCorrelationScope scope(scheduled.correlation);
+    scheduled.event();
+  }
+  dispatchedEvents++;
+  return true;
+}
+
+uint64_t HsmSimulation::runUntil(TimePoint end) {
+  const uint64_t before = dispatchedEvents;
+  const auto started = std::chrono::steady_clock::now();
+
+  // Cancelled entries are dropped first, so the time of the top is the time of the next live event
+  for (dropCancelled(); not queue.empty() && queue.top().time <= end; dropCancelled()) {
+    step();
+  }
+  currentTime = std::max(currentTime, end);
+
+  wallTime += std::chrono::steady_clock::now() - started;
+  return dispatchedEvents - before;
+}
+
+void HsmSimulation::dropCancelled() {
+  while (not queue.empty() && events.count(queue.top().id) == 0) {
+    queue.pop();
+  }
+}
+
+double HsmSimulation::eventsPerSecond() const { return wallTime.count() > 0 ? dispatchedEvents / wallTime.count() : 0; }
+
+HsmSimulationTimer::HsmSimulationTimer(HsmSimulation &simulation, HsmSimulation::Duration timeout)
+    : simulation(simulation)
+    , timeout(timeout) {}
+
+HsmSimulationTimer::~HsmSimulationTimer() { cancel(); }
+
+void HsmSimulationTimer::start(std::function<void()> timeoutCallback) {
+  cancel();
+  isRunning = true;
+  event = simulation.schedule(timeout, [this, timeoutCallback = std::move(timeoutCallback)] {
+    isRunning = false;
+    timeoutCallback();
+  });
+}
+
+void HsmSimulationTimer::cancel() {
+  if (isRunning) {
+    simulation.cancel(event);
+    isRunning = false;
+  }
+}
+
+} // namespace hsp
@@ -22,18 +22,40 @@
 
 #include "hsm_state.h"
 
+#include <cassert>
+
 namespace hsp {
 
 //!
-// Constructor
+// Constructor. Links the state into the sub states of its super state.
 //
 HsmStateBase::HsmStateBase(HsmStateBase *const superState)
-    : superState(superState) {}
+    : superState(superState) {
+  if (superState) {
+    nextSibling = superState->firstSubstate;
+    superState->firstSubstate = this;
+
+    HsmStateBase *top = superState;
+    while (top->superState) {
+      top = top->superState;
+    }
+    index = top->stateCount++;
+  }
+}
 
 //!
-// Destructor
+// Destructor. Unlinks the state from the sub states of its super state, which must still exist.
 //
-HsmStateBase::~HsmStateBase() {}
+HsmStateBase::~HsmStateBase() {
+  if (superState) {
+    HsmStateBase **link = &superState->firstSubstate;
+    while (*link && *link != this) {
+      link = &(*link)->nextSibling;
+    }
+    assert(*link == this && "The state must be a sub state of its super state");
+    *link = nextSibling;
+  }
+}
 
 //!
 // Default behavior of entering a state
@@ -51,4 +73,9 @@ void HsmStateBase::onExit() {}
 //
 void HsmStateBase::onInit() {}
 
+//!
+// States are unnamed by default
+//
+const char *HsmStateBase::name() const { return nullptr; }
+
 } // namespace hsp
@@ -0,0 +1,68 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_state_storage.h"
+
+#include <algorithm>
+
+namespace hsp {
+
+//!
+// Place data after the data of the nearest state in the hierarchy, starting from the owner itself, that
+// already has data.
+//
+std::size_t HsmStateStorage::place(const HsmStateBase &owner, std::size_t size, std::size_t alignment) {
+  assert(not area && "State data must be declared before it is used");
+#ifndef NDEBUG
+  for (const Placement &placement : placements) {
+    for (const HsmStateBase *state = placement.state->superState; state; state = state->superState) {
+      assert(state != &owner && "Super states must declare their data before their sub states");
+    }
+  }
+#endif
+
+  std::size_t begin = 0;
+  for (const HsmStateBase *state = &owner; state; state = state->superState) {
+    auto placed = std::find_if(placements.rbegin(), placements.rend(), [state](const Placement &placement) { return placement.state == state; });
+    if (placed != placements.rend()) {
+      begin = placed->end;
+      break;
+    }
+  }
+
+  const std::size_t offset = (begin + alignment - 1) / alignment * alignment;
+  placements.push_back({&owner, offset + size});
+  maxSize = std::max(maxSize, offset + size);
+  return offset;
+}
+
+//!
+// The area is allocated when first used, when the size of all paths is known
+//
+void *HsmStateStorage::at(std::size_t offset) {
+  if (not area) {
+    area.reset(new std::max_align_t[(maxSize + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t)]);
+  }
+  return reinterpret_cast<char *>(area.get()) + offset;
+}
+
+} // namespace hsp
@@ -0,0 +1,205 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_trace_export.h"
+#include "hsm_event_type.h"
+#include "hsm_state.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+namespace hsp {
+
+namespace {
+
+void collectNames(const HsmStateBase &top, std::vector<std::string> &names) {
+  hsmVisitStates(top, [&](const HsmStateBase &state) {
+    if (names.size() <= state.index) {
+      names.resize(state.index + 1);
+    }
+    if (const char *name = state.name()) {
+      names[state.index] = name;
+    }
+  });
+}
+
+} // namespace
+
+HsmTraceExporter::HsmTraceExporter(std::ostream &out, double timestampsPerMicrosecond)
+    : out(out)
+    , timestampsPerMicrosecond(timestampsPerMicrosecond) {
+  assert(timestampsPerMicrosecond > 0);
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+}
+
+HsmTraceExporter::~HsmTraceExporter() { finish(); }
+
+void HsmTraceExporter::nameStates(const HsmStateBase &top) { collectNames(top, stateNames); }
+
+void HsmTraceExporter::nameStates(uint32_t machine, const HsmStateBase &top) {
+  collectNames(top, machineStateNames[machine]);
+}
+
+void HsmTraceExporter::nameMachine(uint32_t machine, const std::string &name) {
+  assert(machines.count(machine) == 0 && "Machine must be named before its first record");
+  machineNames[machine] = name;
+}
+
+void HsmTraceExporter::add(const HsmTraceRecord &record) {
+  assert(not finished && "No records can be added after finish()");
+
+  if (not started) {
+    origin = record.timestamp;
+    started = true;
+  }
+  if (machines.insert(record.machine).second) {
+    writeTrack(record.machine);
+  }
+
+  unsigned &open = openSlices[record.machine];
+  if (record.kind == HsmTraceRecord::ENTER) {
+    open++;
+  } else if (record.kind == HsmTraceRecord::EXIT) {
+    if (open == 0) {
+      // The slice was entered before the oldest record
+      return;
+    }
+    open--;
+  }
+
+  beginEvent();
+  switch (record.kind) {
+  case HsmTraceRecord::ENTER:
+  case HsmTraceRecord::EXIT:
+    out << "{\"ph\":\"" << (record.kind == HsmTraceRecord::ENTER ? 'B' : 'E') << "\",\"name\":";
+    writeState(record.machine, record.kind == HsmTraceRecord::ENTER ? record.target : record.source);
+    break;
+  case HsmTraceRecord::EVENT:
+    out << "{\"ph\":\"i\",\"s\":\"t\",\"name\":";
+    writeEventName(record.event);
+    out << ",\"args\":{\"handled\":" << (record.handled ? "true" : "false") << ",\"source\":";
+    writeState(record.machine, record.source);
+    out << ",\"target\":";
+    writeState(record.machine, record.target);
+    if (record.correlation) {
+      out << ",\"correlation\":" << record.correlation;
+    }
+    out << "}";
+    break;
+  }
+  out << ",\"pid\":1,\"tid\":" << record.machine << ",\"ts\":";
+  writeTimestamp(record.timestamp);
+  out << "}";
+}
+
+void HsmTraceExporter::add(const HsmTraceRecord *records, std::size_t count) {
+  // Records of threads sharing a recorder may be out of order, start at the earliest
+  if (not started && count > 0) {
+    origin = std::min_element(records, records + count, [](const HsmTraceRecord &a, const HsmTraceRecord &b) {
+               return a.timestamp < b.timestamp;
+             })->timestamp;
+    started = true;
+  }
+  for (std::size_t i = 0; i < count; ++i) {
+    add(records[i]);
+  }
+}
+
+void HsmTraceExporter::add(const HsmFlightRecorder &recorder) {
+  std::vector<HsmTraceRecord> records(recorder.capacity());
+  add(records.data(), recorder.snapshot(records.data(), records.size()));
+}
+
+void HsmTraceExporter::finish() {
+  if (not finished) {
+    out << "\n]}\n";
+    out.flush();
+    finished = true;
+  }
+}
+
+void HsmTraceExporter::beginEvent() {
+  out << (first ? "\n" : ",\n");
+  first = false;
+}
+
+//!
+// Metadata naming the track of a machine
+//
+void HsmTraceExporter::writeTrack(uint32_t machine) {
+  beginEvent();
+  out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << machine << ",\"args\":{\"name\":";
+  auto named = machineNames.find(machine);
+  if (named != machineNames.end()) {
+    writeString(named->second.data(), named->second.size());
+  } else {
+    out << "\"machine " << machine << "\"";
+  }
+  out << "}}";
+}
+
+void HsmTraceExporter::writeTimestamp(uint64_t timestamp) {
+  char text[32];
+  // Signed, a record may be older than the origin
+  const auto ticks = static_cast<int64_t>(timestamp - origin);
+  std::snprintf(text, sizeof(text), "%.3f", static_cast<double>(ticks) / timestampsPerMicrosecond);
+  out << text;
+}
+
+void HsmTraceExporter::writeState(uint32_t machine, uint16_t state) {
+  if (state == HSM_TRACE_NO_STATE) {
+    out << "null";
+    return;
+  }
+  auto own = machineStateNames.find(machine);
+  const Names &names = own != machineStateNames.end() ? own->second : stateNames;
+  if (state < names.size() && not names[state].empty()) {
+    writeString(names[state].data(), names[state].size());
+  } else {
+    out << "\"state " << state << "\"";
+  }
+}
+
+void HsmTraceExporter::writeEventName(uint16_t event) {
+  const std::string name = hsmEventName(event);
+  writeString(name.data(), name.size());
+}
+
+void HsmTraceExporter::writeString(const char *text, std::size_t length) {
+  out << '"';
+  for (std::size_t i = 0; i < length; ++i) {
+    const unsigned char c = text[i];
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out << escaped;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+} // namespace hsp
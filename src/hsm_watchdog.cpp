@@ -0,0 +1,178 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_watchdog.h"
+#include "hsm.h"
+#include "hsm_flight_recorder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+namespace hsp {
+
+//!
+// Called by the machine thread when the step is done. Reports it if over budget.
+//
+void HsmWatchdogSlot::endStep(uint64_t elapsed) {
+  stepBegin.store(0, std::memory_order_release);
+  if (elapsed > budget) {
+    watchdog.reporter(watchdog.overrun(*this, slowest, false, elapsed, slowestTicks));
+  }
+}
+
+HsmWatchdog::HsmWatchdog(Reporter reporter)
+    : reporter(std::move(reporter))
+    , ticksPerNanosecond(hsmTimestampsPerMicrosecond() / 1000) {
+  assert(this->reporter && "A reporter is needed");
+}
+
+HsmWatchdog::~HsmWatchdog() {
+  stopMonitor();
+  for (const auto &slot : slots) {
+    slot->hsm.watchdogSlot = nullptr;
+  }
+}
+
+void HsmWatchdog::watch(HsmBase &hsm, std::chrono::nanoseconds budget, uint32_t machine) {
+  assert(hsm.watchdogSlot == nullptr && "The machine is already watched");
+  const uint64_t budgetTicks = static_cast<uint64_t>(budget.count() * ticksPerNanosecond);
+  std::unique_ptr<HsmWatchdogSlot> slot(new HsmWatchdogSlot(*this, hsm, budgetTicks, machine));
+  std::vector<const HsmStateBase *> &states = slot->states;
+  hsmVisitStates(hsm.topState, [&](const HsmStateBase &state) {
+    if (states.size() <= state.index) {
+      states.resize(state.index + 1);
+    }
+    states[state.index] = &state;
+  });
+
+  std::lock_guard<std::mutex> lock(slotsMutex);
+  hsm.watchdogSlot = slot.get();
+  slots.push_back(std::move(slot));
+}
+
+void HsmWatchdog::unwatch(HsmBase &hsm) {
+  std::lock_guard<std::mutex> lock(slotsMutex);
+  auto found = std::find_if(slots.begin(), slots.end(), [&](const auto &slot) { return &slot->hsm == &hsm; });
+  assert(found != slots.end() && "The machine is not watched by this watchdog");
+  hsm.watchdogSlot = nullptr;
+  slots.erase(found);
+}
+
+void HsmWatchdog::startMonitor(std::chrono::nanoseconds period) {
+  assert(not monitor.joinable() && "The monitor is already started");
+  monitorStopped = false;
+  monitor = std::thread([this, period] {
+    std::unique_lock<std::mutex> lock(monitorMutex);
+    while (not monitorWakeup.wait_for(lock, period, [this] { return monitorStopped; })) {
+      check();
+    }
+  });
+}
+
+void HsmWatchdog::stopMonitor() {
+  if (not monitor.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(monitorMutex);
+    monitorStopped = true;
+  }
+  monitorWakeup.notify_one();
+  monitor.join();
+}
+
+unsigned HsmWatchdog::check() {
+  std::vector<Overrun> overruns;
+  std::unique_lock<std::mutex> lock(slotsMutex);
+  for (const auto &slot : slots) {
+    const uint64_t begin = slot->stepBegin.load(std::memory_order_acquire);
+    const uint64_t step = slot->steps.load(std::memory_order_relaxed);
+    if (begin == 0 || step == slot->reportedStep) {
+      continue;
+    }
+    const uint64_t now = hsmTimestamp();
+    const uint32_t activity = slot->activity.load(std::memory_order_relaxed);
+    // The step could have completed while reading the activity
+    if (now <= begin || now - begin <= slot->budget || slot->stepBegin.load(std::memory_order_acquire) != begin) {
+      continue;
+    }
+    slot->reportedStep = step;
+    overruns.push_back(overrun(*slot, activity, true, now - begin, 0));
+  }
+  // Report without the lock, so the reporter can watch and unwatch machines
+  lock.unlock();
+  for (const Overrun &stalled : overruns) {
+    reporter(stalled);
+  }
+  return static_cast<unsigned>(overruns.size());
+}
+
+HsmWatchdog::Overrun HsmWatchdog::overrun(const HsmWatchdogSlot &slot, uint32_t activity, bool stalled,
+                                          uint64_t elapsed, uint64_t callbackTicks) const {
+  const auto toNanoseconds = [this](uint64_t ticks) {
+    return std::chrono::nanoseconds(static_cast<std::chrono::nanoseconds::rep>(ticks / ticksPerNanosecond));
+  };
+  Overrun overrun;
+  overrun.machine = slot.machine;
+  overrun.state = Overrun::NO_STATE;
+  overrun.callback = static_cast<HsmCallback>(activity & 0xFF);
+  if (activity && (activity >> 8) - 1 < slot.states.size()) {
+    // Called by the machine thread, or by the monitor holding the slots lock, so the state is still alive
+    const HsmStateBase &state = *slot.states[(activity >> 8) - 1];
+    overrun.state = state.index;
+    if (const char *name = state.name()) {
+      overrun.stateName = name;
+    }
+  }
+  overrun.stalled = stalled;
+  overrun.elapsed = toNanoseconds(elapsed);
+  overrun.callbackTime = toNanoseconds(callbackTicks);
+  overrun.budget = toNanoseconds(slot.budget);
+  return overrun;
+}
+
+std::ostream &operator<<(std::ostream &out, const HsmWatchdog::Overrun &overrun) {
+  static const char *const callbacks[HSM_CALLBACKS] = {"handler", "onEnter()", "onExit()", "onInit()"};
+  const auto milliseconds = [](std::chrono::nanoseconds time) { return time.count() / 1e6; };
+
+  std::string callback = "framework";
+  if (overrun.state != HsmWatchdog::Overrun::NO_STATE) {
+    callback = overrun.stateName.empty() ? "state " + std::to_string(overrun.state) : overrun.stateName;
+    callback += "::";
+    callback += callbacks[static_cast<unsigned>(overrun.callback) % HSM_CALLBACKS];
+  }
+
+  char line[256];
+  if (overrun.stalled) {
+    std::snprintf(line, sizeof(line), "machine %u stalled in %s for %.1f ms, budget %.1f ms", overrun.machine,
+                  callback.c_str(), milliseconds(overrun.elapsed), milliseconds(overrun.budget));
+  } else {
+    std::snprintf(line, sizeof(line), "machine %u step took %.1f ms, budget %.1f ms, slowest %s %.1f ms",
+                  overrun.machine, milliseconds(overrun.elapsed), milliseconds(overrun.budget), callback.c_str(),
+                  milliseconds(overrun.callbackTime));
+  }
+  return out << line;
+}
+
+} // namespace hsp
@@ -0,0 +1,206 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//!
+// The pump example scaled up to many events, to measure the code generated per event and the
+// instruction cache misses when dispatching all of them. Each event is handled by the top state, so the
+// bubbling loop walks the whole hierarchy. Build with -DCMAKE_BUILD_TYPE=Release.
+//
+// Usage: hsm_event_benchmark [rounds]
+//
+
+using hsp::Hsm;
+using hsp::HsmState;
+
+// clang-format off
+#define HSM_BENCHMARK_EVENTS(EVENT) \
+  EVENT(0) EVENT(1) EVENT(2) EVENT(3) EVENT(4) EVENT(5) EVENT(6) EVENT(7) EVENT(8) EVENT(9) \
+  EVENT(10) EVENT(11) EVENT(12) EVENT(13) EVENT(14) EVENT(15) EVENT(16) EVENT(17) EVENT(18) EVENT(19) \
+  EVENT(20) EVENT(21) EVENT(22) EVENT(23) EVENT(24) EVENT(25) EVENT(26) EVENT(27) EVENT(28) EVENT(29) \
+  EVENT(30) EVENT(31) EVENT(32) EVENT(33) EVENT(34) EVENT(35) EVENT(36) EVENT(37) EVENT(38) EVENT(39) \
+  EVENT(40) EVENT(41) EVENT(42) EVENT(43) EVENT(44) EVENT(45) EVENT(46) EVENT(47) EVENT(48) EVENT(49) \
+  EVENT(50) EVENT(51) EVENT(52) EVENT(53) EVENT(54) EVENT(55) EVENT(56) EVENT(57) EVENT(58) EVENT(59) \
+  EVENT(60) EVENT(61) EVENT(62) EVENT(63) EVENT(64) EVENT(65) EVENT(66) EVENT(67) EVENT(68) EVENT(69) \
+  EVENT(70) EVENT(71) EVENT(72) EVENT(73) EVENT(74) EVENT(75) EVENT(76) EVENT(77) EVENT(78) EVENT(79) \
+  EVENT(80) EVENT(81) EVENT(82) EVENT(83) EVENT(84) EVENT(85) EVENT(86) EVENT(87) EVENT(88) EVENT(89) \
+  EVENT(90) EVENT(91) EVENT(92) EVENT(93) EVENT(94) EVENT(95) EVENT(96) EVENT(97) EVENT(98) EVENT(99) \
+  EVENT(100) EVENT(101) EVENT(102) EVENT(103) EVENT(104) EVENT(105) EVENT(106) EVENT(107) EVENT(108) EVENT(109) \
+  EVENT(110) EVENT(111) EVENT(112) EVENT(113) EVENT(114) EVENT(115) EVENT(116) EVENT(117) EVENT(118) EVENT(119) \
+  EVENT(120) EVENT(121) EVENT(122) EVENT(123) EVENT(124) EVENT(125) EVENT(126) EVENT(127)
+// clang-format on
+
+namespace {
+
+class PumpHsm;
+
+class PumpState : public HsmState<PumpState> {
+public:
+  PumpState(PumpHsm &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  //! Enter the initial sub state, if any
+  void onInit() override;
+
+#define HSM_DECLARE_HANDLER(n) \
+  virtual bool onEvent##n() { return false; }
+  HSM_BENCHMARK_EVENTS(HSM_DECLARE_HANDLER)
+
+  PumpState *initialSubstate = nullptr;
+
+protected:
+  PumpHsm &hsm;
+};
+
+class StateTop : public PumpState {
+public:
+  using PumpState::PumpState;
+
+#define HSM_OVERRIDE_HANDLER(n) bool onEvent##n() override;
+  HSM_BENCHMARK_EVENTS(HSM_OVERRIDE_HANDLER)
+};
+
+class PumpHsm : public Hsm<PumpState> {
+public:
+  PumpHsm()
+      : Hsm(top) {
+    top.initialSubstate = &pulsing;
+    pulsing.initialSubstate = &running;
+    running.initialSubstate = &pumping;
+  }
+
+#define HSM_TRIGGER(n) \
+  bool onEvent##n() { \
+    return onEvent([](PumpState &state) { return state.onEvent##n(); }); \
+  }
+  HSM_BENCHMARK_EVENTS(HSM_TRIGGER)
+
+  unsigned handled = 0;
+
+  StateTop top{*this, nullptr};
+  PumpState pulsing{*this, &top};
+  PumpState running{*this, &pulsing};
+  PumpState pumping{*this, &running};
+
+  friend PumpState;
+  friend StateTop;
+};
+
+void PumpState::onInit() {
+  if (initialSubstate) {
+    hsm.initialTransition(*initialSubstate);
+  }
+}
+
+#define HSM_DEFINE_HANDLER(n) \
+  bool StateTop::onEvent##n() { \
+    hsm.handled += n; \
+    return true; \
+  }
+HSM_BENCHMARK_EVENTS(HSM_DEFINE_HANDLER)
+
+using Trigger = bool (PumpHsm::*)();
+
+#define HSM_TRIGGER_ADDRESS(n) &PumpHsm::onEvent##n,
+const Trigger triggers[] = {HSM_BENCHMARK_EVENTS(HSM_TRIGGER_ADDRESS)};
+
+//! Counts L1 instruction cache misses of this thread, if the kernel and CPU allow it
+class ICacheMisses {
+public:
+  ICacheMisses() {
+#ifdef __linux__
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+  ~ICacheMisses() {
+#ifdef __linux__
+    if (fd >= 0) {
+      close(fd);
+    }
+#endif
+  }
+
+  bool available() const { return fd >= 0; }
+  long long read() const {
+    long long count = 0;
+#ifdef __linux__
+    if (fd >= 0 && ::read(fd, &count, sizeof(count)) != sizeof(count)) {
+      count = 0;
+    }
+#endif
+    return count;
+  }
+
+private:
+  int fd = -1;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const unsigned rounds = argc > 1 ? std::atoi(argv[1]) : 100000;
+  constexpr unsigned EVENTS = sizeof(triggers) / sizeof(triggers[0]);
+
+  PumpHsm hsm;
+  hsm.onStart();
+
+  ICacheMisses misses;
+  const long long missesBefore = misses.read();
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned round = 0; round < rounds; ++round) {
+    for (unsigned event = 0; event < EVENTS; ++event) {
+      (hsm.*triggers[event])();
+    }
+  }
+  std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+  const long long missesAfter = misses.read();
+
+  const double dispatched = double(rounds) * EVENTS;
+  std::printf("%u events, %.0f dispatched\n", EVENTS, dispatched);
+  std::printf("ns per event:          %6.2f\n", elapsed.count() / dispatched);
+  if (misses.available()) {
+    std::printf("L1I misses per event:  %6.3f\n", (missesAfter - missesBefore) / dispatched);
+  } else {
+    std::printf("L1I misses per event:  n/a (perf events not available)\n");
+  }
+  return hsm.handled == 0;
+}
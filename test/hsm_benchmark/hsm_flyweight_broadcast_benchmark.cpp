@@ -0,0 +1,159 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_flyweight_population.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+//!
+// Benchmark of a fleet wide standby event, dispatched through onEvent() in a loop and through the
+// broadcast kernel. Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+//
+// Usage: hsm_benchmark [machines]
+//
+
+using namespace hsp;
+
+namespace {
+
+class Pump;
+
+class PumpState : public FlyweightHsmState<Pump> {
+public:
+  using FlyweightHsmState::FlyweightHsmState;
+
+  virtual bool onRun(Pump &) const { return false; }
+  virtual bool onStandby(Pump &) const { return false; }
+};
+
+class StateTop : public PumpState {
+public:
+  using PumpState::PumpState;
+  void onInit(Pump &hsm) const override;
+};
+
+class StateStandby : public PumpState {
+public:
+  using PumpState::PumpState;
+  bool onRun(Pump &hsm) const override;
+  bool onStandby(Pump &) const override { return true; }
+};
+
+class StateRunning : public PumpState {
+public:
+  using PumpState::PumpState;
+  void onInit(Pump &hsm) const override;
+  bool onStandby(Pump &hsm) const override;
+};
+
+struct PumpModel : FlyweightHsmModel {
+  StateTop top{*this, nullptr};
+  StateStandby standby{*this, &top};
+  StateRunning running{*this, &top};
+  PumpState pumping{*this, &running};
+  PumpState flushing{*this, &running};
+};
+
+const PumpModel &model() {
+  static const PumpModel model;
+  return model;
+}
+
+struct PumpData {};
+
+class Pump : public FlyweightHsmCursor<PumpState, PumpData> {
+public:
+  using FlyweightHsmCursor::FlyweightHsmCursor;
+};
+
+void StateTop::onInit(Pump &hsm) const { hsm.initialTransition(model().standby); }
+
+bool StateStandby::onRun(Pump &hsm) const {
+  hsm.transition(model().running);
+  return true;
+}
+
+void StateRunning::onInit(Pump &hsm) const { hsm.initialHistoryTransition(model().pumping); }
+bool StateRunning::onStandby(Pump &hsm) const {
+  hsm.transition(model().standby);
+  return true;
+}
+
+auto run = [](const PumpState &state, Pump &hsm) { return state.onRun(hsm); };
+auto standby = [](const PumpState &state, Pump &hsm) { return state.onStandby(hsm); };
+
+//! Start every other pump
+void prepare(FlyweightHsmPopulation<Pump> &pumps) {
+  for (uint32_t pump = 0; pump < pumps.size(); pump += 2) {
+    pumps.onEvent(pump, run);
+  }
+}
+
+template <typename FUNCTION> double measure(FlyweightHsmPopulation<Pump> &pumps, FUNCTION function) {
+  constexpr unsigned ROUNDS = 20;
+  std::chrono::nanoseconds total{0};
+
+  for (unsigned round = 0; round < ROUNDS; ++round) {
+    prepare(pumps);
+    auto start = std::chrono::steady_clock::now();
+    function();
+    total += std::chrono::steady_clock::now() - start;
+  }
+  return double(total.count()) / ROUNDS / pumps.size();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const uint32_t machines = argc > 1 ? std::atoi(argv[1]) : 1000000;
+
+  FlyweightHsmPopulation<Pump> pumps(model(), machines);
+  for (uint32_t pump = 0; pump < machines; ++pump) {
+    pumps.add();
+  }
+
+  FlyweightHsmEventTable standbyTable(model());
+  standbyTable.ignore(model().standby);
+  standbyTable.transition(model().running, model().standby);
+
+  std::vector<std::pair<uint32_t, HsmStateId>> moved;
+  std::vector<uint32_t> scalar;
+  std::vector<HsmStateId> column(machines, model().standby.id);
+
+  std::printf("%u machines, ns per machine\n", machines);
+  std::printf("onEvent loop:   %6.2f\n", measure(pumps, [&] { pumps.broadcast(standby); }));
+  std::printf("kernel:         %6.2f\n", measure(pumps, [&] { pumps.broadcast(standbyTable, standby); }));
+
+  // Kernels alone on a column where no machine moves
+  auto kernelOnly = [&](auto kernel) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned round = 0; round < 20; ++round) {
+      kernel(standbyTable, column.data(), machines, moved, scalar);
+    }
+    return double((std::chrono::steady_clock::now() - start).count()) / 20 / machines;
+  };
+  std::printf("lookup vector:  %6.2f\n", kernelOnly(flyweightBroadcastKernel));
+  std::printf("lookup scalar:  %6.2f\n", kernelOnly(flyweightBroadcastKernelScalar));
+  return 0;
+}
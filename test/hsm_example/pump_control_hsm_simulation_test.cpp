@@ -0,0 +1,192 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pump_control_hsm.h"
+
+#include "hsm_simulation.h"
+
+#include <gmock/gmock.h>
+
+#include <memory>
+#include <vector>
+
+using namespace PumpControl;
+
+using hsp::HsmSimulation;
+using hsp::HsmSimulationTimer;
+
+using ::testing::Test;
+
+using namespace std::chrono_literals;
+
+namespace {
+
+class PumpCounter : public PumpControl::IPump {
+public:
+  void on() override { ons++; }
+  void off() override { offs++; }
+
+  uint64_t ons = 0;
+  uint64_t offs = 0;
+};
+
+class SimulatedTimer : public PumpControl::ITimer {
+public:
+  SimulatedTimer(HsmSimulation &simulation, HsmSimulation::Duration timeout)
+      : timer(simulation, timeout) {}
+
+  void start(std::function<void()> timeoutCallback) override { timer.start(std::move(timeoutCallback)); }
+  void cancel() override { timer.cancel(); }
+
+private:
+  HsmSimulationTimer timer;
+};
+
+//! A pump with randomized running and paused times
+struct SimulatedPump {
+  SimulatedPump(HsmSimulation &simulation)
+      : runningTimer(simulation, std::chrono::seconds(30 + simulation.random()() % 60))
+      , pausedTimer(simulation, std::chrono::seconds(60 + simulation.random()() % 120))
+      , hsm(pump, runningTimer, pausedTimer) {}
+
+  PumpCounter pump;
+  SimulatedTimer runningTimer;
+  SimulatedTimer pausedTimer;
+  PumpControlHsm hsm;
+};
+
+struct FleetResult {
+  uint64_t dispatched = 0;
+  uint64_t ons = 0;
+  uint64_t offs = 0;
+  double eventsPerSecond = 0;
+};
+
+//!
+// Simulate a fleet of pumps where an operator sends random commands to random pumps
+//
+FleetResult simulateFleet(uint64_t seed, unsigned pumps, HsmSimulation::Duration duration) {
+  HsmSimulation simulation(seed);
+  std::vector<std::unique_ptr<SimulatedPump>> fleet;
+
+  for (unsigned i = 0; i < pumps; ++i) {
+    fleet.push_back(std::make_unique<SimulatedPump>(simulation));
+    fleet.back()->hsm.onStart();
+    fleet.back()->hsm.onPulsing();
+  }
+
+  std::function<void()> operatorCommand = [&] {
+    PumpControlHsm &hsm = fleet[simulation.random()() % fleet.size()]->hsm;
+    switch (simulation.random()() % 3) {
+    case 0:
+      hsm.onStandby();
+      break;
+    case 1:
+      hsm.onContinuous();
+      break;
+    default:
+      hsm.onPulsing();
+      break;
+    }
+    simulation.schedule(std::chrono::seconds(simulation.random()() % 60), operatorCommand);
+  };
+  simulation.post(operatorCommand);
+
+  simulation.runUntil(duration);
+
+  FleetResult result;
+  result.dispatched = simulation.dispatched();
+  result.eventsPerSecond = simulation.eventsPerSecond();
+  for (auto &pump : fleet) {
+    result.ons += pump->pump.ons;
+    result.offs += pump->pump.offs;
+  }
+  return result;
+}
+
+} // namespace
+
+TEST(PumpControlHsmSimulationTest, timersExpireInVirtualTime) {
+  HsmSimulation simulation;
+  SimulatedPump pump(simulation);
+
+  pump.hsm.onStart();
+  pump.hsm.onPulsing();
+  EXPECT_EQ(1u, pump.pump.ons);
+
+  // Running and paused times are at most 89s and 179s
+  simulation.runUntil(268s);
+  EXPECT_EQ(2u, pump.pump.ons);
+  EXPECT_EQ(268s, simulation.now());
+}
+
+TEST(PumpControlHsmSimulationTest, fleetIsDeterministic) {
+  const FleetResult first = simulateFleet(42, 100, 24h);
+  const FleetResult second = simulateFleet(42, 100, 24h);
+  const FleetResult other = simulateFleet(43, 100, 24h);
+
+  EXPECT_GT(first.dispatched, 10000u);
+  EXPECT_EQ(first.dispatched, second.dispatched);
+  EXPECT_EQ(first.ons, second.ons);
+  EXPECT_EQ(first.offs, second.offs);
+  EXPECT_NE(first.ons, other.ons);
+
+  RecordProperty("events", static_cast<int>(first.dispatched));
+  RecordProperty("eventsPerSecond", static_cast<int>(first.eventsPerSecond));
+}
+
+TEST(PumpControlHsmSimulationTest, cancelledEventsDoNotAdvanceRunUntil) {
+  HsmSimulation simulation;
+  HsmSimulationTimer cancelled(simulation, 5ns);
+  bool late = false;
+  cancelled.start([] {});
+  simulation.schedule(100ns, [&] { late = true; });
+  cancelled.cancel();
+
+  EXPECT_EQ(0u, simulation.runUntil(10ns));
+  EXPECT_FALSE(late);
+  EXPECT_EQ(10ns, simulation.now());
+
+  EXPECT_EQ(1u, simulation.runUntil(100ns));
+  EXPECT_TRUE(late);
+}
+
+TEST(PumpControlHsmSimulationTest, correlationOfSchedulerKept) {
+  HsmSimulation simulation;
+  HsmSimulationTimer timer(simulation, 5ns);
+  const hsp::HsmCorrelationId command = hsp::hsmNewCorrelation();
+  hsp::HsmCorrelationId posted = 0;
+  hsp::HsmCorrelationId timeout = 0;
+  {
+    hsp::HsmCorrelationScope scope(command);
+    simulation.post([&] {
+      posted = hsp::hsmCorrelation();
+      // The timer started by the posted event inherits the correlation
+      timer.start([&] { timeout = hsp::hsmCorrelation(); });
+    });
+  }
+
+  simulation.runUntil(10ns);
+  EXPECT_EQ(command, posted);
+  EXPECT_EQ(command, timeout);
+  EXPECT_EQ(0u, hsp::hsmCorrelation());
+}
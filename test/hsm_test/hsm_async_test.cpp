@@ -0,0 +1,275 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_async.h"
+#include "hsm_event_loop.h"
+
+#include <gmock/gmock.h>
+
+#include <deque>
+#include <thread>
+
+using hsp::Hsm;
+using hsp::HsmAsyncAction;
+using hsp::HsmEventLoop;
+using hsp::HsmState;
+using hsp::HsmWorkerExecutor;
+using hsp::IExecutor;
+
+using ::testing::Test;
+
+//!
+// Hsm turning on a slow motor with an asynchronous action
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Off
+//   Off --> Starting : TurnOn
+//   Starting : onEnter / async motorOn()
+//   Starting --> On : MotorOn
+//   Starting --> Fault : MotorFailed
+//   Top --> Off : TurnOff
+// }
+//
+// @enduml
+//
+
+namespace {
+
+//! Executor only running the work when told so
+class ManualExecutor : public IExecutor {
+public:
+  void post(std::function<void()> work) override { queue.push_back(std::move(work)); }
+
+  unsigned runAll() {
+    unsigned count = 0;
+    while (not queue.empty()) {
+      auto work = std::move(queue.front());
+      queue.pop_front();
+      work();
+      count++;
+    }
+    return count;
+  }
+
+  std::deque<std::function<void()>> queue;
+};
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onTurnOn() { return false; }
+  virtual bool onTurnOff() { return false; }
+  virtual bool onMotorOn() { return false; }
+  virtual bool onMotorFailed() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+  bool onTurnOff() override;
+};
+
+class StateOff : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onTurnOn() override;
+};
+
+class StateStarting : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onEnter() override;
+  void onExit() override;
+  bool onMotorOn() override;
+  bool onMotorFailed() override;
+};
+
+class StateLeaf : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+public:
+  HsmUnderTest(IExecutor &executor, IExecutor &completion, std::function<bool()> motorOn)
+      : Hsm(top)
+      , motorOnAction(executor, completion)
+      , motorOn(std::move(motorOn))
+      , top(*this, nullptr)
+      , off(*this, &top)
+      , starting(*this, &top)
+      , on(*this, &top)
+      , fault(*this, &top) {}
+
+  bool onTurnOn() {
+    return onEvent([](StateUnderTest &state) { return state.onTurnOn(); });
+  }
+  bool onTurnOff() {
+    return onEvent([](StateUnderTest &state) { return state.onTurnOff(); });
+  }
+  bool onMotorOn() {
+    return onEvent([](StateUnderTest &state) { return state.onMotorOn(); });
+  }
+  bool onMotorFailed() {
+    return onEvent([](StateUnderTest &state) { return state.onMotorFailed(); });
+  }
+
+  bool isOff() const { return currentState == &off; }
+  bool isStarting() const { return currentState == &starting; }
+  bool isOn() const { return currentState == &on; }
+  bool isFault() const { return currentState == &fault; }
+
+  HsmAsyncAction motorOnAction;
+  std::function<bool()> motorOn;
+
+private:
+  StateTop top;
+  StateOff off;
+  StateStarting starting;
+  StateLeaf on;
+  StateLeaf fault;
+
+  friend StateTop;
+  friend StateOff;
+  friend StateStarting;
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.off); }
+bool StateTop::onTurnOff() {
+  hsm.transition(hsm.off);
+  return true;
+}
+
+bool StateOff::onTurnOn() {
+  hsm.transition(hsm.starting);
+  return true;
+}
+
+void StateStarting::onEnter() {
+  hsm.motorOnAction.start(hsm.motorOn, [this] { hsm.onMotorOn(); }, [this] { hsm.onMotorFailed(); });
+}
+void StateStarting::onExit() { hsm.motorOnAction.cancel(); }
+bool StateStarting::onMotorOn() {
+  hsm.transition(hsm.on);
+  return true;
+}
+bool StateStarting::onMotorFailed() {
+  hsm.transition(hsm.fault);
+  return true;
+}
+
+class HsmAsyncTest : public Test {
+public:
+  ManualExecutor executor;
+  ManualExecutor completion;
+};
+
+} // namespace
+
+TEST_F(HsmAsyncTest, completionEvent) {
+  unsigned motorOnCalls = 0;
+  HsmUnderTest hsm(executor, completion, [&] { return ++motorOnCalls > 0; });
+  hsm.onStart();
+
+  // The run-to-completion step returns before the action has run
+  hsm.onTurnOn();
+  EXPECT_TRUE(hsm.isStarting());
+  EXPECT_EQ(0u, motorOnCalls);
+  EXPECT_TRUE(hsm.motorOnAction.pending());
+
+  EXPECT_EQ(1u, executor.runAll());
+  EXPECT_EQ(1u, motorOnCalls);
+  EXPECT_TRUE(hsm.isStarting());
+
+  EXPECT_EQ(1u, completion.runAll());
+  EXPECT_TRUE(hsm.isOn());
+  EXPECT_FALSE(hsm.motorOnAction.pending());
+}
+
+TEST_F(HsmAsyncTest, failureEvent) {
+  HsmUnderTest hsm(executor, completion, [] { return false; });
+  hsm.onStart();
+
+  hsm.onTurnOn();
+  executor.runAll();
+  completion.runAll();
+  EXPECT_TRUE(hsm.isFault());
+}
+
+TEST_F(HsmAsyncTest, completionDroppedWhenStateIsLeft) {
+  HsmUnderTest hsm(executor, completion, [] { return true; });
+  hsm.onStart();
+
+  hsm.onTurnOn();
+  executor.runAll();
+  hsm.onTurnOff();
+
+  // Entering Starting again must not be completed by the first action
+  hsm.onTurnOn();
+  EXPECT_EQ(1u, completion.runAll());
+  EXPECT_TRUE(hsm.isStarting());
+
+  executor.runAll();
+  completion.runAll();
+  EXPECT_TRUE(hsm.isOn());
+}
+
+TEST_F(HsmAsyncTest, completionOutlivesAction) {
+  auto hsm = std::make_unique<HsmUnderTest>(executor, completion, [] { return true; });
+  hsm->onStart();
+  hsm->onTurnOn();
+  executor.runAll();
+  hsm.reset();
+
+  EXPECT_EQ(1u, completion.runAll());
+}
+
+TEST_F(HsmAsyncTest, workerThreadAndEventLoop) {
+  HsmEventLoop loop;
+  HsmWorkerExecutor worker;
+  std::thread::id motorThread;
+  HsmUnderTest hsm(worker, loop, [&] {
+    motorThread = std::this_thread::get_id();
+    return true;
+  });
+
+  loop.post([&] {
+    hsm.onStart();
+    hsm.onTurnOn();
+  });
+  while (not hsm.isOn()) {
+    loop.runOnce(1000);
+  }
+  EXPECT_NE(std::this_thread::get_id(), motorThread);
+}
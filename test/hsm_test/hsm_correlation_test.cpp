@@ -0,0 +1,258 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_async.h"
+#include "hsm_correlation.h"
+#include "hsm_flight_recorder.h"
+#include "hsm_scheduler.h"
+
+#include <gmock/gmock.h>
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+using hsp::Hsm;
+using hsp::HsmAsyncAction;
+using hsp::HsmCorrelationId;
+using hsp::HsmCorrelationScope;
+using hsp::HsmFlightRecorder;
+using hsp::HsmScheduler;
+using hsp::HsmState;
+using hsp::HsmTraceRecord;
+using hsp::IExecutor;
+using hsp::hsmCorrelation;
+using hsp::hsmCorrelationSpans;
+using hsp::hsmNewCorrelation;
+
+using ::testing::Test;
+
+//!
+// A command to the controller fans out to the pump through the scheduler
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Off
+//   Off --> On : TurnOn / post TurnOn to the pump
+//   On --> Off : TurnOff
+// }
+//
+// @enduml
+//
+
+namespace {
+
+//! Executor only running the work when told so
+class ManualExecutor : public IExecutor {
+public:
+  void post(std::function<void()> work) override { queue.push_back(std::move(work)); }
+
+  void runAll() {
+    while (not queue.empty()) {
+      auto work = std::move(queue.front());
+      queue.pop_front();
+      work();
+    }
+  }
+
+  std::deque<std::function<void()>> queue;
+};
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onTurnOn() { return false; }
+  virtual bool onTurnOff() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateOff : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onTurnOn() override;
+};
+
+class StateOn : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onTurnOff() override;
+};
+
+struct TurnOn {
+  bool operator()(StateUnderTest &state) { return state.onTurnOn(); }
+};
+struct TurnOff {
+  bool operator()(StateUnderTest &state) { return state.onTurnOff(); }
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+  friend StateOff;
+  friend StateOn;
+  friend StateTop;
+
+public:
+  HsmUnderTest(HsmFlightRecorder &recorder, uint32_t machine)
+      : Hsm(top) {
+    setFlightRecorder(&recorder, machine);
+  }
+
+  bool onTurnOn() { return onEvent(TurnOn()); }
+  bool onTurnOff() { return onEvent(TurnOff()); }
+
+  StateTop top{*this, nullptr};
+  StateOff off{*this, &top};
+  StateOn on{*this, &top};
+
+  //! Posted TurnOn to on entry, if set
+  std::function<void()> turnedOn;
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.off); }
+
+bool StateOff::onTurnOn() {
+  hsm.transition(hsm.on);
+  if (hsm.turnedOn) {
+    hsm.turnedOn();
+  }
+  return true;
+}
+
+bool StateOn::onTurnOff() {
+  hsm.transition(hsm.off);
+  return true;
+}
+
+class HsmCorrelationTest : public Test {
+public:
+  HsmFlightRecorder::Slot slots[64];
+  HsmFlightRecorder recorder{slots, 64};
+  HsmUnderTest controller{recorder, 1};
+  HsmUnderTest pump{recorder, 2};
+
+  std::vector<HsmTraceRecord> records() {
+    std::vector<HsmTraceRecord> copy(recorder.capacity());
+    copy.resize(recorder.snapshot(copy.data(), copy.size()));
+    return copy;
+  }
+};
+
+} // namespace
+
+TEST(HsmCorrelationScopeTest, nestsAndRestores) {
+  const HsmCorrelationId first = hsmNewCorrelation();
+  const HsmCorrelationId second = hsmNewCorrelation();
+  EXPECT_NE(0u, first);
+  EXPECT_NE(first, second);
+
+  EXPECT_EQ(0u, hsmCorrelation());
+  {
+    HsmCorrelationScope outer(first);
+    EXPECT_EQ(first, hsmCorrelation());
+    {
+      HsmCorrelationScope inner(second);
+      EXPECT_EQ(second, hsmCorrelation());
+    }
+    EXPECT_EQ(first, hsmCorrelation());
+  }
+  EXPECT_EQ(0u, hsmCorrelation());
+}
+
+TEST_F(HsmCorrelationTest, followsCommandThroughScheduler) {
+  HsmScheduler scheduler;
+  const HsmScheduler::MachineId controllerId = scheduler.addMachine();
+  const HsmScheduler::MachineId pumpId = scheduler.addMachine();
+  controller.turnedOn = [&] { scheduler.post(pumpId, [&] { pump.onTurnOn(); }); };
+  controller.onStart();
+  pump.onStart();
+
+  const HsmCorrelationId command = hsmNewCorrelation();
+  {
+    HsmCorrelationScope scope(command);
+    scheduler.post(controllerId, [&] { controller.onTurnOn(); });
+  }
+  // An event without a command
+  scheduler.post(controllerId, [&] { controller.onTurnOff(); });
+  scheduler.run();
+
+  unsigned correlated = 0;
+  for (const HsmTraceRecord &record : records()) {
+    if (record.kind == HsmTraceRecord::EVENT && record.event == hsp::hsmEventType<TurnOn>().id) {
+      EXPECT_EQ(command, record.correlation);
+      ++correlated;
+    }
+    if (record.kind == HsmTraceRecord::EVENT && record.event == hsp::hsmEventType<TurnOff>().id) {
+      EXPECT_EQ(0u, record.correlation);
+    }
+  }
+  EXPECT_EQ(2u, correlated);
+
+  const auto spans = hsmCorrelationSpans(recorder);
+  ASSERT_EQ(1u, spans.size());
+  EXPECT_EQ(command, spans[0].correlation);
+  EXPECT_EQ(2u, spans[0].machines);
+  // Both events, exit of Off and entry of On in both machines
+  EXPECT_EQ(6u, spans[0].records);
+  EXPECT_GE(spans[0].last, spans[0].first);
+}
+
+TEST_F(HsmCorrelationTest, inheritedByAsyncAction) {
+  ManualExecutor executor;
+  ManualExecutor completion;
+  HsmAsyncAction action(executor, completion);
+  pump.onStart();
+
+  const HsmCorrelationId command = hsmNewCorrelation();
+  HsmCorrelationId inAction = 0;
+  {
+    HsmCorrelationScope scope(command);
+    action.start(
+        [&] {
+          inAction = hsmCorrelation();
+          return true;
+        },
+        [&] { pump.onTurnOn(); });
+  }
+  executor.runAll();
+  completion.runAll();
+
+  EXPECT_EQ(command, inAction);
+  EXPECT_EQ(0u, hsmCorrelation());
+  const auto spans = hsmCorrelationSpans(recorder);
+  ASSERT_EQ(1u, spans.size());
+  EXPECT_EQ(command, spans[0].correlation);
+  EXPECT_EQ(1u, spans[0].machines);
+}
@@ -0,0 +1,312 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_correlation.h"
+#include "hsm_event_loop.h"
+
+#include <gmock/gmock.h>
+
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+using hsp::Hsm;
+using hsp::HsmCorrelationId;
+using hsp::HsmCorrelationScope;
+using hsp::HsmEventLoop;
+using hsp::HsmEventLoopTimer;
+using hsp::HsmState;
+
+using ::testing::Test;
+
+using namespace std::chrono_literals;
+
+//!
+// Hsm driven by a HsmEventLoop. Active is left when the timer started on entry expires.
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Idle
+//   Idle --> Active : Activate
+//   Active : onEnter / startTimer()
+//   Active --> Idle : Timeout
+//   Active --> Idle : Deactivate
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onActivate() { return false; }
+  virtual bool onDeactivate() { return false; }
+  virtual bool onTimeout() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateIdle : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onActivate() override;
+};
+
+class StateActive : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onEnter() override;
+  void onExit() override;
+  bool onDeactivate() override;
+  bool onTimeout() override;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+public:
+  HsmUnderTest(HsmEventLoop &loop, std::chrono::nanoseconds timeout)
+      : Hsm(top)
+      , timer(loop, timeout)
+      , top(*this, nullptr)
+      , idle(*this, &top)
+      , active(*this, &top) {}
+
+  bool onActivate() {
+    return onEvent([](StateUnderTest &state) { return state.onActivate(); });
+  }
+  bool onDeactivate() {
+    return onEvent([](StateUnderTest &state) { return state.onDeactivate(); });
+  }
+  bool onTimeout() {
+    return onEvent([](StateUnderTest &state) { return state.onTimeout(); });
+  }
+
+  bool isActive() const { return currentState == &active; }
+
+  HsmEventLoopTimer timer;
+  unsigned timeouts = 0;
+  //! Correlation of the last timeout
+  HsmCorrelationId timeoutCorrelation = 0;
+
+private:
+  StateTop top;
+  StateIdle idle;
+  StateActive active;
+
+  friend StateTop;
+  friend StateIdle;
+  friend StateActive;
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.idle); }
+
+bool StateIdle::onActivate() {
+  hsm.transition(hsm.active);
+  return true;
+}
+
+void StateActive::onEnter() {
+  hsm.timer.start([this] { hsm.onTimeout(); });
+}
+void StateActive::onExit() { hsm.timer.cancel(); }
+bool StateActive::onDeactivate() {
+  hsm.transition(hsm.idle);
+  return true;
+}
+bool StateActive::onTimeout() {
+  hsm.timeouts++;
+  hsm.timeoutCorrelation = hsp::hsmCorrelation();
+  hsm.transition(hsm.idle);
+  return true;
+}
+
+class HsmEventLoopTest : public Test {
+public:
+  HsmEventLoop loop;
+};
+
+} // namespace
+
+TEST_F(HsmEventLoopTest, postFromOtherThread) {
+  HsmUnderTest hsm(loop, 1h);
+  hsm.onStart();
+
+  std::thread poster([&] { loop.post([&] { hsm.onActivate(); }); });
+  poster.join();
+
+  EXPECT_EQ(1u, loop.runOnce(1000));
+  EXPECT_TRUE(hsm.isActive());
+
+  loop.post([&] { hsm.onDeactivate(); });
+  loop.post([&] { loop.stop(); });
+  loop.run();
+  EXPECT_FALSE(hsm.isActive());
+}
+
+TEST_F(HsmEventLoopTest, timerExpires) {
+  HsmUnderTest hsm(loop, 1ms);
+  hsm.onStart();
+  hsm.onActivate();
+  ASSERT_TRUE(hsm.isActive());
+
+  while (hsm.isActive()) {
+    loop.runOnce(1000);
+  }
+  EXPECT_EQ(1u, hsm.timeouts);
+}
+
+TEST_F(HsmEventLoopTest, cancelledTimerDoNotExpire) {
+  HsmUnderTest hsm(loop, 1ms);
+  HsmUnderTest other(loop, 5ms);
+  hsm.onStart();
+  other.onStart();
+
+  hsm.onActivate();
+  other.onActivate();
+  hsm.onDeactivate(); // Cancels the first timer to expire
+
+  while (other.isActive()) {
+    loop.runOnce(1000);
+  }
+  EXPECT_EQ(0u, hsm.timeouts);
+  EXPECT_EQ(1u, other.timeouts);
+}
+
+TEST_F(HsmEventLoopTest, correlationOfPosterKept) {
+  HsmUnderTest hsm(loop, 1ms);
+  hsm.onStart();
+
+  const HsmCorrelationId command = hsp::hsmNewCorrelation();
+  HsmCorrelationId posted = 0;
+  std::thread poster([&] {
+    HsmCorrelationScope scope(command);
+    loop.post([&] {
+      posted = hsp::hsmCorrelation();
+      hsm.onActivate();
+    });
+  });
+  poster.join();
+
+  // The timer started by the posted event inherits the correlation
+  while (hsm.timeouts == 0) {
+    loop.runOnce(1000);
+  }
+  EXPECT_EQ(command, posted);
+  EXPECT_EQ(command, hsm.timeoutCorrelation);
+  EXPECT_EQ(0u, hsp::hsmCorrelation());
+}
+
+TEST_F(HsmEventLoopTest, readableFdIsMappedToEvent) {
+  HsmUnderTest hsm(loop, 1h);
+  hsm.onStart();
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  loop.watch(fds[0], [&] {
+    char command;
+    ASSERT_EQ(1, read(fds[0], &command, 1));
+    command == 'a' ? hsm.onActivate() : hsm.onDeactivate();
+  });
+
+  ASSERT_EQ(1, write(fds[1], "a", 1));
+  EXPECT_EQ(1u, loop.runOnce(1000));
+  EXPECT_TRUE(hsm.isActive());
+
+  ASSERT_EQ(1, write(fds[1], "d", 1));
+  EXPECT_EQ(1u, loop.runOnce(1000));
+  EXPECT_FALSE(hsm.isActive());
+
+  loop.unwatch(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(HsmEventLoopTest, unwatchedInSameBatchIsSkipped) {
+  int first[2];
+  int second[2];
+  ASSERT_EQ(0, pipe(first));
+  ASSERT_EQ(0, pipe(second));
+
+  // Each callback unwatches and closes the other, like a connection closing its peer
+  unsigned invoked = 0;
+  int survivor = -1;
+  loop.watch(first[0], [&] {
+    invoked++;
+    survivor = first[0];
+    loop.unwatch(second[0]);
+    close(second[0]);
+  });
+  loop.watch(second[0], [&] {
+    invoked++;
+    survivor = second[0];
+    loop.unwatch(first[0]);
+    close(first[0]);
+  });
+  ASSERT_EQ(1, write(first[1], "a", 1));
+  ASSERT_EQ(1, write(second[1], "a", 1));
+
+  EXPECT_EQ(1u, loop.runOnce(1000));
+  EXPECT_EQ(1u, invoked);
+
+  loop.unwatch(survivor);
+  close(survivor);
+  close(first[1]);
+  close(second[1]);
+}
+
+TEST_F(HsmEventLoopTest, manyMachinesOneThread) {
+  constexpr unsigned MACHINES = 2000;
+  std::vector<std::unique_ptr<HsmUnderTest>> machines;
+  for (unsigned i = 0; i < MACHINES; ++i) {
+    machines.push_back(std::make_unique<HsmUnderTest>(loop, std::chrono::microseconds(100 + i % 500)));
+    machines.back()->onStart();
+    machines.back()->onActivate();
+  }
+
+  unsigned timeouts = 0;
+  while (timeouts < MACHINES) {
+    loop.runOnce(1000);
+    timeouts = 0;
+    for (auto &machine : machines) {
+      timeouts += machine->timeouts;
+    }
+  }
+  for (auto &machine : machines) {
+    EXPECT_FALSE(machine->isActive());
+  }
+}
@@ -0,0 +1,279 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_flight_recorder.h"
+
+#include <gmock/gmock.h>
+
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using hsp::Hsm;
+using hsp::HsmFlightRecorder;
+using hsp::HsmFlightRecorderRing;
+using hsp::HsmState;
+using hsp::HsmTraceRecord;
+
+using ::testing::HasSubstr;
+using ::testing::Test;
+
+//!
+// Machine recording to a flight recorder
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Standby
+//   state Standby
+//   state Running
+//   Standby --> Running : run
+//   Running --> Standby : standby
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onRun() { return false; }
+  virtual bool onStandby() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+//! Event of a named type, dispatched as an rvalue and as a const lvalue
+struct RunEvent {
+  bool operator()(StateUnderTest &state) const { return state.onRun(); }
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateStandby : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onRun() override;
+};
+
+class StateRunning : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onStandby() override;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+  friend StateTop;
+  friend StateStandby;
+  friend StateRunning;
+
+public:
+  explicit HsmUnderTest(HsmFlightRecorder &recorder, uint32_t machine = 0)
+      : Hsm(top) {
+    setFlightRecorder(&recorder, machine);
+  }
+
+  bool onRun() {
+    return onEvent([](StateUnderTest &state) { return state.onRun(); });
+  }
+  bool onStandby() {
+    return onEvent([](StateUnderTest &state) { return state.onStandby(); });
+  }
+  bool onRunEvent() { return onEvent(RunEvent{}); }
+  bool onConstRunEvent() {
+    const RunEvent event;
+    return onEvent(event);
+  }
+
+  StateTop top{*this, nullptr};
+  StateStandby standby{*this, &top};
+  StateRunning running{*this, &top};
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.standby); }
+
+bool StateStandby::onRun() {
+  hsm.transition(hsm.running);
+  return true;
+}
+
+bool StateRunning::onStandby() {
+  hsm.transition(hsm.standby);
+  return true;
+}
+
+std::vector<HsmTraceRecord> snapshot(const HsmFlightRecorder &recorder) {
+  std::vector<HsmTraceRecord> records(recorder.capacity());
+  records.resize(recorder.snapshot(records.data(), records.size()));
+  return records;
+}
+
+class HsmFlightRecorderTest : public Test {
+public:
+  HsmFlightRecorderRing<16> recorder;
+  HsmUnderTest hsm{recorder, 7};
+};
+
+} // namespace
+
+TEST_F(HsmFlightRecorderTest, recordsEventsAndTransitions) {
+  hsm.onStart();
+  hsm.onRun();
+  hsm.onRun();
+
+  auto records = snapshot(recorder);
+  ASSERT_EQ(6u, records.size());
+
+  // Start
+  EXPECT_EQ(HsmTraceRecord::ENTER, records[0].kind);
+  EXPECT_EQ(hsm.top.index, records[0].target);
+  EXPECT_EQ(HsmTraceRecord::ENTER, records[1].kind);
+  EXPECT_EQ(hsm.standby.index, records[1].target);
+
+  // Handled run
+  EXPECT_EQ(HsmTraceRecord::EXIT, records[2].kind);
+  EXPECT_EQ(hsm.standby.index, records[2].source);
+  EXPECT_EQ(HsmTraceRecord::EVENT, records[3].kind);
+  EXPECT_EQ(hsm.standby.index, records[3].source);
+  EXPECT_EQ(hsm.running.index, records[3].target);
+  EXPECT_TRUE(records[3].handled);
+  EXPECT_EQ(HsmTraceRecord::ENTER, records[4].kind);
+  EXPECT_EQ(hsm.running.index, records[4].target);
+
+  // Unhandled run
+  EXPECT_EQ(HsmTraceRecord::EVENT, records[5].kind);
+  EXPECT_FALSE(records[5].handled);
+  EXPECT_EQ(hsp::HSM_TRACE_NO_STATE, records[5].target);
+  EXPECT_EQ(records[3].event, records[5].event);
+  EXPECT_EQ(records[3].event, records[2].event);
+
+  for (const auto &record : records) {
+    EXPECT_EQ(7u, record.machine);
+  }
+  EXPECT_LE(records[0].timestamp, records[5].timestamp);
+}
+
+TEST_F(HsmFlightRecorderTest, eventTypes) {
+  hsm.onStart();
+  hsm.onRun();
+  hsm.onStandby();
+
+  auto records = snapshot(recorder);
+  const uint16_t run = records[3].event;
+  const uint16_t standby = records.back().event;
+  EXPECT_NE(run, standby);
+  EXPECT_NE(0u, run);
+
+  const hsp::HsmEventType *type = hsp::hsmFindEventType(run);
+  ASSERT_NE(nullptr, type);
+  EXPECT_THAT(std::string(type->name, type->nameLength), HasSubstr("lambda"));
+}
+
+TEST_F(HsmFlightRecorderTest, constEventSameType) {
+  hsm.onStart();
+  hsm.onRunEvent();
+  hsm.onConstRunEvent();
+
+  auto records = snapshot(recorder);
+  EXPECT_EQ(hsp::hsmEventType<RunEvent>().id, records[3].event);
+  EXPECT_EQ(records[3].event, records.back().event);
+}
+
+TEST_F(HsmFlightRecorderTest, ringKeepsLatest) {
+  hsm.onStart();
+  for (int i = 0; i < 100; ++i) {
+    hsm.onRun();
+    hsm.onStandby();
+  }
+
+  auto records = snapshot(recorder);
+  EXPECT_EQ(16u, records.size());
+  EXPECT_EQ(2u + 100 * 6, recorder.written());
+  EXPECT_EQ(HsmTraceRecord::ENTER, records.back().kind);
+  EXPECT_EQ(hsm.standby.index, records.back().target);
+}
+
+TEST_F(HsmFlightRecorderTest, sharedByThreads) {
+  HsmFlightRecorderRing<1 << 16> shared;
+  std::vector<std::thread> threads;
+  for (uint32_t machine = 0; machine < 4; ++machine) {
+    threads.emplace_back([&shared, machine] {
+      HsmUnderTest hsm(shared, machine);
+      hsm.onStart();
+      for (int i = 0; i < 1000; ++i) {
+        hsm.onRun();
+        hsm.onStandby();
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  auto records = snapshot(shared);
+  EXPECT_EQ(4u * (2 + 1000 * 6), records.size());
+  unsigned perMachine[4] = {};
+  for (const auto &record : records) {
+    ASSERT_LT(record.machine, 4u);
+    perMachine[record.machine]++;
+  }
+  for (unsigned count : perMachine) {
+    EXPECT_EQ(2u + 1000 * 6, count);
+  }
+}
+
+TEST_F(HsmFlightRecorderTest, dump) {
+  hsm.onStart();
+  hsm.onRun();
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  recorder.dump(fds[1]);
+  close(fds[1]);
+
+  std::string text;
+  char buffer[256];
+  for (ssize_t size; (size = read(fds[0], buffer, sizeof(buffer))) > 0;) {
+    text.append(buffer, size);
+  }
+  close(fds[0]);
+
+  EXPECT_THAT(text, HasSubstr("5 of 5 records"));
+  EXPECT_THAT(text, HasSubstr(" 7 EVENT "));
+  EXPECT_THAT(text, HasSubstr(" 7 ENTER "));
+  EXPECT_THAT(text, HasSubstr("lambda"));
+}
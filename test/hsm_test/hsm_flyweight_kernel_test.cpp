@@ -0,0 +1,256 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_flyweight_population.h"
+
+#include <gmock/gmock.h>
+
+#include <random>
+
+using hsp::FlyweightHsmCursor;
+using hsp::FlyweightHsmEventTable;
+using hsp::FlyweightHsmModel;
+using hsp::FlyweightHsmPopulation;
+using hsp::FlyweightHsmState;
+using hsp::HsmStateId;
+
+using ::testing::Test;
+
+//!
+// Fleet where standby is table driven except from Fault, which counts the resets
+//
+// @startuml
+//
+// state Top {
+// 	 state Idle
+// 	 state Running {
+// 	   [H] --> Slow
+// 	   state Slow
+// 	   state Fast
+// 	   Slow --> Fast : speedUp
+// 	 }
+// 	 state Fault
+//   [*] --> Idle
+//   Idle --> Running : run
+//   Running --> Idle : standby
+//   Fault --> Idle : standby / resets++
+//   Top --> Fault : fail
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class Machine;
+
+struct Data {
+  unsigned resets = 0;
+};
+
+class State : public FlyweightHsmState<Machine> {
+public:
+  using FlyweightHsmState::FlyweightHsmState;
+
+  virtual bool onRun(Machine &) const { return false; }
+  virtual bool onSpeedUp(Machine &) const { return false; }
+  virtual bool onStandby(Machine &) const { return false; }
+  virtual bool onFail(Machine &hsm) const;
+};
+
+class StateTop : public State {
+public:
+  using State::State;
+  void onInit(Machine &hsm) const override;
+};
+
+class StateIdle : public State {
+public:
+  using State::State;
+  bool onRun(Machine &hsm) const override;
+  bool onStandby(Machine &) const override { return true; }
+};
+
+class StateRunning : public State {
+public:
+  using State::State;
+  void onInit(Machine &hsm) const override;
+  bool onStandby(Machine &hsm) const override;
+};
+
+class StateSlow : public State {
+public:
+  using State::State;
+  bool onSpeedUp(Machine &hsm) const override;
+};
+
+class StateFault : public State {
+public:
+  using State::State;
+  bool onStandby(Machine &hsm) const override;
+};
+
+struct Model : FlyweightHsmModel {
+  StateTop top{*this, nullptr};
+  StateIdle idle{*this, &top};
+  StateRunning running{*this, &top};
+  StateSlow slow{*this, &running};
+  State fast{*this, &running};
+  StateFault fault{*this, &top};
+};
+
+const Model &model() {
+  static const Model model;
+  return model;
+}
+
+class Machine : public FlyweightHsmCursor<State, Data> {
+public:
+  using FlyweightHsmCursor::FlyweightHsmCursor;
+};
+
+bool State::onFail(Machine &hsm) const {
+  hsm.transition(model().fault);
+  return true;
+}
+
+void StateTop::onInit(Machine &hsm) const { hsm.initialTransition(model().idle); }
+
+bool StateIdle::onRun(Machine &hsm) const {
+  hsm.transition(model().running);
+  return true;
+}
+
+void StateRunning::onInit(Machine &hsm) const { hsm.initialHistoryTransition(model().slow); }
+bool StateRunning::onStandby(Machine &hsm) const {
+  hsm.transition(model().idle);
+  return true;
+}
+
+bool StateSlow::onSpeedUp(Machine &hsm) const {
+  hsm.transition(model().fast);
+  return true;
+}
+
+bool StateFault::onStandby(Machine &hsm) const {
+  hsm.data().resets++;
+  hsm.transition(model().idle);
+  return true;
+}
+
+auto run = [](const State &state, Machine &hsm) { return state.onRun(hsm); };
+auto speedUp = [](const State &state, Machine &hsm) { return state.onSpeedUp(hsm); };
+auto standby = [](const State &state, Machine &hsm) { return state.onStandby(hsm); };
+auto fail = [](const State &state, Machine &hsm) { return state.onFail(hsm); };
+
+//! Not a multiple of the vector width
+constexpr uint32_t MACHINES = 1003;
+
+class HsmFlyweightKernelTest : public Test {
+public:
+  FlyweightHsmPopulation<Machine> kernel{model(), MACHINES};
+  FlyweightHsmPopulation<Machine> reference{model(), MACHINES};
+  FlyweightHsmEventTable standbyTable{model()};
+
+  void SetUp() override {
+    standbyTable.ignore(model().idle);
+    standbyTable.transition(model().running, model().idle);
+
+    // Drive both populations to the same random states
+    std::mt19937 random(7);
+    for (uint32_t i = 0; i < MACHINES; ++i) {
+      kernel.add();
+      reference.add();
+      for (unsigned event = random() % 4; event != 0; --event) {
+        switch (random() % 4) {
+        case 0:
+          kernel.onEvent(i, run), reference.onEvent(i, run);
+          break;
+        case 1:
+          kernel.onEvent(i, speedUp), reference.onEvent(i, speedUp);
+          break;
+        case 2:
+          kernel.onEvent(i, standby), reference.onEvent(i, standby);
+          break;
+        default:
+          kernel.onEvent(i, fail), reference.onEvent(i, fail);
+        }
+      }
+    }
+  }
+
+  void expectSameStates() {
+    for (uint32_t i = 0; i < MACHINES; ++i) {
+      ASSERT_EQ(reference.currentState(i), kernel.currentState(i)) << "machine " << i;
+      ASSERT_EQ(reference.dataOf(i).resets, kernel.dataOf(i).resets) << "machine " << i;
+    }
+  }
+};
+
+} // namespace
+
+TEST_F(HsmFlyweightKernelTest, table) {
+  EXPECT_EQ(model().idle.id, standbyTable.entry(model().idle.id));
+  EXPECT_EQ(model().idle.id | FlyweightHsmEventTable::HISTORY, standbyTable.entry(model().fast.id));
+  EXPECT_EQ(FlyweightHsmEventTable::SCALAR, standbyTable.entry(model().fault.id));
+
+  const auto &writes = standbyTable.historyWrites(model().fast.id);
+  ASSERT_EQ(2u, writes.size());
+  EXPECT_EQ(model().running.id, writes[0].superState);
+  EXPECT_EQ(model().fast.id, writes[0].subState);
+  EXPECT_EQ(model().top.id, writes[1].superState);
+  EXPECT_EQ(model().running.id, writes[1].subState);
+}
+
+TEST_F(HsmFlyweightKernelTest, sameResultAsOnEvent) {
+  uint32_t faults = 0;
+  for (uint32_t i = 0; i < MACHINES; ++i) {
+    faults += kernel.isIn(i, model().fault);
+  }
+
+  EXPECT_EQ(faults, kernel.broadcast(standbyTable, standby));
+  reference.broadcast(standby);
+  expectSameStates();
+
+  // History written by the kernel
+  kernel.broadcast(run);
+  reference.broadcast(run);
+  expectSameStates();
+}
+
+TEST_F(HsmFlyweightKernelTest, scalarFallbackSameAsKernel) {
+  std::vector<HsmStateId> vectorized;
+  std::vector<HsmStateId> scalar;
+  for (uint32_t i = 0; i < MACHINES; ++i) {
+    vectorized.push_back(kernel.currentState(i));
+  }
+  scalar = vectorized;
+
+  std::vector<std::pair<uint32_t, HsmStateId>> movedVectorized, movedScalar;
+  std::vector<uint32_t> scalarVectorized, scalarScalar;
+  hsp::flyweightBroadcastKernel(standbyTable, vectorized.data(), MACHINES, movedVectorized, scalarVectorized);
+  hsp::flyweightBroadcastKernelScalar(standbyTable, scalar.data(), MACHINES, movedScalar, scalarScalar);
+
+  EXPECT_EQ(scalar, vectorized);
+  EXPECT_EQ(movedScalar, movedVectorized);
+  EXPECT_EQ(scalarScalar, scalarVectorized);
+}
@@ -0,0 +1,212 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_flyweight_population.h"
+
+#include <gmock/gmock.h>
+
+using hsp::FlyweightHsmCursor;
+using hsp::FlyweightHsmModel;
+using hsp::FlyweightHsmPopulation;
+using hsp::FlyweightHsmState;
+
+using ::testing::Test;
+
+//!
+// A population of machines with history
+//
+// @startuml
+//
+// state Top {
+// 	 state Idle
+// 	 state Running {
+// 	   [H] --> Slow
+// 	   state Slow
+// 	   state Fast
+// 	   Slow --> Fast : speedUp
+// 	 }
+//   [*] --> Idle
+//   Idle --> Running : run
+//   Running --> Idle : halt
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class Machine;
+
+struct Data {
+  unsigned ticks = 0;
+  unsigned entries = 0;
+};
+
+class State : public FlyweightHsmState<Machine> {
+public:
+  using FlyweightHsmState::FlyweightHsmState;
+
+  void onEnter(Machine &hsm) const override;
+
+  virtual bool onRun(Machine &) const { return false; }
+  virtual bool onHalt(Machine &) const { return false; }
+  virtual bool onSpeedUp(Machine &) const { return false; }
+  virtual bool onTick(Machine &) const { return false; }
+};
+
+class StateTop : public State {
+public:
+  using State::State;
+  void onInit(Machine &hsm) const override;
+};
+
+class StateIdle : public State {
+public:
+  using State::State;
+  bool onRun(Machine &hsm) const override;
+};
+
+class StateRunning : public State {
+public:
+  using State::State;
+  void onInit(Machine &hsm) const override;
+  bool onHalt(Machine &hsm) const override;
+  bool onTick(Machine &hsm) const override;
+};
+
+class StateSlow : public State {
+public:
+  using State::State;
+  bool onSpeedUp(Machine &hsm) const override;
+};
+
+struct Model : FlyweightHsmModel {
+  StateTop top{*this, nullptr};
+  StateIdle idle{*this, &top};
+  StateRunning running{*this, &top};
+  StateSlow slow{*this, &running};
+  State fast{*this, &running};
+};
+
+const Model &model() {
+  static const Model model;
+  return model;
+}
+
+class Machine : public FlyweightHsmCursor<State, Data> {
+public:
+  using FlyweightHsmCursor::FlyweightHsmCursor;
+};
+
+void State::onEnter(Machine &hsm) const { hsm.data().entries++; }
+
+void StateTop::onInit(Machine &hsm) const { hsm.initialTransition(model().idle); }
+
+bool StateIdle::onRun(Machine &hsm) const {
+  hsm.transition(model().running);
+  return true;
+}
+
+void StateRunning::onInit(Machine &hsm) const { hsm.initialHistoryTransition(model().slow); }
+bool StateRunning::onHalt(Machine &hsm) const {
+  hsm.transition(model().idle);
+  return true;
+}
+bool StateRunning::onTick(Machine &hsm) const {
+  hsm.data().ticks++;
+  return true;
+}
+
+bool StateSlow::onSpeedUp(Machine &hsm) const {
+  hsm.transition(model().fast);
+  return true;
+}
+
+auto run = [](const State &state, Machine &hsm) { return state.onRun(hsm); };
+auto halt = [](const State &state, Machine &hsm) { return state.onHalt(hsm); };
+auto speedUp = [](const State &state, Machine &hsm) { return state.onSpeedUp(hsm); };
+auto tick = [](const State &state, Machine &hsm) { return state.onTick(hsm); };
+
+class HsmFlyweightPopulationTest : public Test {
+public:
+  FlyweightHsmPopulation<Machine> population{model(), 1000};
+};
+
+} // namespace
+
+TEST_F(HsmFlyweightPopulationTest, addStartsMachine) {
+  auto handle = population.add();
+
+  EXPECT_EQ(1u, population.size());
+  EXPECT_EQ(model().idle.id, population.currentState(handle));
+  EXPECT_EQ(2u, population.dataOf(handle).entries);
+}
+
+TEST_F(HsmFlyweightPopulationTest, machinesHaveOwnStateAndHistory) {
+  auto first = population.add();
+  auto second = population.add();
+
+  EXPECT_TRUE(population.onEvent(first, run));
+  EXPECT_TRUE(population.onEvent(first, speedUp));
+  EXPECT_FALSE(population.onEvent(second, speedUp));
+  EXPECT_TRUE(population.isIn(first, model().fast));
+  EXPECT_TRUE(population.isIn(second, model().idle));
+
+  population.onEvent(first, halt);
+  population.onEvent(second, run);
+  population.onEvent(second, halt);
+  population.onEvent(first, run);
+  population.onEvent(second, run);
+
+  EXPECT_TRUE(population.isIn(first, model().fast));
+  EXPECT_TRUE(population.isIn(second, model().slow));
+  EXPECT_TRUE(population.isIn(second, model().running));
+}
+
+TEST_F(HsmFlyweightPopulationTest, broadcast) {
+  for (unsigned i = 0; i < 1000; ++i) {
+    auto handle = population.add();
+    if (i % 2) {
+      population.onEvent(handle, run);
+    }
+  }
+
+  EXPECT_EQ(500u, population.broadcast(tick));
+  EXPECT_EQ(0u, population.dataOf(0).ticks);
+  EXPECT_EQ(1u, population.dataOf(1).ticks);
+}
+
+TEST_F(HsmFlyweightPopulationTest, dispatchPending) {
+  for (unsigned i = 0; i < 10; ++i) {
+    population.add();
+  }
+  population.setPending(3);
+  population.setPending(7);
+
+  EXPECT_TRUE(population.isPending(3));
+  EXPECT_EQ(2u, population.dispatchPending(run));
+  EXPECT_FALSE(population.isPending(3));
+  EXPECT_TRUE(population.isIn(3, model().slow));
+  EXPECT_TRUE(population.isIn(7, model().slow));
+  EXPECT_TRUE(population.isIn(4, model().idle));
+  EXPECT_EQ(0u, population.dispatchPending(run));
+}
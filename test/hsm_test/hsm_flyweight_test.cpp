@@ -0,0 +1,262 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm_flyweight.h"
+
+#include <gmock/gmock.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+
+using hsp::FlyweightHsm;
+using hsp::FlyweightHsmModel;
+using hsp::FlyweightHsmState;
+
+using ::testing::ElementsAre;
+using ::testing::Test;
+
+//!
+// The history state machine with states shared by all instances
+//
+// @startuml
+//
+// state Top {
+// 	 state Disabled
+// 	 state Enabled {
+// 	   [H] --> A
+// 	   state A
+// 	   state B
+// 	   Enabled --> A : eventA
+// 	   Enabled --> B : eventB
+// 	 }
+//   [*] --> Disabled
+//   Disabled --> Enabled : On
+//   Enabled --> Disabled : Off
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public FlyweightHsmState<HsmUnderTest> {
+public:
+  StateUnderTest(FlyweightHsmModel &model, const StateUnderTest *superState, const string &name)
+      : FlyweightHsmState(model, superState)
+      , name(name) {}
+
+  void onEnter(HsmUnderTest &hsm) const override;
+  void onExit(HsmUnderTest &hsm) const override;
+
+  virtual bool onEventOn(HsmUnderTest &) const { return false; }
+  virtual bool onEventOff(HsmUnderTest &) const { return false; }
+  virtual bool onEventA(HsmUnderTest &) const { return false; }
+  virtual bool onEventB(HsmUnderTest &) const { return false; }
+
+  const string name;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit(HsmUnderTest &hsm) const override;
+};
+
+class StateDisabled : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onEventOn(HsmUnderTest &hsm) const override;
+};
+
+class StateEnabled : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit(HsmUnderTest &hsm) const override;
+  bool onEventOff(HsmUnderTest &hsm) const override;
+  bool onEventA(HsmUnderTest &hsm) const override;
+  bool onEventB(HsmUnderTest &hsm) const override;
+};
+
+//! The states shared by all instances
+struct ModelUnderTest : FlyweightHsmModel {
+  StateTop top{*this, nullptr, "TOP"};
+  StateDisabled disabled{*this, &top, "DISABLED"};
+  StateEnabled enabled{*this, &top, "ENABLED"};
+  StateUnderTest a{*this, &enabled, "A"};
+  StateUnderTest b{*this, &enabled, "B"};
+};
+
+const ModelUnderTest &modelUnderTest() {
+  static const ModelUnderTest model;
+  return model;
+}
+
+class HsmUnderTest : public FlyweightHsm<StateUnderTest> {
+public:
+  HsmUnderTest()
+      : FlyweightHsm(modelUnderTest()) {}
+  explicit HsmUnderTest(hsp::HsmStateId *history)
+      : FlyweightHsm(modelUnderTest(), history) {}
+
+  bool onEventOn() {
+    return onEvent([](const StateUnderTest &state, HsmUnderTest &hsm) { return state.onEventOn(hsm); });
+  }
+  bool onEventOff() {
+    return onEvent([](const StateUnderTest &state, HsmUnderTest &hsm) { return state.onEventOff(hsm); });
+  }
+  bool onEventA() {
+    return onEvent([](const StateUnderTest &state, HsmUnderTest &hsm) { return state.onEventA(hsm); });
+  }
+  bool onEventB() {
+    return onEvent([](const StateUnderTest &state, HsmUnderTest &hsm) { return state.onEventB(hsm); });
+  }
+
+  // Instance data
+  std::vector<string> log;
+};
+
+void StateUnderTest::onEnter(HsmUnderTest &hsm) const { hsm.log.push_back(name + " ENTRY"); }
+void StateUnderTest::onExit(HsmUnderTest &hsm) const { hsm.log.push_back(name + " EXIT"); }
+
+void StateTop::onInit(HsmUnderTest &hsm) const { hsm.initialTransition(modelUnderTest().disabled); }
+
+bool StateDisabled::onEventOn(HsmUnderTest &hsm) const {
+  hsm.transition(modelUnderTest().enabled);
+  return true;
+}
+
+void StateEnabled::onInit(HsmUnderTest &hsm) const { hsm.initialHistoryTransition(modelUnderTest().a); }
+bool StateEnabled::onEventOff(HsmUnderTest &hsm) const {
+  hsm.transition(modelUnderTest().disabled);
+  return true;
+}
+bool StateEnabled::onEventA(HsmUnderTest &hsm) const {
+  hsm.transition(modelUnderTest().a);
+  return true;
+}
+bool StateEnabled::onEventB(HsmUnderTest &hsm) const {
+  hsm.transition(modelUnderTest().b);
+  return true;
+}
+
+class HsmFlyweightTest : public Test {
+public:
+  HsmUnderTest first;
+  HsmUnderTest second;
+};
+
+} // namespace
+
+TEST_F(HsmFlyweightTest, transitions) {
+  first.onStart();
+  EXPECT_THAT(first.log, ElementsAre("TOP ENTRY", "DISABLED ENTRY"));
+  first.log.clear();
+
+  EXPECT_TRUE(first.onEventOn());
+  EXPECT_THAT(first.log, ElementsAre("DISABLED EXIT", "ENABLED ENTRY", "A ENTRY"));
+  first.log.clear();
+
+  EXPECT_TRUE(first.onEventB());
+  EXPECT_THAT(first.log, ElementsAre("A EXIT", "B ENTRY"));
+  first.log.clear();
+
+  EXPECT_FALSE(first.onEventOn());
+  EXPECT_TRUE(first.log.empty());
+}
+
+TEST_F(HsmFlyweightTest, instancesHaveOwnHistory) {
+  first.onStart();
+  second.onStart();
+
+  first.onEventOn();
+  first.onEventB();
+  first.onEventOff();
+  second.onEventOn();
+  second.onEventOff();
+  first.log.clear();
+  second.log.clear();
+
+  first.onEventOn();
+  second.onEventOn();
+  EXPECT_THAT(first.log, ElementsAre("DISABLED EXIT", "ENABLED ENTRY", "B ENTRY"));
+  EXPECT_THAT(second.log, ElementsAre("DISABLED EXIT", "ENABLED ENTRY", "A ENTRY"));
+  EXPECT_TRUE(first.isIn(modelUnderTest().b));
+  EXPECT_TRUE(first.isIn(modelUnderTest().enabled));
+  EXPECT_TRUE(second.isIn(modelUnderTest().a));
+}
+
+TEST_F(HsmFlyweightTest, instanceSizeIndependentOfStates) {
+  EXPECT_EQ(5u, modelUnderTest().size());
+  EXPECT_LE(sizeof(hsp::FlyweightHsmBase), 3 * sizeof(void *));
+  EXPECT_EQ(1u, sizeof(hsp::HsmStateId));
+}
+
+TEST_F(HsmFlyweightTest, modelTable) {
+  const ModelUnderTest &model = modelUnderTest();
+
+  EXPECT_EQ(0u, model.top.id);
+  EXPECT_EQ(hsp::NO_STATE, model.parent(model.top.id));
+  EXPECT_EQ(model.top.id, model.parent(model.enabled.id));
+  EXPECT_EQ(model.enabled.id, model.parent(model.b.id));
+  EXPECT_EQ(2u, model.depth(model.a.id));
+
+  // Sub states are linked in order of construction
+  EXPECT_EQ(model.disabled.id, model.node(model.top.id).firstChild);
+  EXPECT_EQ(model.enabled.id, model.node(model.disabled.id).nextSibling);
+  EXPECT_EQ(model.a.id, model.node(model.enabled.id).firstChild);
+  EXPECT_EQ(model.b.id, model.node(model.a.id).nextSibling);
+  EXPECT_EQ(hsp::NO_STATE, model.node(model.b.id).nextSibling);
+
+  EXPECT_EQ(model.enabled.id, model.lca(model.a.id, model.b.id));
+  EXPECT_EQ(model.top.id, model.lca(model.a.id, model.disabled.id));
+  EXPECT_EQ(&model.b, &model.state(model.b.id));
+
+  // Only states with sub states have history
+  EXPECT_EQ(2u, model.historySlots());
+  EXPECT_EQ(0u, model.historySlot(model.top.id));
+  EXPECT_EQ(1u, model.historySlot(model.enabled.id));
+  EXPECT_EQ(hsp::NO_STATE, model.historySlot(model.disabled.id));
+  EXPECT_EQ(hsp::NO_STATE, model.historySlot(model.a.id));
+}
+
+TEST(HsmFlyweightHistoryTest, historyInStorageOfCaller) {
+  std::vector<hsp::HsmStateId> history(2 * modelUnderTest().historySlots(), 0);
+  HsmUnderTest first(&history[0]);
+  HsmUnderTest second(&history[modelUnderTest().historySlots()]);
+  EXPECT_THAT(history, ::testing::Each(hsp::NO_STATE));
+
+  first.onStart();
+  second.onStart();
+  first.onEventOn();
+  first.onEventB();
+  first.onEventOff();
+
+  EXPECT_EQ(modelUnderTest().b.id, history[modelUnderTest().historySlot(modelUnderTest().enabled.id)]);
+  first.onEventOn();
+  EXPECT_TRUE(first.isIn(modelUnderTest().b));
+  second.onEventOn();
+  EXPECT_TRUE(second.isIn(modelUnderTest().a));
+}
@@ -0,0 +1,259 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_flight_recorder.h"
+#include "hsm_heat_map.h"
+#include "hsm_metrics.h"
+
+#include <gmock/gmock.h>
+
+#include <sstream>
+#include <string>
+
+using hsp::Hsm;
+using hsp::HsmFlightRecorderRing;
+using hsp::HsmHeatMap;
+using hsp::HsmState;
+
+using ::testing::HasSubstr;
+using ::testing::Test;
+
+//!
+// Machine drawn as a heat map
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Standby
+//   state Standby
+//   state Running {
+//     [*] --> Pumping
+//     state Pumping
+//     state Paused
+//     Pumping --> Paused : pause
+//     Paused --> Pumping : pause
+//   }
+//   Standby --> Running : run
+//   Running --> Standby : standby
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState, const char *stateName)
+      : HsmState(superState)
+      , hsm(hsm)
+      , stateName(stateName) {}
+
+  const char *name() const override { return stateName; }
+
+  virtual bool onRun() { return false; }
+  virtual bool onStandby() { return false; }
+  virtual bool onPause() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+  const char *const stateName;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateStandby : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onRun() override;
+};
+
+class StateRunning : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+  bool onStandby() override;
+};
+
+class StatePumping : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onPause() override;
+};
+
+class StatePaused : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onPause() override;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+  friend StateTop;
+  friend StateStandby;
+  friend StateRunning;
+  friend StatePumping;
+  friend StatePaused;
+
+public:
+  HsmUnderTest()
+      : Hsm(top) {}
+
+  bool onRun() {
+    return onEvent([](StateUnderTest &state) { return state.onRun(); });
+  }
+  bool onStandby() {
+    return onEvent([](StateUnderTest &state) { return state.onStandby(); });
+  }
+  bool onPause() {
+    return onEvent([](StateUnderTest &state) { return state.onPause(); });
+  }
+
+  StateTop top{*this, nullptr, "Top"};
+  StateStandby standby{*this, &top, "Standby"};
+  StateRunning running{*this, &top, "Running"};
+  StatePumping pumping{*this, &running, "Pumping"};
+  StatePaused paused{*this, &running, "Paused"};
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.standby); }
+
+bool StateStandby::onRun() {
+  hsm.transition(hsm.running);
+  return true;
+}
+
+void StateRunning::onInit() { hsm.initialTransition(hsm.pumping); }
+
+bool StateRunning::onStandby() {
+  hsm.transition(hsm.standby);
+  return true;
+}
+
+bool StatePumping::onPause() {
+  hsm.transition(hsm.paused);
+  return true;
+}
+
+bool StatePaused::onPause() {
+  hsm.transition(hsm.pumping);
+  return true;
+}
+
+class HsmHeatMapTest : public Test {
+public:
+  HsmHeatMapTest() {
+    hsm.setFlightRecorder(&recorder);
+    hsm.onStart();
+    hsm.onRun();
+    // Pausing is the hot transition
+    for (int i = 0; i < 10; ++i) {
+      hsm.onPause();
+    }
+    hsm.onStandby();
+  }
+
+  HsmFlightRecorderRing<256> recorder;
+  HsmUnderTest hsm;
+  std::ostringstream out;
+};
+
+} // namespace
+
+TEST_F(HsmHeatMapTest, plantUml) {
+  HsmHeatMap map(hsm.top);
+  map.add(recorder);
+  map.writePlantUml(out);
+  const std::string uml = out.str();
+
+  EXPECT_EQ(0u, uml.find("@startuml\nstate \"Top\" as S0 "));
+  EXPECT_THAT(uml, HasSubstr("  state \"Running\" as S2 #FF"));
+  EXPECT_THAT(uml, HasSubstr("    state \"Pumping\" as S3 #FF2828\n    S3 : entered 6x\n"));
+  EXPECT_THAT(uml, HasSubstr("    S4 : entered 5x\n"));
+  EXPECT_THAT(uml, HasSubstr("S3 -[#FF2828,bold]-> S4 : onPause()\\n5x\n"));
+  EXPECT_THAT(uml, HasSubstr("S1 -[#FFD4D4,bold]-> S2 : "));
+  EXPECT_EQ("@enduml\n", uml.substr(uml.size() - 8));
+}
+
+TEST_F(HsmHeatMapTest, dot) {
+  HsmHeatMap map(hsm.top);
+  map.add(recorder);
+  map.writeDot(out);
+  const std::string dot = out.str();
+
+  EXPECT_EQ(0u, dot.find("digraph hsm {\n"));
+  EXPECT_THAT(dot, HasSubstr("subgraph cluster_S2 {\n      label=\"Running\\nentered 1x\";\n"));
+  EXPECT_THAT(dot, HasSubstr("S3 [label=\"Pumping\\nentered 6x\", fillcolor=\"#FF2828\"];"));
+  EXPECT_THAT(dot, HasSubstr("color=\"#FF2828\", penwidth=5];"));
+  // Leaving Running is drawn from the border of the cluster
+  EXPECT_THAT(dot, HasSubstr("S2 -> S1 [label="));
+  EXPECT_THAT(dot, HasSubstr("ltail=cluster_S2];"));
+}
+
+TEST_F(HsmHeatMapTest, unknownStatesSkipped) {
+  HsmHeatMap map(hsm.top);
+  hsp::HsmTraceRecord record = {};
+  record.kind = hsp::HsmTraceRecord::EVENT;
+  record.handled = true;
+  // States of a larger machine
+  record.source = 1;
+  record.target = 40;
+  map.add(record);
+  record.source = 40;
+  record.target = 1;
+  map.add(record);
+  record.kind = hsp::HsmTraceRecord::ENTER;
+  map.add(record);
+
+  map.writePlantUml(out);
+  map.writeDot(out);
+  EXPECT_THAT(out.str(), ::testing::Not(HasSubstr("S40")));
+  EXPECT_THAT(out.str(), ::testing::Not(HasSubstr("->")));
+}
+
+#ifdef HSM_METRICS
+TEST(HsmHeatMapMetricsTest, dwellAndLatency) {
+  HsmFlightRecorderRing<64> recorder;
+  hsp::HsmMetrics metrics(5);
+  HsmUnderTest hsm;
+  hsm.setFlightRecorder(&recorder);
+  hsm.setMetrics(&metrics);
+  hsm.onStart();
+  hsm.onRun();
+  hsm.onStandby();
+
+  HsmHeatMap map(hsm.top);
+  map.add(recorder);
+  map.add(metrics.snapshot());
+  std::ostringstream out;
+  map.writePlantUml(out);
+
+  EXPECT_THAT(out.str(), HasSubstr("S3 : entered 1x\\ndwell "));
+  EXPECT_THAT(out.str(), HasSubstr("\\n1x, "));
+}
+#endif
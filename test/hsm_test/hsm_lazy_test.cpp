@@ -0,0 +1,219 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_lazy.h"
+
+#include <gmock/gmock.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+
+using hsp::Hsm;
+using hsp::HsmArena;
+using hsp::HsmLazy;
+using hsp::HsmState;
+
+using ::testing::ElementsAre;
+using ::testing::Test;
+
+//!
+// Machine where the service subtree is only constructed when entered
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Normal
+//   state Normal
+//   state Service {
+//     [H] --> Calibrate
+//     state Calibrate
+//     state Flush
+//     Calibrate --> Flush : next
+//   }
+//   Normal --> Service : service
+//   Service --> Normal : done
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState, const string &name)
+      : HsmState(superState)
+      , hsm(hsm)
+      , name(name) {}
+
+  void onEnter() override;
+
+  virtual bool onService() { return false; }
+  virtual bool onNext() { return false; }
+  virtual bool onDone() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+  const string name;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateNormal : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onService() override;
+};
+
+class StateService : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+  bool onDone() override;
+};
+
+class StateCalibrate : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onNext() override;
+};
+
+//! The lazy subtree
+struct ServiceStates {
+  ServiceStates(HsmUnderTest &hsm, HsmState<StateUnderTest> *superState)
+      : service(hsm, superState, "SERVICE")
+      , calibrate(hsm, &service, "CALIBRATE")
+      , flush(hsm, &service, "FLUSH") {
+    constructions++;
+  }
+
+  StateService service;
+  StateCalibrate calibrate;
+  StateUnderTest flush;
+
+  static int constructions;
+};
+int ServiceStates::constructions = 0;
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+public:
+  explicit HsmUnderTest(HsmArena &arena)
+      : Hsm(top)
+      , services(arena, [this](void *memory) { return new (memory) ServiceStates(*this, &top); }) {}
+
+  bool onService() {
+    return onEvent([](StateUnderTest &state) { return state.onService(); });
+  }
+  bool onNext() {
+    return onEvent([](StateUnderTest &state) { return state.onNext(); });
+  }
+  bool onDone() {
+    return onEvent([](StateUnderTest &state) { return state.onDone(); });
+  }
+
+  std::vector<string> log;
+
+  StateTop top{*this, nullptr, "TOP"};
+  StateNormal normal{*this, &top, "NORMAL"};
+  HsmLazy<ServiceStates> services;
+
+  friend StateTop;
+  friend StateNormal;
+  friend StateService;
+  friend StateCalibrate;
+};
+
+void StateUnderTest::onEnter() { hsm.log.push_back(name); }
+
+void StateTop::onInit() { hsm.initialTransition(hsm.normal); }
+
+bool StateNormal::onService() {
+  hsm.transition(hsm.services->calibrate);
+  return true;
+}
+
+void StateService::onInit() { hsm.initialHistoryTransition(hsm.services->calibrate); }
+bool StateService::onDone() {
+  hsm.transition(hsm.normal);
+  return true;
+}
+
+bool StateCalibrate::onNext() {
+  hsm.transition(hsm.services->flush);
+  return true;
+}
+
+class HsmLazyTest : public Test {
+public:
+  HsmArena arena{sizeof(ServiceStates)};
+  HsmUnderTest hsm{arena};
+
+  void SetUp() override { ServiceStates::constructions = 0; }
+};
+
+} // namespace
+
+TEST_F(HsmLazyTest, subtreeConstructedOnFirstEntry) {
+  hsm.onStart();
+  hsm.onNext();
+  EXPECT_FALSE(hsm.services.constructed());
+  EXPECT_EQ(0u, arena.used());
+
+  hsm.onService();
+  EXPECT_TRUE(hsm.services.constructed());
+  EXPECT_EQ(sizeof(ServiceStates), arena.used());
+  EXPECT_THAT(hsm.log, ElementsAre("TOP", "NORMAL", "SERVICE", "CALIBRATE"));
+  hsm.log.clear();
+
+  hsm.onNext();
+  hsm.onDone();
+  hsm.onService();
+  EXPECT_THAT(hsm.log, ElementsAre("FLUSH", "NORMAL", "SERVICE", "CALIBRATE"));
+  EXPECT_EQ(1, ServiceStates::constructions);
+}
+
+TEST_F(HsmLazyTest, staticBuffer) {
+  alignas(std::max_align_t) static char buffer[sizeof(ServiceStates) + 16];
+  HsmArena staticArena(buffer + 1, sizeof(buffer) - 1);
+
+  void *memory = staticArena.allocate(8, 8);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(memory) % 8);
+  EXPECT_EQ(buffer + 8, memory);
+  EXPECT_EQ(15u, staticArena.used());
+}
+
+TEST(HsmArenaDeathTest, exhaustedArenaAborts) {
+  alignas(std::max_align_t) static char buffer[16];
+  HsmArena staticArena(buffer, sizeof(buffer));
+  staticArena.allocate(16, 1);
+  EXPECT_DEATH(staticArena.allocate(1, 1), "");
+  EXPECT_DEATH(staticArena.allocate(~std::size_t(0), 1), "");
+}
@@ -0,0 +1,364 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifdef HSM_METRICS
+
+#include "hsm.h"
+#include "hsm_event_type.h"
+#include "hsm_metrics.h"
+
+#include <gmock/gmock.h>
+
+#include <chrono>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using hsp::Hsm;
+using hsp::HsmHistogram;
+using hsp::HsmMetrics;
+using hsp::HsmState;
+
+using ::testing::ContainsRegex;
+using ::testing::HasSubstr;
+using ::testing::Test;
+
+//!
+// Machine collecting metrics
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Standby
+//   state Standby
+//   state Running
+//   Standby --> Running : run
+//   Running --> Standby : standby
+//   Top : ping
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onRun() { return false; }
+  virtual bool onStandby() { return false; }
+  virtual bool onPing() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+  bool onPing() override { return true; }
+};
+
+class StateStandby : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onRun() override;
+};
+
+class StateRunning : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onEnter() override;
+  bool onStandby() override;
+  const char *name() const override { return "Running"; }
+};
+
+struct RunEvent {
+  bool operator()(StateUnderTest &state) { return state.onRun(); }
+};
+struct StandbyEvent {
+  bool operator()(StateUnderTest &state) { return state.onStandby(); }
+};
+struct PingEvent {
+  bool operator()(StateUnderTest &state) { return state.onPing(); }
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+  friend StateTop;
+  friend StateStandby;
+  friend StateRunning;
+
+public:
+  explicit HsmUnderTest(HsmMetrics &metrics)
+      : Hsm(top) {
+    setMetrics(&metrics);
+  }
+
+  bool onRun() { return onEvent(RunEvent()); }
+  bool onStandby() { return onEvent(StandbyEvent()); }
+  bool onPing() { return onEvent(PingEvent()); }
+
+  StateTop top{*this, nullptr};
+  StateStandby standby{*this, &top};
+  StateRunning running{*this, &top};
+
+  //! Time burnt by Running.onEnter()
+  std::chrono::microseconds enterRunning{0};
+};
+
+void spin(std::chrono::microseconds duration) {
+  const auto end = std::chrono::steady_clock::now() + duration;
+  while (std::chrono::steady_clock::now() < end) {
+  }
+}
+
+void StateTop::onInit() { hsm.initialTransition(hsm.standby); }
+
+bool StateStandby::onRun() {
+  hsm.transition(hsm.running);
+  return true;
+}
+
+void StateRunning::onEnter() { spin(hsm.enterRunning); }
+
+bool StateRunning::onStandby() {
+  hsm.transition(hsm.standby);
+  return true;
+}
+
+class HsmMetricsTest : public Test {
+public:
+  HsmMetrics metrics{3};
+  HsmUnderTest hsm{metrics};
+};
+
+} // namespace
+
+TEST(HsmHistogramTest, buckets) {
+  EXPECT_EQ(0u, HsmHistogram::bucketOf(0));
+  EXPECT_EQ(1u, HsmHistogram::bucketOf(1));
+  EXPECT_EQ(2u, HsmHistogram::bucketOf(3));
+  EXPECT_EQ(11u, HsmHistogram::bucketOf(1024));
+  EXPECT_EQ(HsmHistogram::BUCKETS - 1, HsmHistogram::bucketOf(~uint64_t(0)));
+
+  HsmHistogram histogram;
+  histogram.count = 10;
+  histogram.buckets[HsmHistogram::bucketOf(100)] = 9;
+  histogram.buckets[HsmHistogram::bucketOf(5000)] = 1;
+  EXPECT_EQ(127u, histogram.percentile(0.5));
+  EXPECT_EQ(8191u, histogram.percentile(0.99));
+}
+
+TEST_F(HsmMetricsTest, dwellTime) {
+  hsm.onStart();
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  hsm.onRun();
+  hsm.onStandby();
+
+  auto snapshot = metrics.snapshot();
+  EXPECT_EQ(1u, snapshot.dwell[hsm.standby.index].count);
+  EXPECT_GE(snapshot.dwell[hsm.standby.index].max, 2000000u);
+  EXPECT_EQ(1u, snapshot.dwell[hsm.running.index].count);
+  // Top has not been exited yet
+  EXPECT_EQ(0u, snapshot.dwell[hsm.top.index].count);
+
+  hsm.onStop();
+  snapshot = metrics.snapshot();
+  EXPECT_EQ(2u, snapshot.dwell[hsm.standby.index].count);
+  EXPECT_EQ(1u, snapshot.dwell[hsm.top.index].count);
+  EXPECT_GE(snapshot.dwell[hsm.top.index].sum, snapshot.dwell[hsm.standby.index].sum);
+}
+
+TEST_F(HsmMetricsTest, eventsAndBubbling) {
+  hsm.onStart();
+  hsm.onRun();
+  hsm.onRun();
+  hsm.onPing();
+  hsm.onPing();
+
+  const uint16_t run = hsp::hsmEventType<RunEvent>().id;
+  const uint16_t ping = hsp::hsmEventType<PingEvent>().id;
+  auto snapshot = metrics.snapshot();
+
+  EXPECT_EQ(2u, snapshot.latency[run].count);
+  EXPECT_EQ(1u, snapshot.unhandled[run]);
+  EXPECT_EQ(2u, snapshot.latency[ping].count);
+  EXPECT_EQ(0u, snapshot.unhandled[ping]);
+
+  // Run was handled by the current state, ping bubbled up to top
+  EXPECT_EQ(1u, snapshot.bubbleDepth[0]);
+  EXPECT_EQ(2u, snapshot.bubbleDepth[1]);
+}
+
+TEST_F(HsmMetricsTest, shardPerThread) {
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([this] {
+      HsmUnderTest local(metrics);
+      local.onStart();
+      for (int i = 0; i < 1000; ++i) {
+        local.onRun();
+        local.onStandby();
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  auto snapshot = metrics.snapshot();
+  EXPECT_EQ(4000u, snapshot.dwell[hsm.running.index].count);
+  EXPECT_EQ(4000u, snapshot.latency[hsp::hsmEventType<RunEvent>().id].count);
+  EXPECT_EQ(8000u, snapshot.bubbleDepth[0]);
+}
+
+TEST(HsmMetricsReuseTest, freshShardsAfterReuse) {
+  for (int i = 0; i < 3; ++i) {
+    // Each metrics may reuse the id of the one destroyed before, but not its shard of this thread
+    HsmMetrics metrics{3};
+    metrics.dwell(1, 1000);
+    EXPECT_EQ(1u, metrics.snapshot().dwell[1].count);
+  }
+}
+
+TEST_F(HsmMetricsTest, cpuTimePerState) {
+  metrics.profileCpu(1);
+  hsm.enterRunning = std::chrono::milliseconds(5);
+  hsm.onStart();
+  hsm.onRun();
+  hsm.onStandby();
+
+  auto snapshot = metrics.snapshot();
+  EXPECT_EQ(3u, snapshot.cpuSamples);
+  const auto &running = snapshot.cpu[hsm.running.index];
+  const auto &standby = snapshot.cpu[hsm.standby.index];
+  EXPECT_EQ(1u, running.calls[unsigned(hsp::HsmCallback::ENTER)]);
+  EXPECT_EQ(1u, running.calls[unsigned(hsp::HsmCallback::HANDLER)]);
+  EXPECT_EQ(1u, standby.calls[unsigned(hsp::HsmCallback::HANDLER)]);
+  EXPECT_EQ(2u, standby.calls[unsigned(hsp::HsmCallback::ENTER)]);
+  // The spin in Running.onEnter() is attributed to it and not to the handler of Standby taking the transition
+  EXPECT_GT(running.ticks[unsigned(hsp::HsmCallback::ENTER)], 10 * standby.total());
+  EXPECT_GT(running.ticks[unsigned(hsp::HsmCallback::ENTER)], 10 * snapshot.cpuOverhead);
+
+  std::ostringstream report;
+  metrics.cpuReport(report, hsm.top);
+  EXPECT_THAT(report.str(), HasSubstr("3 steps sampled, 1 of 1"));
+  // Most expensive first
+  EXPECT_THAT(report.str(), HasSubstr("share\nRunning "));
+  EXPECT_THAT(report.str(), HasSubstr("(framework)"));
+}
+
+TEST_F(HsmMetricsTest, cpuSampling) {
+  metrics.profileCpu(4);
+  hsm.onStart();
+  for (int i = 0; i < 8; ++i) {
+    hsm.onRun();
+    hsm.onStandby();
+  }
+
+  auto snapshot = metrics.snapshot();
+  EXPECT_EQ(17u / 4, snapshot.cpuSamples);
+  EXPECT_EQ(4u, snapshot.cpuSamplePeriod);
+}
+
+TEST_F(HsmMetricsTest, bubblingPerLeaf) {
+  metrics.profileBubbling();
+  hsm.onStart();
+  for (int i = 0; i < 100; ++i) {
+    hsm.onPing();
+  }
+  hsm.onRun();
+  hsm.onRun();
+
+  const uint16_t run = hsp::hsmEventType<RunEvent>().id;
+  const uint16_t ping = hsp::hsmEventType<PingEvent>().id;
+  auto snapshot = metrics.snapshot();
+
+  // Ping bubbled from Standby to Top
+  EXPECT_EQ(100u, snapshot.bubblingOf(ping, hsm.standby.index).dispatched);
+  EXPECT_EQ(200u, snapshot.bubblingOf(ping, hsm.standby.index).levels);
+  EXPECT_EQ(0u, snapshot.bubblingOf(ping, hsm.standby.index).dropped);
+  // Run was handled by Standby, but dropped by Running after bubbling through Top
+  EXPECT_EQ(1u, snapshot.bubblingOf(run, hsm.standby.index).levels);
+  EXPECT_EQ(0u, snapshot.bubblingOf(run, hsm.standby.index).dropped);
+  EXPECT_EQ(2u, snapshot.bubblingOf(run, hsm.running.index).levels);
+  EXPECT_EQ(1u, snapshot.bubblingOf(run, hsm.running.index).dropped);
+  EXPECT_EQ(0u, snapshot.bubblingOf(ping, hsm.running.index).dispatched);
+
+  std::ostringstream report;
+  metrics.bubblingReport(report, hsm.top);
+  // Most expensive first, and flagged as handled two levels up
+  EXPECT_THAT(report.str(), ContainsRegex("share\nPingEvent +state 1 +100 +2\\.0 +0\\.0%[^\n]* handle lower\n"));
+  EXPECT_THAT(report.str(), HasSubstr("Running"));
+}
+
+TEST(HsmMetricsTooFewStatesTest, unknownStatesDropped) {
+  // Running has the highest index and is not counted
+  HsmMetrics metrics(2);
+  metrics.profileCpu(1);
+  metrics.profileBubbling();
+  HsmUnderTest hsm(metrics);
+  hsm.onStart();
+  hsm.onRun();
+  hsm.onStandby();
+
+  auto snapshot = metrics.snapshot();
+  EXPECT_EQ(2u, snapshot.dwell.size());
+  EXPECT_EQ(1u, snapshot.dwell[hsm.standby.index].count);
+  // Enter, init, handler, exit and dwell of Running, and the standby dispatched from it
+  EXPECT_EQ(6u, snapshot.unknownStates);
+}
+
+TEST(HsmMetricsDetachedTest, dwellCountsFromAttach) {
+  HsmMetrics metrics(3);
+  HsmUnderTest hsm(metrics);
+  hsm.setMetrics(nullptr);
+  hsm.onStart();
+  hsm.onRun();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  hsm.setMetrics(&metrics);
+  hsm.onStandby();
+  auto snapshot = metrics.snapshot();
+  EXPECT_EQ(1u, snapshot.dwell[hsm.running.index].count);
+  EXPECT_LT(snapshot.dwell[hsm.running.index].max, 20000000u);
+}
+
+TEST(HsmMetricsDetachedTest, nothingCollected) {
+  HsmMetrics metrics(3);
+  HsmUnderTest hsm(metrics);
+  hsm.setMetrics(nullptr);
+  hsm.onStart();
+  hsm.onRun();
+
+  auto snapshot = metrics.snapshot();
+  EXPECT_EQ(0u, snapshot.dwell[hsm.standby.index].count);
+  EXPECT_EQ(0u, snapshot.bubbleDepth[0]);
+}
+
+#endif
@@ -0,0 +1,236 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_payload.h"
+
+#include <gmock/gmock.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+
+using hsp::Hsm;
+using hsp::HsmPayload;
+using hsp::HsmPayloadArena;
+using hsp::HsmState;
+
+using ::testing::Test;
+
+//!
+// Sensor machine receiving frames as payloads
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Sampling
+//   state Sampling
+//   state Overload
+//   Sampling --> Overload : frame [peak > limit]
+//   Overload --> Sampling : frame [peak <= limit]
+// }
+//
+// @enduml
+//
+
+namespace {
+
+//! Large payload that counts its copies
+struct Frame {
+  Frame(uint16_t peak)
+      : peak(peak) {
+    alive++;
+  }
+  Frame(const Frame &other)
+      : peak(other.peak) {
+    alive++;
+    copies++;
+  }
+  ~Frame() { alive--; }
+
+  uint16_t peak;
+  std::array<uint16_t, 2048> samples = {};
+
+  static int alive;
+  static int copies;
+};
+int Frame::alive = 0;
+int Frame::copies = 0;
+
+//! Move only payload
+struct Calibration {
+  std::unique_ptr<uint16_t> limit;
+};
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onFrame(const Frame &) { return false; }
+  virtual bool onCalibration(Calibration &) { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+  bool onCalibration(Calibration &calibration) override;
+};
+
+class StateSampling : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onFrame(const Frame &frame) override;
+};
+
+class StateOverload : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onFrame(const Frame &frame) override;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+public:
+  HsmUnderTest()
+      : Hsm(top) {
+    setPayloadArena(&payloads);
+  }
+
+  bool onFrame(HsmPayload<Frame> frame) {
+    return onEvent([&](StateUnderTest &state) { return state.onFrame(*frame); });
+  }
+  bool onCalibration(HsmPayload<Calibration> calibration) {
+    return onEvent([&](StateUnderTest &state) { return state.onCalibration(*calibration); });
+  }
+
+  HsmPayloadArena payloads{4096};
+  std::unique_ptr<uint16_t> limit = std::make_unique<uint16_t>(100);
+  //! Arena usage seen by handlers
+  std::size_t payloadsInStep = 0;
+
+  StateTop top{*this, nullptr};
+  StateSampling sampling{*this, &top};
+  StateOverload overload{*this, &top};
+
+  friend StateTop;
+  friend StateSampling;
+  friend StateOverload;
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.sampling); }
+bool StateTop::onCalibration(Calibration &calibration) {
+  hsm.limit = std::move(calibration.limit);
+  // Internal event in the same run to completion step
+  hsm.onFrame(hsm.payloads.make<Frame>(*hsm.limit + 1));
+  hsm.payloadsInStep = hsm.payloads.count();
+  return true;
+}
+
+bool StateSampling::onFrame(const Frame &frame) {
+  hsm.payloadsInStep = hsm.payloads.count();
+  if (frame.peak > *hsm.limit) {
+    hsm.transition(hsm.overload);
+  }
+  return true;
+}
+
+bool StateOverload::onFrame(const Frame &frame) {
+  hsm.payloadsInStep = hsm.payloads.count();
+  if (frame.peak <= *hsm.limit) {
+    hsm.transition(hsm.sampling);
+  }
+  return true;
+}
+
+class HsmPayloadTest : public Test {
+public:
+  HsmUnderTest hsm;
+
+  void SetUp() override {
+    Frame::alive = 0;
+    Frame::copies = 0;
+    hsm.onStart();
+  }
+};
+
+} // namespace
+
+TEST_F(HsmPayloadTest, framesAreNotCopied) {
+  for (uint16_t peak = 0; peak < 200; peak += 10) {
+    EXPECT_TRUE(hsm.onFrame(hsm.payloads.make<Frame>(peak)));
+    EXPECT_EQ(1u, hsm.payloadsInStep);
+  }
+  EXPECT_EQ(0, Frame::copies);
+}
+
+TEST_F(HsmPayloadTest, releasedAfterStep) {
+  hsm.onFrame(hsm.payloads.make<Frame>(200));
+  EXPECT_EQ(0, Frame::alive);
+  EXPECT_EQ(0u, hsm.payloads.used());
+}
+
+TEST_F(HsmPayloadTest, moveOnlyPayloadAndInternalEvent) {
+  auto calibration = hsm.payloads.make<Calibration>();
+  calibration->limit = std::make_unique<uint16_t>(50);
+
+  EXPECT_TRUE(hsm.onCalibration(std::move(calibration)));
+  EXPECT_EQ(50, *hsm.limit);
+  // Payload of the internal event is kept until the outer step completes
+  EXPECT_EQ(2u, hsm.payloadsInStep);
+  EXPECT_EQ(0, Frame::alive);
+}
+
+TEST(HsmPayloadArenaTest, blocksAreReused) {
+  HsmPayloadArena arena(1024);
+  std::size_t capacity = 0;
+  const void *firstLarge = nullptr;
+
+  for (int step = 0; step < 10; ++step) {
+    auto small = arena.make<uint32_t>(7u);
+    auto large = arena.make<std::array<char, 3000>>();
+    auto next = arena.make<uint64_t>(9u);
+    EXPECT_EQ(7u, *small);
+    EXPECT_EQ(9u, *next);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(next.get()) % alignof(uint64_t));
+    EXPECT_EQ(3u, arena.count());
+    EXPECT_GE(arena.used(), sizeof(uint32_t) + 3000 + sizeof(uint64_t));
+    if (step == 0) {
+      capacity = arena.capacity();
+      firstLarge = large.get();
+      // A block of its own for the large payload
+      EXPECT_GE(capacity, 1024u + 3000u);
+    } else {
+      // No blocks allocated after the first step
+      EXPECT_EQ(capacity, arena.capacity());
+      EXPECT_EQ(firstLarge, large.get());
+    }
+    arena.release();
+  }
+  EXPECT_EQ(0u, arena.used());
+}
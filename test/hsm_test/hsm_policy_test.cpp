@@ -0,0 +1,188 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+
+#include <gmock/gmock.h>
+
+#include <string>
+#include <vector>
+
+using hsp::Hsm;
+using hsp::HsmBase;
+using hsp::HsmNoPolicy;
+using hsp::HsmState;
+using hsp::HsmStateBase;
+
+using ::testing::ElementsAre;
+using ::testing::Test;
+
+//!
+// Machine with a policy logging the hooks
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Standby
+//   state Standby
+//   state Running
+//   Standby --> Running : run
+//   Running --> Standby : standby
+//   Top : ping
+// }
+//
+// @enduml
+//
+
+namespace {
+
+struct LoggingPolicy : HsmNoPolicy {
+  std::vector<std::string> log;
+
+  template <typename EVENT> void onDispatch(const HsmStateBase &currentState, const EVENT &) {
+    log.push_back("dispatch " + name(currentState));
+  }
+  void onHandled(const HsmStateBase *state) { log.push_back("handled " + (state ? name(*state) : "-")); }
+  void onExit(const HsmStateBase &state) { log.push_back("exit " + name(state)); }
+  void onEnter(const HsmStateBase &state) { log.push_back("enter " + name(state)); }
+  void onInit(const HsmStateBase &state) { log.push_back("init " + name(state)); }
+  void onTransitionComplete(const HsmStateBase &currentState) { log.push_back("complete " + name(currentState)); }
+
+  static std::string name(const HsmStateBase &state) { return std::to_string(state.index); }
+};
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onRun() { return false; }
+  virtual bool onStandby() { return false; }
+  virtual bool onPing() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+  bool onPing() override { return true; }
+};
+
+class StateStandby : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onRun() override;
+};
+
+class StateRunning : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onStandby() override;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest, LoggingPolicy> {
+  friend StateTop;
+  friend StateStandby;
+  friend StateRunning;
+
+public:
+  HsmUnderTest()
+      : Hsm(top) {}
+
+  bool onRun() {
+    return onEvent([](StateUnderTest &state) { return state.onRun(); });
+  }
+  bool onStandby() {
+    return onEvent([](StateUnderTest &state) { return state.onStandby(); });
+  }
+  bool onPing() {
+    return onEvent([](StateUnderTest &state) { return state.onPing(); });
+  }
+
+  // Indices 0, 1 and 2
+  StateTop top{*this, nullptr};
+  StateStandby standby{*this, &top};
+  StateRunning running{*this, &top};
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.standby); }
+
+bool StateStandby::onRun() {
+  hsm.transition(hsm.running);
+  return true;
+}
+
+bool StateRunning::onStandby() {
+  hsm.transition(hsm.standby);
+  return true;
+}
+
+class HsmPolicyTest : public Test {
+public:
+  HsmUnderTest hsm;
+};
+
+class EmptyState : public HsmState<EmptyState> {
+  using HsmState::HsmState;
+};
+
+} // namespace
+
+TEST(HsmNoPolicyTest, noOverhead) {
+  // The policy is an empty base, so it takes no space in the machine
+  EXPECT_EQ(sizeof(HsmBase), sizeof(Hsm<EmptyState>));
+}
+
+TEST_F(HsmPolicyTest, hooks) {
+  hsm.onStart();
+  EXPECT_THAT(hsm.policy().log, ElementsAre("enter 0", "init 0", "enter 1", "init 1"));
+
+  hsm.policy().log.clear();
+  hsm.onRun();
+  EXPECT_THAT(hsm.policy().log, ElementsAre("dispatch 1", "exit 1", "enter 2", "init 2", "complete 2", "handled 1"));
+
+  hsm.policy().log.clear();
+  hsm.onPing();
+  hsm.onRun();
+  EXPECT_THAT(hsm.policy().log, ElementsAre("dispatch 2", "handled 0", "dispatch 2", "handled -"));
+
+  hsm.policy().log.clear();
+  hsm.onStop();
+  EXPECT_THAT(hsm.policy().log, ElementsAre("exit 2", "exit 0"));
+}
+
+TEST_F(HsmPolicyTest, baseWithoutHooks) {
+  HsmBase &base = hsm;
+  base.onStart();
+  EXPECT_TRUE(hsm.isStarted());
+  EXPECT_TRUE(hsm.policy().log.empty());
+
+  base.onStop();
+  EXPECT_FALSE(hsm.isStarted());
+  EXPECT_TRUE(hsm.policy().log.empty());
+}
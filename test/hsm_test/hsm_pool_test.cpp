@@ -0,0 +1,221 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_pool.h"
+
+#include <gmock/gmock.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::string;
+
+using hsp::Hsm;
+using hsp::HsmPool;
+using hsp::HsmState;
+using hsp::HsmStateBase;
+
+using ::testing::ElementsAre;
+using ::testing::Test;
+
+//!
+// Session machine that is stopped, reset and reused
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Session
+//   state Session {
+//     [H] --> Login
+//     state Login
+//     state Active
+//     Login --> Active : authenticated
+//   }
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState, const string &name)
+      : HsmState(superState)
+      , hsm(hsm)
+      , name(name) {}
+
+  void onEnter() override;
+  void onExit() override;
+
+  virtual bool onAuthenticated() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+  const string name;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateSession : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateLogin : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onAuthenticated() override;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+public:
+  HsmUnderTest()
+      : Hsm(top) {
+    constructions++;
+  }
+
+  bool onAuthenticated() {
+    return onEvent([](StateUnderTest &state) { return state.onAuthenticated(); });
+  }
+
+  std::vector<string> log;
+  static int constructions;
+
+private:
+  StateTop top{*this, nullptr, "TOP"};
+  StateSession session{*this, &top, "SESSION"};
+  StateLogin login{*this, &session, "LOGIN"};
+  StateUnderTest active{*this, &session, "ACTIVE"};
+
+  friend StateTop;
+  friend StateSession;
+  friend StateLogin;
+};
+int HsmUnderTest::constructions = 0;
+
+void StateUnderTest::onEnter() { hsm.log.push_back(name + " ENTRY"); }
+void StateUnderTest::onExit() { hsm.log.push_back(name + " EXIT"); }
+
+void StateTop::onInit() { hsm.initialTransition(hsm.session); }
+
+void StateSession::onInit() { hsm.initialHistoryTransition(hsm.login); }
+
+bool StateLogin::onAuthenticated() {
+  hsm.transition(hsm.active);
+  return true;
+}
+
+class HsmPoolTest : public Test {
+public:
+  HsmUnderTest hsm;
+
+  void SetUp() override { HsmUnderTest::constructions = 0; }
+};
+
+} // namespace
+
+TEST(HsmStateBaseTest, destroyedStatesUnlinked) {
+  HsmStateBase top(nullptr);
+  HsmStateBase first(&top);
+  auto second = std::make_unique<HsmStateBase>(&top);
+  {
+    HsmStateBase third(&top);
+    ASSERT_EQ(&third, top.firstSubstate);
+    ASSERT_EQ(second.get(), third.nextSibling);
+
+    second.reset();
+    EXPECT_EQ(&first, third.nextSibling);
+  }
+  EXPECT_EQ(&first, top.firstSubstate);
+  EXPECT_EQ(nullptr, first.nextSibling);
+}
+
+TEST_F(HsmPoolTest, stopExitsAllActiveStates) {
+  hsm.onStart();
+  hsm.onAuthenticated();
+  hsm.log.clear();
+
+  hsm.onStop();
+  EXPECT_FALSE(hsm.isStarted());
+  EXPECT_THAT(hsm.log, ElementsAre("ACTIVE EXIT", "SESSION EXIT", "TOP EXIT"));
+}
+
+TEST_F(HsmPoolTest, restartUsesHistoryUntilReset) {
+  hsm.onStart();
+  hsm.onAuthenticated();
+  hsm.onStop();
+  hsm.log.clear();
+
+  hsm.onStart();
+  EXPECT_THAT(hsm.log, ElementsAre("TOP ENTRY", "SESSION ENTRY", "ACTIVE ENTRY"));
+  hsm.onStop();
+  hsm.log.clear();
+
+  hsm.reset();
+  hsm.onStart();
+  EXPECT_THAT(hsm.log, ElementsAre("TOP ENTRY", "SESSION ENTRY", "LOGIN ENTRY"));
+}
+
+TEST_F(HsmPoolTest, poolReusesMachines) {
+  HsmPool<HsmUnderTest> pool;
+  pool.reserve(2);
+  EXPECT_EQ(2, HsmUnderTest::constructions);
+
+  for (int session = 0; session < 100; ++session) {
+    auto first = pool.acquire();
+    auto second = pool.acquire();
+    EXPECT_TRUE(first->isStarted());
+    first->log.clear();
+
+    // Reused machines start without history
+    EXPECT_TRUE(first->onAuthenticated());
+    EXPECT_THAT(first->log, ElementsAre("LOGIN EXIT", "ACTIVE ENTRY"));
+    first->log.clear();
+    second->log.clear();
+  }
+
+  EXPECT_EQ(2, HsmUnderTest::constructions);
+  EXPECT_EQ(2u, pool.available());
+}
+
+TEST_F(HsmPoolTest, handleReleasesOnce) {
+  HsmPool<HsmUnderTest> pool;
+  auto handle = pool.acquire();
+  auto moved = std::move(handle);
+  EXPECT_FALSE(handle);
+  EXPECT_EQ(0u, pool.available());
+
+  moved.release();
+  EXPECT_FALSE(moved);
+  EXPECT_EQ(1u, pool.available());
+  EXPECT_EQ(1u, pool.size());
+}
@@ -0,0 +1,269 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_scheduler.h"
+
+#include <gmock/gmock.h>
+
+#include <string>
+#include <vector>
+
+using hsp::Hsm;
+using hsp::HsmScheduler;
+using hsp::HsmState;
+
+using ::testing::ElementsAre;
+using ::testing::Test;
+
+//!
+// Hsm counting ticks
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Counting
+//   Counting : Tick / log()
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onTick() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateCounting : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onTick() override;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+public:
+  HsmUnderTest(const std::string &name, std::vector<std::string> &log)
+      : Hsm(top)
+      , name(name)
+      , log(log)
+      , top(*this, nullptr)
+      , counting(*this, &top) {
+    onStart();
+  }
+
+  bool onTick() {
+    return onEvent([](StateUnderTest &state) { return state.onTick(); });
+  }
+
+  const std::string name;
+  std::vector<std::string> &log;
+
+private:
+  StateTop top;
+  StateCounting counting;
+
+  friend StateTop;
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.counting); }
+
+bool StateCounting::onTick() {
+  hsm.log.push_back(hsm.name);
+  return true;
+}
+
+class HsmSchedulerTest : public Test {
+public:
+  std::vector<std::string> log;
+  HsmUnderTest a{"A", log};
+  HsmUnderTest b{"B", log};
+  HsmUnderTest c{"C", log};
+};
+
+} // namespace
+
+TEST_F(HsmSchedulerTest, floodedMachineDoesNotStarveOthers) {
+  HsmScheduler scheduler;
+  auto idA = scheduler.addMachine();
+  auto idB = scheduler.addMachine();
+
+  for (int i = 0; i < 100; ++i) {
+    scheduler.post(idA, [&] { a.onTick(); });
+  }
+  scheduler.post(idB, [&] { b.onTick(); });
+
+  EXPECT_EQ(2u, scheduler.runSlice());
+  EXPECT_THAT(log, ElementsAre("A", "B"));
+  EXPECT_EQ(99u, scheduler.backlog());
+
+  EXPECT_EQ(99u, scheduler.run());
+  EXPECT_EQ(0u, scheduler.backlog());
+}
+
+TEST_F(HsmSchedulerTest, quotaPerSlice) {
+  HsmScheduler scheduler;
+  auto idA = scheduler.addMachine(2);
+  auto idB = scheduler.addMachine();
+  auto idC = scheduler.addMachine();
+  scheduler.setQuota(idC, 3);
+
+  for (int i = 0; i < 4; ++i) {
+    scheduler.post(idA, [&] { a.onTick(); });
+    scheduler.post(idB, [&] { b.onTick(); });
+    scheduler.post(idC, [&] { c.onTick(); });
+  }
+
+  scheduler.runSlice();
+  EXPECT_THAT(log, ElementsAre("A", "A", "B", "C", "C", "C"));
+  log.clear();
+  scheduler.runSlice();
+  EXPECT_THAT(log, ElementsAre("A", "A", "B", "C"));
+}
+
+TEST_F(HsmSchedulerTest, eventPostedDuringSliceRunsInNextSlice) {
+  HsmScheduler scheduler;
+  auto idA = scheduler.addMachine();
+  auto idB = scheduler.addMachine();
+
+  scheduler.post(idA, [&] {
+    a.onTick();
+    scheduler.post(idA, [&] { a.onTick(); });
+    scheduler.post(idB, [&] { b.onTick(); });
+  });
+
+  EXPECT_EQ(1u, scheduler.runSlice());
+  EXPECT_EQ(2u, scheduler.runSlice());
+  EXPECT_EQ(0u, scheduler.runSlice());
+  EXPECT_THAT(log, ElementsAre("A", "A", "B"));
+}
+
+TEST_F(HsmSchedulerTest, stats) {
+  HsmScheduler scheduler(4);
+  auto idA = scheduler.addMachine();
+  auto idB = scheduler.addMachine();
+
+  for (int i = 0; i < 10; ++i) {
+    scheduler.post(idA, [&] { a.onTick(); });
+  }
+  scheduler.post(idB, [&] { b.onTick(); });
+
+  scheduler.runSlice();
+  const HsmScheduler::MachineStats &stats = scheduler.stats(idA);
+  EXPECT_EQ(10u, stats.posted);
+  EXPECT_EQ(4u, stats.dispatched);
+  EXPECT_EQ(6u, stats.backlog);
+  EXPECT_EQ(10u, stats.maxBacklog);
+
+  scheduler.run();
+  EXPECT_EQ(10u, stats.dispatched);
+  EXPECT_EQ(0u, stats.backlog);
+  EXPECT_GE(stats.maxLatency, stats.meanLatency());
+  EXPECT_EQ(1u, scheduler.stats(idB).dispatched);
+}
+
+TEST_F(HsmSchedulerTest, earliestDeadlineFirst) {
+  HsmScheduler scheduler(1, HsmScheduler::Policy::EarliestDeadlineFirst);
+  auto idA = scheduler.addMachine(3);
+  auto idB = scheduler.addMachine(3);
+  auto idC = scheduler.addMachine(3);
+  const auto now = HsmScheduler::Clock::now();
+
+  scheduler.post(idC, [&] { c.onTick(); });
+  scheduler.post(idA, [&] { a.onTick(); }, now + std::chrono::seconds(10));
+  scheduler.post(idB, [&] { b.onTick(); }, now + std::chrono::seconds(1));
+  scheduler.post(idA, [&] { a.onTick(); }, now + std::chrono::seconds(2));
+
+  EXPECT_EQ(4u, scheduler.runSlice());
+  EXPECT_THAT(log, ElementsAre("B", "A", "A", "C"));
+}
+
+TEST_F(HsmSchedulerTest, earliestDeadlineFirstRespectsQuota) {
+  HsmScheduler scheduler(1, HsmScheduler::Policy::EarliestDeadlineFirst);
+  auto idA = scheduler.addMachine();
+  auto idB = scheduler.addMachine();
+  const auto now = HsmScheduler::Clock::now();
+
+  for (int i = 0; i < 3; ++i) {
+    scheduler.post(idA, [&] { a.onTick(); }, now + std::chrono::seconds(1));
+  }
+  scheduler.post(idB, [&] { b.onTick(); }, now + std::chrono::seconds(2));
+
+  EXPECT_EQ(2u, scheduler.runSlice());
+  EXPECT_THAT(log, ElementsAre("A", "B"));
+  EXPECT_EQ(2u, scheduler.run());
+}
+
+TEST_F(HsmSchedulerTest, deadlineMisses) {
+  HsmScheduler scheduler(1, HsmScheduler::Policy::EarliestDeadlineFirst);
+  auto idA = scheduler.addMachine();
+  auto idB = scheduler.addMachine();
+  constexpr HsmScheduler::EventType STOP = 1;
+  constexpr HsmScheduler::EventType TICK = 2;
+  const auto now = HsmScheduler::Clock::now();
+
+  scheduler.post(idA, [&] { a.onTick(); }, now - std::chrono::milliseconds(1), STOP);
+  scheduler.post(idA, [&] { a.onTick(); }, now + std::chrono::hours(1), STOP);
+  scheduler.post(idB, [&] { b.onTick(); }, now + std::chrono::hours(1), TICK);
+  scheduler.post(idB, [&] { b.onTick(); });
+  scheduler.run();
+
+  EXPECT_EQ(2u, scheduler.stats(idA).deadlines.dispatched);
+  EXPECT_EQ(1u, scheduler.stats(idA).deadlines.misses);
+  EXPECT_GE(scheduler.stats(idA).deadlines.maxLateness, std::chrono::milliseconds(1));
+  EXPECT_EQ(1u, scheduler.stats(idB).deadlines.dispatched);
+  EXPECT_EQ(0u, scheduler.stats(idB).deadlines.misses);
+
+  EXPECT_EQ(2u, scheduler.deadlineStats(STOP).dispatched);
+  EXPECT_EQ(1u, scheduler.deadlineStats(STOP).misses);
+  EXPECT_EQ(1u, scheduler.deadlineStats(TICK).dispatched);
+  EXPECT_EQ(0u, scheduler.deadlineStats(TICK).misses);
+}
+
+TEST_F(HsmSchedulerTest, roundRobinIgnoresDeadlinesForOrder) {
+  HsmScheduler scheduler;
+  auto idA = scheduler.addMachine(2);
+  const auto now = HsmScheduler::Clock::now();
+
+  scheduler.post(idA, [&] { log.push_back("first"); }, now + std::chrono::hours(1));
+  scheduler.post(idA, [&] { log.push_back("second"); }, now - std::chrono::hours(1));
+  scheduler.run();
+
+  EXPECT_THAT(log, ElementsAre("first", "second"));
+  EXPECT_EQ(1u, scheduler.stats(idA).deadlines.misses);
+}
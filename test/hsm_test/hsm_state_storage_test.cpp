@@ -0,0 +1,293 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_state_storage.h"
+
+#include <gmock/gmock.h>
+
+#include <cstdint>
+#include <memory>
+
+using hsp::Hsm;
+using hsp::HsmState;
+using hsp::HsmStateLocal;
+using hsp::HsmStateStorage;
+
+using ::testing::Test;
+
+//!
+// Pulsing pump where the states keep their data in the storage of the machine
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Standby
+//   state Standby
+//   state Pulsing {
+//     [*] --> Running
+//     state Running
+//     state Paused
+//     Running --> Paused : timeout
+//     Paused --> Running : timeout
+//   }
+//   Standby --> Pulsing : pulse
+//   Pulsing --> Standby : standby
+// }
+//
+// @enduml
+//
+
+namespace {
+
+//! Counts the live objects to check construction and destruction
+struct Tracked {
+  static int alive;
+  Tracked() { alive++; }
+  ~Tracked() { alive--; }
+};
+int Tracked::alive = 0;
+
+struct Pulses : Tracked {
+  unsigned count = 0;
+};
+
+struct RunningData : Tracked {
+  uint64_t samples[4] = {};
+};
+
+struct PausedData : Tracked {
+  uint16_t reason = 0;
+};
+
+struct StandbyData : Tracked {
+  uint32_t since = 0;
+};
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onPulse() { return false; }
+  virtual bool onStandby() { return false; }
+  virtual bool onTimeout() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateStandby : public StateUnderTest {
+public:
+  StateStandby(HsmUnderTest &hsm, HsmState *const superState);
+  void onEnter() override { data.emplace(); }
+  void onExit() override { data.destroy(); }
+  bool onPulse() override;
+
+  HsmStateLocal<StandbyData> data;
+};
+
+class StatePulsing : public StateUnderTest {
+public:
+  StatePulsing(HsmUnderTest &hsm, HsmState *const superState);
+  void onEnter() override { pulses.emplace(); }
+  void onExit() override { pulses.destroy(); }
+  void onInit() override;
+  bool onStandby() override;
+
+  HsmStateLocal<Pulses> pulses;
+};
+
+class StateRunning : public StateUnderTest {
+public:
+  StateRunning(HsmUnderTest &hsm, HsmState *const superState);
+  void onEnter() override;
+  void onExit() override { data.destroy(); }
+  bool onTimeout() override;
+
+  HsmStateLocal<RunningData> data;
+};
+
+class StatePaused : public StateUnderTest {
+public:
+  StatePaused(HsmUnderTest &hsm, HsmState *const superState);
+  void onEnter() override { data.emplace(); }
+  void onExit() override { data.destroy(); }
+  bool onTimeout() override;
+
+  HsmStateLocal<PausedData> data;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+public:
+  HsmUnderTest()
+      : Hsm(top) {}
+
+  bool onPulse() {
+    return onEvent([](StateUnderTest &state) { return state.onPulse(); });
+  }
+  bool onStandby() {
+    return onEvent([](StateUnderTest &state) { return state.onStandby(); });
+  }
+  bool onTimeout() {
+    return onEvent([](StateUnderTest &state) { return state.onTimeout(); });
+  }
+
+  // Must be declared before the states, so it is destroyed after them
+  HsmStateStorage storage;
+
+  StateTop top{*this, nullptr};
+  StateStandby standby{*this, &top};
+  StatePulsing pulsing{*this, &top};
+  StateRunning running{*this, &pulsing};
+  StatePaused paused{*this, &pulsing};
+
+  friend StateTop;
+  friend StateStandby;
+  friend StatePulsing;
+  friend StateRunning;
+  friend StatePaused;
+};
+
+StateStandby::StateStandby(HsmUnderTest &hsm, HsmState *const superState)
+    : StateUnderTest(hsm, superState)
+    , data(hsm.storage, *this) {}
+
+StatePulsing::StatePulsing(HsmUnderTest &hsm, HsmState *const superState)
+    : StateUnderTest(hsm, superState)
+    , pulses(hsm.storage, *this) {}
+
+StateRunning::StateRunning(HsmUnderTest &hsm, HsmState *const superState)
+    : StateUnderTest(hsm, superState)
+    , data(hsm.storage, *this) {}
+
+StatePaused::StatePaused(HsmUnderTest &hsm, HsmState *const superState)
+    : StateUnderTest(hsm, superState)
+    , data(hsm.storage, *this) {}
+
+void StateTop::onInit() { hsm.initialTransition(hsm.standby); }
+
+bool StateStandby::onPulse() {
+  hsm.transition(hsm.pulsing);
+  return true;
+}
+
+void StatePulsing::onInit() { hsm.initialTransition(hsm.running); }
+bool StatePulsing::onStandby() {
+  hsm.transition(hsm.standby);
+  return true;
+}
+
+void StateRunning::onEnter() {
+  data.emplace();
+  hsm.pulsing.pulses->count++;
+}
+bool StateRunning::onTimeout() {
+  hsm.transition(hsm.paused);
+  return true;
+}
+
+bool StatePaused::onTimeout() {
+  hsm.transition(hsm.running);
+  return true;
+}
+
+//! State without a machine, for the order of the declarations
+class PlainState : public HsmState<PlainState> {
+public:
+  using HsmState::HsmState;
+};
+
+class HsmStateStorageTest : public Test {
+public:
+  HsmUnderTest hsm;
+};
+
+} // namespace
+
+TEST_F(HsmStateStorageTest, siblingsShareBytes) {
+  // Standby and Pulsing start the area, the sub states of Pulsing follow the data of Pulsing
+  EXPECT_EQ(0u, hsm.standby.data.storageOffset());
+  EXPECT_EQ(0u, hsm.pulsing.pulses.storageOffset());
+  EXPECT_GE(hsm.running.data.storageOffset(), sizeof(Pulses));
+  EXPECT_GE(hsm.paused.data.storageOffset(), sizeof(Pulses));
+  EXPECT_LT(hsm.paused.data.storageOffset(), hsm.running.data.storageOffset() + sizeof(RunningData));
+  EXPECT_EQ(hsm.running.data.storageOffset() + sizeof(RunningData), hsm.storage.size());
+  EXPECT_LT(hsm.storage.size(), sizeof(StandbyData) + sizeof(Pulses) + sizeof(RunningData) + sizeof(PausedData));
+}
+
+TEST_F(HsmStateStorageTest, dataOnlyExistsWhileActive) {
+  hsm.onStart();
+  EXPECT_TRUE(hsm.standby.data.active());
+  EXPECT_EQ(1, Tracked::alive);
+
+  hsm.onPulse();
+  EXPECT_FALSE(hsm.standby.data.active());
+  EXPECT_TRUE(hsm.pulsing.pulses.active());
+  EXPECT_TRUE(hsm.running.data.active());
+  EXPECT_EQ(2, Tracked::alive);
+
+  hsm.onTimeout();
+  hsm.onTimeout();
+  hsm.onTimeout();
+  EXPECT_TRUE(hsm.paused.data.active());
+  EXPECT_FALSE(hsm.running.data.active());
+  EXPECT_EQ(2u, hsm.pulsing.pulses->count);
+  EXPECT_EQ(2, Tracked::alive);
+
+  hsm.onStandby();
+  EXPECT_FALSE(hsm.pulsing.pulses.active());
+  EXPECT_EQ(1, Tracked::alive);
+
+  // Data of the new activation starts over
+  hsm.onPulse();
+  EXPECT_EQ(1u, hsm.pulsing.pulses->count);
+  hsm.onStandby();
+}
+
+#ifndef NDEBUG
+
+TEST(HsmStateStorageDeathTest, storageDestroyedBeforeStates) {
+  PlainState top(nullptr);
+  auto storage = std::make_unique<HsmStateStorage>();
+  HsmStateLocal<uint32_t> data(*storage, top);
+  EXPECT_DEATH(storage.reset(), "storage must be declared before the states");
+}
+
+TEST(HsmStateStorageDeathTest, subStateDataDeclaredFirst) {
+  PlainState top(nullptr);
+  PlainState sub(&top);
+  HsmStateStorage storage;
+  HsmStateLocal<uint32_t> subData(storage, sub);
+  EXPECT_DEATH(HsmStateLocal<uint32_t>(storage, top), "Super states must declare their data before");
+}
+
+#endif
@@ -0,0 +1,228 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "hsm.h"
+#include "hsm_flight_recorder.h"
+#include "hsm_trace_export.h"
+
+#include <gmock/gmock.h>
+
+#include <sstream>
+#include <string>
+
+using hsp::Hsm;
+using hsp::HsmFlightRecorderRing;
+using hsp::HsmState;
+using hsp::HsmTraceExporter;
+using hsp::HsmTraceRecord;
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+using ::testing::Test;
+
+//!
+// Machine exported to a trace
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Standby
+//   state Standby
+//   state Running {
+//     [*] --> Pumping
+//     state Pumping
+//   }
+//   Standby --> Running : run
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState, const char *stateName)
+      : HsmState(superState)
+      , hsm(hsm)
+      , stateName(stateName) {}
+
+  const char *name() const override { return stateName; }
+
+  virtual bool onRun() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+  const char *const stateName;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateStandby : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onRun() override;
+};
+
+class StateRunning : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+  friend StateTop;
+  friend StateStandby;
+  friend StateRunning;
+
+public:
+  HsmUnderTest()
+      : Hsm(top) {}
+
+  bool onRun() {
+    return onEvent([](StateUnderTest &state) { return state.onRun(); });
+  }
+
+  StateTop top{*this, nullptr, "Top"};
+  StateStandby standby{*this, &top, "Standby"};
+  StateRunning running{*this, &top, "Running"};
+  StateUnderTest pumping{*this, &running, nullptr};
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.standby); }
+
+bool StateStandby::onRun() {
+  hsm.transition(hsm.running);
+  return true;
+}
+
+void StateRunning::onInit() { hsm.initialTransition(hsm.pumping); }
+
+HsmTraceRecord record(uint64_t timestamp, uint32_t machine, HsmTraceRecord::Kind kind, uint16_t source,
+                      uint16_t target) {
+  HsmTraceRecord record = {};
+  record.timestamp = timestamp;
+  record.machine = machine;
+  record.kind = kind;
+  record.source = source;
+  record.target = target;
+  return record;
+}
+
+class HsmTraceExporterTest : public Test {
+public:
+  std::ostringstream out;
+};
+
+} // namespace
+
+TEST_F(HsmTraceExporterTest, stateSlicesAndEvents) {
+  HsmFlightRecorderRing<64> recorder;
+  HsmUnderTest hsm;
+  hsm.setFlightRecorder(&recorder, 3);
+  hsm.onStart();
+  hsm.onRun();
+
+  {
+    HsmTraceExporter exporter(out);
+    exporter.nameStates(hsm.top);
+    exporter.nameMachine(3, "pump \"3\"");
+    exporter.add(recorder);
+  }
+  const std::string json = out.str();
+
+  EXPECT_EQ(0u, json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+  EXPECT_THAT(json, HasSubstr("\"name\":\"thread_name\",\"pid\":1,\"tid\":3,\"args\":{\"name\":\"pump \\\"3\\\"\"}}"));
+  EXPECT_THAT(json, HasSubstr("{\"ph\":\"B\",\"name\":\"Top\",\"pid\":1,\"tid\":3,\"ts\":0.000}"));
+  EXPECT_THAT(json, HasSubstr("{\"ph\":\"E\",\"name\":\"Standby\""));
+  EXPECT_THAT(json, HasSubstr("{\"ph\":\"B\",\"name\":\"Running\""));
+  // Unnamed state
+  EXPECT_THAT(json, HasSubstr("{\"ph\":\"B\",\"name\":\"state 3\""));
+  EXPECT_THAT(json, HasSubstr("{\"ph\":\"i\",\"s\":\"t\",\"name\":\"onRun()\""));
+  EXPECT_THAT(json, HasSubstr("\"args\":{\"handled\":true,\"source\":\"Standby\",\"target\":\"Running\"}"));
+  EXPECT_EQ("\n]}\n", json.substr(json.size() - 4));
+}
+
+TEST_F(HsmTraceExporterTest, trackPerMachine) {
+  HsmTraceExporter exporter(out, 1000.0);
+  exporter.add(record(5000, 1, HsmTraceRecord::ENTER, hsp::HSM_TRACE_NO_STATE, 0));
+  exporter.add(record(6500, 2, HsmTraceRecord::ENTER, hsp::HSM_TRACE_NO_STATE, 0));
+  exporter.add(record(9000, 1, HsmTraceRecord::EXIT, 0, hsp::HSM_TRACE_NO_STATE));
+  exporter.finish();
+  const std::string json = out.str();
+
+  EXPECT_THAT(json, HasSubstr("\"tid\":1,\"args\":{\"name\":\"machine 1\"}}"));
+  EXPECT_THAT(json, HasSubstr("\"tid\":2,\"args\":{\"name\":\"machine 2\"}}"));
+  EXPECT_THAT(json, HasSubstr("{\"ph\":\"B\",\"name\":\"state 0\",\"pid\":1,\"tid\":2,\"ts\":1.500}"));
+  EXPECT_THAT(json, HasSubstr("{\"ph\":\"E\",\"name\":\"state 0\",\"pid\":1,\"tid\":1,\"ts\":4.000}"));
+  // One track per machine
+  EXPECT_THAT(json.substr(json.find("tid\":1,\"args") + 1), Not(HasSubstr("tid\":1,\"args")));
+}
+
+TEST_F(HsmTraceExporterTest, exitsWithoutEnterDropped) {
+  HsmTraceExporter exporter(out, 1000.0);
+  // Entered before the oldest record
+  exporter.add(record(5000, 1, HsmTraceRecord::EXIT, 1, 2));
+  exporter.add(record(6000, 1, HsmTraceRecord::ENTER, 1, 2));
+  exporter.add(record(7000, 1, HsmTraceRecord::EXIT, 2, 1));
+  exporter.add(record(8000, 1, HsmTraceRecord::EXIT, 0, hsp::HSM_TRACE_NO_STATE));
+  exporter.finish();
+  const std::string json = out.str();
+
+  EXPECT_THAT(json, HasSubstr("{\"ph\":\"E\",\"name\":\"state 2\",\"pid\":1,\"tid\":1,\"ts\":2.000}"));
+  EXPECT_THAT(json, Not(HasSubstr("\"name\":\"state 1\"")));
+  EXPECT_THAT(json, Not(HasSubstr("\"name\":\"state 0\"")));
+}
+
+TEST_F(HsmTraceExporterTest, recordsOlderThanFirst) {
+  const HsmTraceRecord records[] = {record(5000, 1, HsmTraceRecord::ENTER, 0, 1),
+                                    record(3000, 2, HsmTraceRecord::ENTER, 0, 1)};
+  {
+    HsmTraceExporter exporter(out, 1000.0);
+    exporter.add(records, 2);
+    exporter.add(record(2500, 3, HsmTraceRecord::ENTER, 0, 1));
+  }
+  const std::string json = out.str();
+
+  // The earliest record of the batch is the origin, later records may still be older
+  EXPECT_THAT(json, HasSubstr("\"tid\":1,\"ts\":2.000}"));
+  EXPECT_THAT(json, HasSubstr("\"tid\":2,\"ts\":0.000}"));
+  EXPECT_THAT(json, HasSubstr("\"tid\":3,\"ts\":-0.500}"));
+}
+
+TEST_F(HsmTraceExporterTest, correlationOfEvents) {
+  HsmTraceRecord event = record(5000, 1, HsmTraceRecord::EVENT, 0, hsp::HSM_TRACE_NO_STATE);
+  event.correlation = 42;
+  HsmTraceExporter exporter(out, 1000.0);
+  exporter.add(event);
+  exporter.finish();
+
+  EXPECT_THAT(out.str(), HasSubstr("\"target\":null,\"correlation\":42}"));
+}
+
+TEST(HsmTimestampTest, rate) { EXPECT_GT(hsp::hsmTimestampsPerMicrosecond(), 0.0); }
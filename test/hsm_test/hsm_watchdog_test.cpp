@@ -0,0 +1,265 @@
+// MIT License
+//
+// Copyright (c) 2020 Groskopf Embedded
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifdef HSM_WATCHDOG
+
+#include "hsm.h"
+#include "hsm_watchdog.h"
+
+#include <gmock/gmock.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using hsp::Hsm;
+using hsp::HsmCallback;
+using hsp::HsmState;
+using hsp::HsmWatchdog;
+
+using ::testing::HasSubstr;
+using ::testing::Test;
+
+//!
+// Machine with a slow onEnter()
+//
+// @startuml
+//
+// state Top {
+//   [*] --> Standby
+//   state Standby
+//   state Running
+//   Standby --> Running : run
+//   Running --> Standby : standby
+// }
+//
+// @enduml
+//
+
+namespace {
+
+class HsmUnderTest;
+
+class StateUnderTest : public HsmState<StateUnderTest> {
+public:
+  StateUnderTest(HsmUnderTest &hsm, HsmState *const superState)
+      : HsmState(superState)
+      , hsm(hsm) {}
+
+  virtual bool onRun() { return false; }
+  virtual bool onStandby() { return false; }
+
+protected:
+  HsmUnderTest &hsm;
+};
+
+class StateTop : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onInit() override;
+};
+
+class StateStandby : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  bool onRun() override;
+};
+
+class StateRunning : public StateUnderTest {
+public:
+  using StateUnderTest::StateUnderTest;
+  void onEnter() override;
+  bool onStandby() override;
+  const char *name() const override { return "Running"; }
+};
+
+struct RunEvent {
+  bool operator()(StateUnderTest &state) { return state.onRun(); }
+};
+struct StandbyEvent {
+  bool operator()(StateUnderTest &state) { return state.onStandby(); }
+};
+
+class HsmUnderTest : public Hsm<StateUnderTest> {
+  friend StateTop;
+  friend StateStandby;
+  friend StateRunning;
+
+public:
+  HsmUnderTest()
+      : Hsm(top) {}
+
+  bool onRun() { return onEvent(RunEvent()); }
+  bool onStandby() { return onEvent(StandbyEvent()); }
+
+  StateTop top{*this, nullptr};
+  StateStandby standby{*this, &top};
+  StateRunning running{*this, &top};
+
+  //! Time Running.onEnter() blocks, like a slow pump.on()
+  std::chrono::milliseconds enterRunning{0};
+  //! Makes Running.onEnter() return early
+  std::atomic<bool> release{false};
+};
+
+void StateTop::onInit() { hsm.initialTransition(hsm.standby); }
+
+bool StateStandby::onRun() {
+  hsm.transition(hsm.running);
+  return true;
+}
+
+void StateRunning::onEnter() {
+  const auto end = std::chrono::steady_clock::now() + hsm.enterRunning;
+  while (not hsm.release && std::chrono::steady_clock::now() < end) {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+}
+
+bool StateRunning::onStandby() {
+  hsm.transition(hsm.standby);
+  return true;
+}
+
+class HsmWatchdogTest : public Test {
+public:
+  std::mutex overrunsMutex;
+  std::vector<HsmWatchdog::Overrun> overruns;
+  HsmUnderTest hsm;
+  //! Destroyed before the machine, which detaches it
+  HsmWatchdog watchdog{[this](const HsmWatchdog::Overrun &overrun) {
+    std::lock_guard<std::mutex> lock(overrunsMutex);
+    overruns.push_back(overrun);
+    hsm.release = true;
+  }};
+};
+
+} // namespace
+
+TEST_F(HsmWatchdogTest, slowStepReported) {
+  watchdog.watch(hsm, std::chrono::milliseconds(2), 7);
+  hsm.onStart();
+  hsm.onRun();
+  hsm.onStandby();
+  EXPECT_TRUE(overruns.empty());
+
+  hsm.enterRunning = std::chrono::milliseconds(10);
+  hsm.onRun();
+  ASSERT_EQ(1u, overruns.size());
+  const HsmWatchdog::Overrun &overrun = overruns.front();
+  EXPECT_EQ(7u, overrun.machine);
+  EXPECT_FALSE(overrun.stalled);
+  // The time is attributed to Running.onEnter() and not to the handler of Standby taking the transition
+  EXPECT_EQ(hsm.running.index, overrun.state);
+  EXPECT_EQ("Running", overrun.stateName);
+  EXPECT_EQ(HsmCallback::ENTER, overrun.callback);
+  EXPECT_GE(overrun.callbackTime, std::chrono::milliseconds(9));
+  EXPECT_GE(overrun.elapsed, overrun.callbackTime);
+
+  std::ostringstream line;
+  line << overrun;
+  EXPECT_THAT(line.str(), HasSubstr("machine 7 step took"));
+  EXPECT_THAT(line.str(), HasSubstr("budget 2.0 ms, slowest Running::onEnter()"));
+
+  hsm.onStandby();
+  watchdog.unwatch(hsm);
+  hsm.release = false;
+  hsm.onRun();
+  EXPECT_EQ(1u, overruns.size());
+}
+
+TEST_F(HsmWatchdogTest, stalledStepReportedByMonitor) {
+  watchdog.watch(hsm, std::chrono::milliseconds(2));
+  hsm.onStart();
+  watchdog.startMonitor(std::chrono::milliseconds(1));
+
+  // Blocks until the monitor reports it
+  hsm.enterRunning = std::chrono::seconds(10);
+  hsm.onRun();
+  watchdog.stopMonitor();
+
+  std::lock_guard<std::mutex> lock(overrunsMutex);
+  ASSERT_EQ(2u, overruns.size());
+  EXPECT_TRUE(overruns[0].stalled);
+  EXPECT_EQ(hsm.running.index, overruns[0].state);
+  EXPECT_EQ(HsmCallback::ENTER, overruns[0].callback);
+  EXPECT_LT(overruns[0].elapsed, std::chrono::seconds(5));
+
+  std::ostringstream line;
+  line << overruns[0];
+  EXPECT_THAT(line.str(), HasSubstr("machine 0 stalled in Running::onEnter() for "));
+
+  // And by the machine thread when the step completed
+  EXPECT_FALSE(overruns[1].stalled);
+  EXPECT_EQ(hsm.running.index, overruns[1].state);
+}
+
+TEST_F(HsmWatchdogTest, reporterWatchesMachines) {
+  HsmUnderTest other;
+  bool otherWatched = false;
+  HsmWatchdog reentrant([&](const HsmWatchdog::Overrun &) {
+    // Would deadlock if the monitor reported under its lock
+    if (not otherWatched) {
+      reentrant.watch(other, std::chrono::milliseconds(2));
+      otherWatched = true;
+    }
+    hsm.release = true;
+  });
+  reentrant.watch(hsm, std::chrono::milliseconds(2));
+  hsm.onStart();
+  reentrant.startMonitor(std::chrono::milliseconds(1));
+
+  hsm.enterRunning = std::chrono::seconds(10);
+  hsm.onRun();
+  reentrant.stopMonitor();
+  EXPECT_TRUE(otherWatched);
+}
+
+TEST(HsmWatchdogOverrunTest, outlivesMachine) {
+  std::vector<HsmWatchdog::Overrun> overruns;
+  HsmWatchdog watchdog([&](const HsmWatchdog::Overrun &overrun) { overruns.push_back(overrun); });
+  {
+    HsmUnderTest hsm;
+    watchdog.watch(hsm, std::chrono::milliseconds(2));
+    hsm.onStart();
+    hsm.enterRunning = std::chrono::milliseconds(10);
+    hsm.onRun();
+    watchdog.unwatch(hsm);
+  }
+
+  ASSERT_EQ(1u, overruns.size());
+  std::ostringstream line;
+  line << overruns[0];
+  EXPECT_THAT(line.str(), HasSubstr("slowest Running::onEnter()"));
+}
+
+TEST_F(HsmWatchdogTest, checkWithoutMonitor) {
+  watchdog.watch(hsm, std::chrono::milliseconds(2));
+  EXPECT_EQ(0u, watchdog.check());
+  hsm.onStart();
+  EXPECT_EQ(0u, watchdog.check());
+}
+
+#endif